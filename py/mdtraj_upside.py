@@ -6,6 +6,7 @@ import mdtraj.core.element as el
 import mdtraj as md
 
 from mdtraj.formats.registry import FormatRegistry
+from run_upside import output_pos as _output_pos
 angstrom=0.1  # conversion to nanometer from angstrom
 
 aa_conv_dict = {"A": "ALA", "R": "ARG", "N": "ASN", "D": "ASP", "C": "CYS", "E": "GLU",
@@ -153,10 +154,11 @@ def load_upside_traj(fname, stride=1, from_init=False, fasta_fn='', chain_breaks
                     # take into account that the first frame of each pos is the same as the last frame before restart
                     # attempt to land on the stride
                     sl = slice(start_frame,None,stride)
-                    xyz.append(g.pos[sl,0])
+                    pos = _output_pos(g)
+                    xyz.append(pos[sl,0])
                     time.append(g.time[sl]+last_time)
                     last_time = g.time[-1]+last_time
-                    total_frames_produced += g.pos.shape[0]-(1 if g_no else 0)  # correct for first frame
+                    total_frames_produced += pos.shape[0]-(1 if g_no else 0)  # correct for first frame
                     start_frame = 1 + stride*(total_frames_produced%stride>0) - total_frames_produced%stride
         
             seq = t.root.input.sequence[:]
@@ -192,10 +194,11 @@ def load_upside_rep(fnames, rep_select, stride=1):
                     # take into account that the first frame of each pos is the same as the last frame before restart
                     # attempt to land on the stride
                     sl = slice(start_frame,None,stride)
-                    xyz.append(g.pos[sl,0])
+                    pos = _output_pos(g)
+                    xyz.append(pos[sl,0])
                     time.append(g.time[sl]+last_time)
                     last_time = g.time[-1]+last_time
-                    total_frames_produced += g.pos.shape[0]-(1 if g_no else 0)  # correct for first frame
+                    total_frames_produced += pos.shape[0]-(1 if g_no else 0)  # correct for first frame
                     start_frame = 1 + stride*(total_frames_produced%stride>0) - total_frames_produced%stride
                 xyz = np.concatenate(xyz,axis=0)
                 time = np.concatenate(time,axis=0)
@@ -216,9 +219,10 @@ def load_upside_rep(fnames, rep_select, stride=1):
                     # take into account that the first frame of each pos is the same as the last frame before restart
                     # attempt to land on the stride
                     sl = slice(start_frame,None,stride)
-                    xyz2.append(g.pos[sl,0])
+                    pos = _output_pos(g)
+                    xyz2.append(pos[sl,0])
                     replica_idx.append(g.replica_index[sl,0])
-                    total_frames_produced += g.pos.shape[0]-(1 if g_no else 0)  # correct for first frame
+                    total_frames_produced += pos.shape[0]-(1 if g_no else 0)  # correct for first frame
                     start_frame = 1 + stride*(total_frames_produced%stride>0) - total_frames_produced%stride
             xyz2 = np.concatenate(xyz2, axis=0)
             replica_idx = np.concatenate(replica_idx, axis=0)
@@ -279,17 +283,21 @@ def compute_upside_values(config_path, traj, outputs=dict(), named_values=dict()
 
     engine = ue.Upside(config_path)
     assert engine.n_atom == pos.shape[1]
-    for x in pos:
-        # must compute energy before any other quantities
-        ret['energy'].append(engine.energy(x))
+    if not outputs and not named_values:
+        # energies alone can be computed for all frames in parallel
+        ret['energy'] = list(engine.evaluate_frames(pos)[0])
+    else:
+        for x in pos:
+            # must compute energy before any other quantities
+            ret['energy'].append(engine.energy(x))
 
-        for nm, node_name in outputs.items():
-            ret[nm].append(engine.get_output(node_name))
+            for nm, node_name in outputs.items():
+                ret[nm].append(engine.get_output(node_name))
 
-        for nm, (value_shape, node_name, log_name) in named_values.items():
-            ret[nm].append(
-                    engine.get_value_by_name(
-                        value_shape, node_name, log_name))
+            for nm, (value_shape, node_name, log_name) in named_values.items():
+                ret[nm].append(
+                        engine.get_value_by_name(
+                            value_shape, node_name, log_name))
     for k,v in ret.items():
         ret[k] = np.stack(v, axis=0)
 
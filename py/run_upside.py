@@ -163,6 +163,7 @@ def run_upside(queue, config, duration, frame_interval, time_limit=None, n_threa
                replica_interval=None, anneal_factor=1., anneal_duration=-1., mc_interval=None, 
                time_step = None, swap_sets = None,
                log_level='basic', account=None, disable_recentering=False,
+               checkpoint_interval=None, restart_from=None, pos_precision=None,
                extra_args=[], verbose=True):
     if isinstance(config,str): config = [config]
     
@@ -193,6 +194,13 @@ def run_upside(queue, config, duration, frame_interval, time_limit=None, n_threa
         upside_args.extend(['--time-step', str(time_step)])
     if disable_recentering:
         upside_args.extend(['--disable-recentering'])
+    if checkpoint_interval is not None:
+        upside_args.extend(['--checkpoint-interval', '%f'%checkpoint_interval])
+    if pos_precision is not None:
+        upside_args.extend(['--pos-precision', '%g'%pos_precision])
+    if restart_from is not None:
+        # the seed is read from the checkpoint
+        upside_args.extend(['--restart-from', restart_from])
 
     upside_args.extend(['--seed','%li'%(seed if seed is not None else np.random.randint(1<<31))])
     upside_args.extend(extra_args)
@@ -251,6 +259,20 @@ def run_upside(queue, config, duration, frame_interval, time_limit=None, n_threa
     return UpsideJob(job,config,output_path, timer_object=timer_object)
 
 
+def output_pos(g):
+    """Positions (n_frame,1,n_atom,3) of an output group, decoding pos_quantized if present"""
+    if 'pos' in g:
+        return g.pos[:]
+    # zigzag coded fixed point values, which are differences from the previous frame
+    # except at the start of each block of keyframe_interval frames
+    node = g.pos_quantized
+    z = node[:].astype('u4')
+    x = (z>>1).astype('i8') ^ -(z&1).astype('i8')
+    k = int(node._v_attrs.keyframe_interval)
+    for start in range(0, x.shape[0], k):
+        np.cumsum(x[start:start+k], axis=0, out=x[start:start+k])
+    return (x*float(node._v_attrs.precision)).astype('f4')
+
 def continue_sim(partition, configs, duration, frame_interval, **upside_kwargs):
     upside_kwargs = dict(upside_kwargs)
     temps = []
@@ -266,7 +288,7 @@ def continue_sim(partition, configs, duration, frame_interval, **upside_kwargs):
             else:
                 n = t.get_node('/output_previous_%i'%(i-1))
 
-            t.root.input.pos[:,:,0] = n.pos[-1,0]
+            t.root.input.pos[:,:,0] = output_pos(n)[-1,0]
             temps.append(n.temperature[-1,0])
 
             if 'output' in t.root:
@@ -295,8 +317,9 @@ def read_output(t, output_name, stride):
         # take into account that the first frame of each output is the same as the last frame before restart
         # attempt to land on the stride
         sl = slice(start_frame,None,stride)
-        output.append(g._f_get_child(output_name)[sl,:])
-        total_frames_produced += g._f_get_child(output_name).shape[0]-(1 if g_no else 0)  # correct for first frame
+        values = output_pos(g) if output_name=='pos' else g._f_get_child(output_name)
+        output.append(values[sl,:])
+        total_frames_produced += values.shape[0]-(1 if g_no else 0)  # correct for first frame
         start_frame = 1 + stride*(total_frames_produced%stride>0) - total_frames_produced%stride
     output = np.concatenate(output,axis=0)
     return output
@@ -1431,6 +1431,12 @@ def main():
 
     parser.add_argument('--debugging-only-disable-basic-springs', default=False, action='store_true',
             help='Disable basic springs (like bond distance and angle).  Do not use this.')
+    parser.add_argument('--fused-bonded-terms', default=False, action='store_true',
+            help='Evaluate the bond, angle, and dihedral springs (and atom position springs) in a single '+
+            'vectorized "bonded" node rather than as separate nodes.')
+    parser.add_argument('--slow-force-group', default='',
+            help='Comma-separated list of potential nodes (such as rotamer,environment_energy) to evaluate '+
+            'only every --respa-interval time steps in multiple time step integration.')
 
     args = parser.parse_args()
     if args.restraint_group and not args.initial_structure:
@@ -1742,6 +1748,19 @@ def main():
         make_offset_spring(parser, args.offset_spring)
 
 
+    if args.fused_bonded_terms:
+        bonded = t.create_group(potential, 'bonded')
+        bonded._v_attrs.arguments = np.array(['pos'])
+        for node_name in ['atom_pos_spring', 'dist_spring', 'angle_spring', 'dihedral_spring']:
+            if node_name in potential:
+                t.move_node(potential._f_get_child(node_name), newparent=bonded)
+
+    if args.slow_force_group:
+        for node_name in args.slow_force_group.split(','):
+            if node_name not in potential:
+                parser.error('--slow-force-group node %s is not in the potential' % node_name)
+            potential._f_get_child(node_name)._v_attrs.force_group = 1
+
     # if we have the necessary information, write pivot_sampler
     if require_rama and 'rama_map_pot' in potential:
         grp = t.create_group(input, 'pivot_moves')
@@ -24,12 +24,30 @@ calc.construct_deriv_engine.argtypes = [ct.c_int, ct.c_char_p, ct.c_bool]
 calc.free_deriv_engine.restype  = None
 calc.free_deriv_engine.argtypes = [ct.c_void_p]
 
+calc.clone_deriv_engine.restype  = ct.c_void_p
+calc.clone_deriv_engine.argtypes = [ct.c_void_p]
+
 calc.evaluate_energy.restype  = ct.c_int
 calc.evaluate_energy.argtypes = [ct.c_void_p, ct.c_void_p, ct.c_void_p]
 
 calc.evaluate_deriv.restype  = ct.c_int
 calc.evaluate_deriv.argtypes = [ct.c_void_p, ct.c_void_p, ct.c_void_p]
 
+calc.construct_engine_pool.restype  = ct.c_void_p
+calc.construct_engine_pool.argtypes = [ct.c_void_p, ct.c_int]
+
+calc.free_engine_pool.restype  = None
+calc.free_engine_pool.argtypes = [ct.c_void_p]
+
+calc.evaluate_frames.restype  = ct.c_int
+calc.evaluate_frames.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p, ct.c_void_p, ct.c_void_p, ct.c_void_p]
+
+calc.get_n_potential_node.restype  = ct.c_int
+calc.get_n_potential_node.argtypes = [ct.c_void_p, ct.c_void_p]
+
+calc.get_potential_node_name.restype  = ct.c_int
+calc.get_potential_node_name.argtypes = [ct.c_int, ct.c_char_p, ct.c_void_p, ct.c_int]
+
 calc.set_param.restype  = ct.c_int
 calc.set_param.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p, ct.c_char_p]
 
@@ -165,10 +183,26 @@ class Upside(object):
             self.sequence = t.root.input.sequence[:]
         self.engine = calc.construct_deriv_engine(self.n_atom, self.config_file_path, bool(quiet))
         if self.engine is None: raise RuntimeError('Unable to initialize upside engine for %s'%(config_file_path,))
+        self.pool = None
+        self.n_pool_thread = 0
 
     def __repr__(self):
         return 'Upside(%r, %r)'%(self.n_atom, self.config_file_path)
 
+    def clone(self):
+        '''Independent copy of the engine, including its current parameters, that
+        does not read the configuration file again'''
+        other = Upside.__new__(Upside)
+        other.config_file_path = self.config_file_path
+        other.initial_pos = self.initial_pos
+        other.n_atom = self.n_atom
+        other.sequence = self.sequence
+        other.engine = calc.clone_deriv_engine(self.engine)
+        if other.engine is None: raise RuntimeError('Unable to clone upside engine')
+        other.pool = None
+        other.n_pool_thread = 0
+        return other
+
     def energy(self, pos):
         pos = np.require(pos, dtype='f4', requirements='C')
         assert pos.shape == (self.n_atom,3)
@@ -185,6 +219,47 @@ class Upside(object):
         if retcode: raise RuntimeError('Unable to evaluate derivative')
         return deriv
 
+    def potential_node_names(self):
+        n_node = np.zeros(1,dtype=np.intc)
+        calc.get_n_potential_node(n_node.ctypes.data, self.engine)
+        names = []
+        for i in range(int(n_node[0])):
+            buf = ct.create_string_buffer(1024)
+            if calc.get_potential_node_name(len(buf), buf, self.engine, i):
+                raise RuntimeError('Unable to get potential node name')
+            names.append(buf.value)
+        return names
+
+    def evaluate_frames(self, pos, deriv=False, n_thread=None):
+        '''Evaluate the energy of each frame of pos, shape (n_frame,n_atom,3), using
+        n_thread engines in parallel.  Returns the energies (n_frame,), a dictionary of
+        the energy of each potential node (n_frame,), and the derivatives
+        (n_frame,n_atom,3) if deriv is True.  Parameters set with set_param are used by
+        the parallel engines.'''
+        import multiprocessing
+        pos = np.require(pos, dtype='f4', requirements='C')
+        assert len(pos.shape) == 3 and pos.shape[1:] == (self.n_atom,3)
+        n_frame = pos.shape[0]
+
+        if n_thread is None: n_thread = multiprocessing.cpu_count()
+        n_thread = max(1, min(int(n_thread), n_frame))
+        if self.pool is None or self.n_pool_thread != n_thread:
+            if self.pool is not None: calc.free_engine_pool(self.pool)
+            self.pool = calc.construct_engine_pool(self.engine, n_thread)
+            if self.pool is None: raise RuntimeError('Unable to construct engine pool')
+            self.n_pool_thread = n_thread
+
+        names = self.potential_node_names()
+        energy      = np.zeros((n_frame,), dtype='f4')
+        node_energy = np.zeros((n_frame,len(names)), dtype='f4')
+        deriv_array = np.zeros(pos.shape, dtype='f4') if deriv else None
+        retcode = calc.evaluate_frames(n_frame, energy.ctypes.data, node_energy.ctypes.data,
+                deriv_array.ctypes.data if deriv else None, self.pool, pos.ctypes.data)
+        if retcode: raise RuntimeError('Unable to evaluate frames')
+
+        node_energy = dict((nm,node_energy[:,i]) for i,nm in enumerate(names))
+        return (energy, node_energy, deriv_array) if deriv else (energy, node_energy)
+
     def set_param(self, param, node_name):
         param_size = param.shape
         param = np.require(param.ravel(), dtype='f4', requirements='C')  # flatten and make contiguous
@@ -239,6 +314,7 @@ class Upside(object):
         return value
 
     def __del__(self):
+        if self.pool is not None: calc.free_engine_pool(self.pool)
         calc.free_deriv_engine(self.engine)
 
 def get_rotamer_graph(engine):
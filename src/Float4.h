@@ -6,6 +6,8 @@
 #include <xmmintrin.h>
 #include <smmintrin.h>
 #include <immintrin.h>
+#include <cstdint>
+#include <cstdlib>
     
 enum class Alignment {unaligned, aligned};
 
@@ -322,64 +324,231 @@ struct alignas(16) Float4
         friend inline Float4 horizontal_add(const Float4& x1, const Float4& x2);
 };
 
-/*
+// Wider vector types
+//
+// Float8/Int8 (AVX2) and Float16/Int16 (AVX-512F) provide the subset of the Float4/Int4
+// interface needed by the wide kernels.  All of their members carry target attributes,
+// so they may be compiled into a binary whose baseline is only SSE4.  They must only be
+// used from functions with the same target attribute, and those functions must only be
+// called when runtime_simd_width() reports support.
+
+#define SIMD_TARGET_AVX2   __attribute__((target("avx2,fma,bmi2")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f")))
+
+//! Widest vector width (in floats) supported by this processor: 4, 8, or 16
+//!
+//! The environment variable UPSIDE_SIMD_WIDTH may lower the width (useful for testing).
+inline int runtime_simd_width() {
+    static const int width = [] {
+        int w = 4;
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("bmi2")) w = 8;
+        if(__builtin_cpu_supports("avx512f")) w = 16;
+        const char* requested = getenv("UPSIDE_SIMD_WIDTH");
+        if(requested) {
+            int r = atoi(requested);
+            if(r==4 || r==8 || r==16) w = r<w ? r : w;
+        }
+        return w;
+    }();
+    return width;
+}
+
+struct Float8;
+
+struct alignas(32) Int8
+{
+    protected:
+        __m256i vec;
+        SIMD_TARGET_AVX2 Int8(__m256i vec_): vec(vec_) {};
+
+    public:
+        SIMD_TARGET_AVX2 Int8(): vec(_mm256_setzero_si256()) {}
+
+        SIMD_TARGET_AVX2 explicit Int8(const int32_t* vec_, Alignment align = Alignment::aligned):
+            vec(align==Alignment::aligned ? _mm256_load_si256((const __m256i*)vec_) 
+                                          : _mm256_loadu_si256((const __m256i*)vec_)) {}
+
+        SIMD_TARGET_AVX2 explicit Int8(const int val): vec(_mm256_set1_epi32(val)) {}
+
+        SIMD_TARGET_AVX2 Int8 left_pack(int mask) const {
+            // expand each bit of mask to a byte, then extract the indices of the set bits
+            uint64_t expanded_mask = _pdep_u64(mask, 0x0101010101010101ull) * 0xffu;
+            uint64_t indices = _pext_u64(0x0706050403020100ull, expanded_mask);
+            __m256i control = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(indices));
+            return Int8(_mm256_permutevar8x32_epi32(vec, control));
+        }
+
+        SIMD_TARGET_AVX2 Int8 operator+ (const Int8 &o) const {return Int8(_mm256_add_epi32  (vec, o.vec));}
+        SIMD_TARGET_AVX2 Int8 operator- (const Int8 &o) const {return Int8(_mm256_sub_epi32  (vec, o.vec));}
+        SIMD_TARGET_AVX2 Int8 operator* (const Int8 &o) const {return Int8(_mm256_mullo_epi32(vec, o.vec));}
+        SIMD_TARGET_AVX2 Int8 operator==(const Int8 &o) const {return Int8(_mm256_cmpeq_epi32 (vec, o.vec));}
+        SIMD_TARGET_AVX2 Int8 operator& (const Int8 &o) const {return Int8(_mm256_and_si256  (vec, o.vec));}
+        SIMD_TARGET_AVX2 Int8 operator| (const Int8 &o) const {return Int8(_mm256_or_si256   (vec, o.vec));}
+
+        SIMD_TARGET_AVX2 bool any () const {return !_mm256_testz_si256(vec,vec);}
+        SIMD_TARGET_AVX2 bool none() const {return  _mm256_testz_si256(vec,vec);}
+        SIMD_TARGET_AVX2 int movemask() const {return _mm256_movemask_ps(_mm256_castsi256_ps(vec));}
+
+        SIMD_TARGET_AVX2 void store(int32_t* vec_, Alignment align=Alignment::aligned) const { 
+            if(align==Alignment::aligned) 
+                _mm256_store_si256 ((__m256i*)vec_, vec); 
+            else 
+                _mm256_storeu_si256((__m256i*)vec_, vec);
+        }
+
+        friend Float8;
+};
+
 struct alignas(32) Float8 
 {
     protected:
         __m256 vec;
-        Float8(__m256 vec_):
-            vec(vec_)
-        {};
+        SIMD_TARGET_AVX2 Float8(__m256 vec_): vec(vec_) {};
 
     public:
-        Float8(): vec(_mm256_setzero_ps()) {}
+        SIMD_TARGET_AVX2 Float8(): vec(_mm256_setzero_ps()) {}
 
-        // constructor from aligned storage
-        explicit Float8(const float* vec, Alignment align = Alignment::aligned):
-            vec(align==Alignment::aligned ? _mm256_load_ps(vec) : _mm256_loadu_ps(vec)) {}
+        SIMD_TARGET_AVX2 explicit Float8(const float* vec_, Alignment align = Alignment::aligned):
+            vec(align==Alignment::aligned ? _mm256_load_ps(vec_) : _mm256_loadu_ps(vec_)) {}
 
-        // broadcast constructor
-        Float8(float val):   
-            vec(_mm256_broadcast_ps(val)) {}
-
-        Float8 operator+(const Float8 &o) const {return Float8(_mm256_add_ps  (vec, o.vec));}
-        Float8 operator-(const Float8 &o) const {return Float8(_mm256_sub_ps  (vec, o.vec));}
-        Float8 operator*(const Float8 &o) const {return Float8(_mm256_mul_ps  (vec, o.vec));}
-        Float8 operator<(const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_LT_OQ));}
-        Float8 operator!=(const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_NEQ_OQ));}
-        Float8 operator==(const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_EQ_OQ));}
-        Float8 operator&(const Float8 &o) const {return Float8(_mm256_and_ps(vec,o.vec));}
-        Float8 operator|(const Float8 &o) const {return Float8(_mm256_or_ps(vec,o.vec));}
-        Float8 sqrt() const {return Float8(_mm256_sqrt_ps(vec));}
-
-        Float8 operator+=(const Float8 &o) {return vec = _mm256_add_ps(vec, o.vec);}
-        Float8 operator-=(const Float8 &o) {return vec = _mm256_sub_ps(vec, o.vec);}
-        Float8 operator*=(const Float8 &o) {return vec = _mm256_mul_ps(vec, o.vec);}
-
-        // int movemask() {return _mm256_movemask_ps(vec);}
-        // bool any() {return movemask();}
+        SIMD_TARGET_AVX2 Float8(const float val): vec(_mm256_set1_ps(val)) {}
 
-        void store(float* vec_, Alignment align=Alignment::aligned) const { 
+        // gather constructor from offsets (in units of floats)
+        SIMD_TARGET_AVX2 Float8(const float* base, const Int8& offsets):
+            vec(_mm256_i32gather_ps(base, offsets.vec, 4)) {}
+
+        SIMD_TARGET_AVX2 Float8 operator+ (const Float8 &o) const {return Float8(_mm256_add_ps(vec, o.vec));}
+        SIMD_TARGET_AVX2 Float8 operator- (const Float8 &o) const {return Float8(_mm256_sub_ps(vec, o.vec));}
+        SIMD_TARGET_AVX2 Float8 operator* (const Float8 &o) const {return Float8(_mm256_mul_ps(vec, o.vec));}
+        SIMD_TARGET_AVX2 Float8 operator< (const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_LT_OQ));}
+        SIMD_TARGET_AVX2 Float8 operator<=(const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_LE_OQ));}
+        SIMD_TARGET_AVX2 Float8 operator& (const Float8 &o) const {return Float8(_mm256_and_ps(vec, o.vec));}
+        SIMD_TARGET_AVX2 Float8 operator| (const Float8 &o) const {return Float8(_mm256_or_ps (vec, o.vec));}
+
+        SIMD_TARGET_AVX2 Float8 operator+=(const Float8 &o) {return vec = _mm256_add_ps(vec, o.vec);}
+        SIMD_TARGET_AVX2 Float8 operator-=(const Float8 &o) {return vec = _mm256_sub_ps(vec, o.vec);}
+        SIMD_TARGET_AVX2 Float8 operator*=(const Float8 &o) {return vec = _mm256_mul_ps(vec, o.vec);}
+
+        SIMD_TARGET_AVX2 Float8 sqrt() const {return Float8(_mm256_sqrt_ps(vec));}
+
+        SIMD_TARGET_AVX2 int movemask() const {return _mm256_movemask_ps(vec);}
+        SIMD_TARGET_AVX2 bool none() const {return  _mm256_testz_ps(vec,vec);}
+        SIMD_TARGET_AVX2 bool any () const {return !none();}
+
+        SIMD_TARGET_AVX2 Int8 cast_int() const {return Int8(_mm256_castps_si256(vec));}
+
+        SIMD_TARGET_AVX2 void store(float* vec_, Alignment align=Alignment::aligned) const { 
             if(align==Alignment::aligned) 
                 _mm256_store_ps(vec_, vec); 
             else 
                 _mm256_storeu_ps(vec_,vec);
         }
 
+        friend inline Float8 fmadd(const Float8& a1, const Float8& a2, const Float8& b);
+};
 
-        Float8 swap_halves() const {return Float8(_mm256_permute2f128_ps(vec,vec,1));}
+SIMD_TARGET_AVX2 inline Float8 fmadd(const Float8& a1, const Float8& a2, const Float8& b) {
+    return Float8(_mm256_fmadd_ps(a1.vec, a2.vec, b.vec));
+}
 
-        float sum() const {
-            __m256 half_sum = _mm256_add_ps(vec, swap_halves().vec);
-            __m256 x = _mm256_hadd_ps(half_sum, half_sum);
-            x = _mm256_hadd_ps(x, x);
+struct Float16;
+
+// AVX-512 comparisons produce bit masks rather than vectors, so comparisons return a
+// Mask16 that supports the same movemask/any/none queries and left_pack is a compress
+struct Mask16 {
+    __mmask16 mask;
+    explicit Mask16(__mmask16 mask_): mask(mask_) {}
+    int  movemask() const {return mask;}
+    bool any () const {return mask!=0;}
+    bool none() const {return mask==0;}
+    Mask16 operator&(const Mask16& o) const {return Mask16(mask & o.mask);}
+    Mask16 operator|(const Mask16& o) const {return Mask16(mask | o.mask);}
+};
 
-            float ret;
-            _mm_store_ss(&ret, _mm256_castps256_ps128(x));
-            return ret;
+struct alignas(64) Int16
+{
+    protected:
+        __m512i vec;
+        SIMD_TARGET_AVX512 Int16(__m512i vec_): vec(vec_) {};
+
+    public:
+        SIMD_TARGET_AVX512 Int16(): vec(_mm512_setzero_si512()) {}
+
+        SIMD_TARGET_AVX512 explicit Int16(const int32_t* vec_, Alignment align = Alignment::aligned):
+            vec(align==Alignment::aligned ? _mm512_load_si512(vec_) : _mm512_loadu_si512(vec_)) {}
+
+        SIMD_TARGET_AVX512 explicit Int16(const int val): vec(_mm512_set1_epi32(val)) {}
+
+        SIMD_TARGET_AVX512 Int16 left_pack(int mask) const {
+            return Int16(_mm512_maskz_compress_epi32(__mmask16(mask), vec));
+        }
+
+        SIMD_TARGET_AVX512 Int16 operator+ (const Int16 &o) const {return Int16(_mm512_add_epi32  (vec, o.vec));}
+        SIMD_TARGET_AVX512 Int16 operator- (const Int16 &o) const {return Int16(_mm512_sub_epi32  (vec, o.vec));}
+        SIMD_TARGET_AVX512 Int16 operator* (const Int16 &o) const {return Int16(_mm512_mullo_epi32(vec, o.vec));}
+        SIMD_TARGET_AVX512 Mask16 operator==(const Int16 &o) const {return Mask16(_mm512_cmpeq_epi32_mask(vec, o.vec));}
+        SIMD_TARGET_AVX512 Mask16 operator< (const Int16 &o) const {return Mask16(_mm512_cmplt_epi32_mask(vec, o.vec));}
+
+        SIMD_TARGET_AVX512 void store(int32_t* vec_, Alignment align=Alignment::aligned) const { 
+            if(align==Alignment::aligned) 
+                _mm512_store_si512(vec_, vec); 
+            else 
+                _mm512_storeu_si512(vec_, vec);
+        }
+
+        // store only the elements selected by mask contiguously at vec_ (unaligned)
+        SIMD_TARGET_AVX512 void compress_store(int32_t* vec_, int mask) const {
+            _mm512_mask_compressstoreu_epi32(vec_, __mmask16(mask), vec);
+        }
+
+        friend Float16;
+};
+
+struct alignas(64) Float16
+{
+    protected:
+        __m512 vec;
+        SIMD_TARGET_AVX512 Float16(__m512 vec_): vec(vec_) {};
+
+    public:
+        SIMD_TARGET_AVX512 Float16(): vec(_mm512_setzero_ps()) {}
+
+        SIMD_TARGET_AVX512 explicit Float16(const float* vec_, Alignment align = Alignment::aligned):
+            vec(align==Alignment::aligned ? _mm512_load_ps(vec_) : _mm512_loadu_ps(vec_)) {}
+
+        SIMD_TARGET_AVX512 Float16(const float val): vec(_mm512_set1_ps(val)) {}
+
+        // gather constructor from offsets (in units of floats)
+        // (masked form with a zero source, since the unmasked intrinsic starts from an
+        // undefined register and trips -Wmaybe-uninitialized)
+        SIMD_TARGET_AVX512 Float16(const float* base, const Int16& offsets):
+            vec(_mm512_mask_i32gather_ps(_mm512_setzero_ps(), __mmask16(0xffff), offsets.vec, base, 4)) {}
+
+        SIMD_TARGET_AVX512 Float16 operator+ (const Float16 &o) const {return Float16(_mm512_add_ps(vec, o.vec));}
+        SIMD_TARGET_AVX512 Float16 operator- (const Float16 &o) const {return Float16(_mm512_sub_ps(vec, o.vec));}
+        SIMD_TARGET_AVX512 Float16 operator* (const Float16 &o) const {return Float16(_mm512_mul_ps(vec, o.vec));}
+        SIMD_TARGET_AVX512 Mask16  operator< (const Float16 &o) const {return Mask16(_mm512_cmp_ps_mask(vec,o.vec,_CMP_LT_OQ));}
+        SIMD_TARGET_AVX512 Mask16  operator<=(const Float16 &o) const {return Mask16(_mm512_cmp_ps_mask(vec,o.vec,_CMP_LE_OQ));}
+
+        SIMD_TARGET_AVX512 Float16 operator+=(const Float16 &o) {return vec = _mm512_add_ps(vec, o.vec);}
+        SIMD_TARGET_AVX512 Float16 operator-=(const Float16 &o) {return vec = _mm512_sub_ps(vec, o.vec);}
+        SIMD_TARGET_AVX512 Float16 operator*=(const Float16 &o) {return vec = _mm512_mul_ps(vec, o.vec);}
+
+        SIMD_TARGET_AVX512 Float16 sqrt() const {return Float16(_mm512_sqrt_ps(vec));}
+
+        SIMD_TARGET_AVX512 void store(float* vec_, Alignment align=Alignment::aligned) const { 
+            if(align==Alignment::aligned) 
+                _mm512_store_ps(vec_, vec); 
+            else 
+                _mm512_storeu_ps(vec_,vec);
         }
+
+        friend inline Float16 fmadd(const Float16& a1, const Float16& a2, const Float16& b);
 };
-*/
+
+SIMD_TARGET_AVX512 inline Float16 fmadd(const Float16& a1, const Float16& a2, const Float16& b) {
+    return Float16(_mm512_fmadd_ps(a1.vec, a2.vec, b.vec));
+}
 
 static void print_vector(const char* nm, const Float4& val) {
     printf("%s % .2f % .2f % .2f % .2f\n", nm, val.x(), val.y(), val.z(), val.w());
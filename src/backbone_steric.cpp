@@ -15,9 +15,10 @@ namespace {
 
 constexpr float nonbonded_atom_cutoff2 = 3.f*3.f + 0.1f*3.f;
 
-template <bool return_deriv>
-inline float
-nonbonded_kernel_or_deriv_over_r(float r_mag2)
+// value and derivative over r of the steric repulsion, for float or Float4 arguments
+template <typename S>
+inline Vec<2,S>
+nonbonded_kernel_and_deriv_over_r(const S& r_mag2)
 {
     const float energy_scale = 4.f;
     const float wall = 3.0f;  // corresponds to vdW *diameter*
@@ -25,8 +26,14 @@ nonbonded_kernel_or_deriv_over_r(float r_mag2)
     const float width = 0.10f;
     const float sharpness = 1.f/(wall*width);  // ensure character
 
-    const float2 V = energy_scale*compact_sigmoid(r_mag2-wall_squared, sharpness);
-    return return_deriv ? 2.f*V.y() : V.x();
+    const Vec<2,S> V = compact_sigmoid(r_mag2-S(wall_squared), S(sharpness));
+    return make_vec2(S(energy_scale)*V.x(), S(2.f*energy_scale)*V.y());
+}
+
+inline float sum_lanes(const Float4& x) {
+    alignas(16) float v[4];
+    x.store(v);
+    return (v[0]+v[1]) + (v[2]+v[3]);
 }
 
 Int4 acceptable_backbone_pair(const Int4& id1, const Int4& id2) {
@@ -37,66 +44,126 @@ Int4 acceptable_backbone_pair(const Int4& id1, const Int4& id2) {
 
 struct BackbonePairs : public PotentialNode
 {
-    struct RefPos {
-        int32_t n_atom;
-        float3  pos[4];
-    };
-
     int n_residue;
-    CoordNode& alignment;
+    FrameNode& alignment;
     vector<AffineParams> params;
-    vector<RefPos> ref_pos;
     PairlistComputation<true> pairlist;
     unique_ptr<int32_t[]> id;
     float dist_cutoff;
 
+    // Per residue blocks of 4 atoms by component, (n_residue,3,4), so that the atoms of
+    // a residue fill the lanes of a Float4.  Missing atoms are excluded by atom_present.
+    unique_ptr<float[]>   ref_pos;     // in the residue frame
+    unique_ptr<float[]>   atom_pos;    // placed, recomputed on each evaluation
+    unique_ptr<float[]>   atom_present;  // (n_residue,4), 1 for existing atoms and 0 for missing
+    VecArrayStorage coords;            // frame centers for the pairlist
+
     BackbonePairs(hid_t grp, CoordNode& alignment_):
         PotentialNode(),
-        n_residue(get_dset_size(1, grp, "id")[0]), alignment(alignment_), 
-        params(n_residue), ref_pos(n_residue),
+        n_residue(get_dset_size(1, grp, "id")[0]), alignment(as_frame_node(alignment_)), 
+        params(n_residue),
         pairlist(n_residue, n_residue, (n_residue*(n_residue-1))/2),
-        id(new_aligned<int32_t>(n_residue,16))
+        id(new_aligned<int32_t>(n_residue,16)),
+        ref_pos  (new_aligned<float>  (n_residue*12, 4)),
+        atom_pos (new_aligned<float>  (n_residue*12, 4)),
+        atom_present(new_aligned<float>(n_residue*4, 4)),
+        coords(3, round_up(n_residue,4))
     {
-        check_elem_width(alignment, 7);
-
         check_size(grp, "id",      n_residue);
         check_size(grp, "n_atom",  n_residue);
         check_size(grp, "ref_pos", n_residue, 4, 3);
 
         traverse_dset<1,int>(grp, "id",     [&](size_t nr, int x) {params[nr].residue = x; id[nr]=x;});
-        traverse_dset<1,int>(grp, "n_atom", [&](size_t nr, int x) {ref_pos[nr].n_atom = x;});
+        traverse_dset<1,int>(grp, "n_atom", [&](size_t nr, int x) {
+                for(int na: range(4)) atom_present[nr*4+na] = na<x ? 1.f : 0.f;});
 
         traverse_dset<3,float>(grp, "ref_pos", [&](size_t nr, size_t na, size_t d, float x) {
-                ref_pos[nr].pos[na][d] = x;});
+                ref_pos[nr*12 + d*4 + na] = x;});
 
         // set dist cutoff to largest distance that could possibly have an atom cutoff
         float max_atom_dev = 0.f;
-        for(const auto& p: ref_pos)
-            for(int na: range(p.n_atom))
-                max_atom_dev = max(mag(p.pos[na]), max_atom_dev);
+        for(int nr: range(n_residue))
+            for(int na: range(4))
+                if(atom_present[nr*4+na])
+                    max_atom_dev = max(mag(make_vec3(ref_pos[nr*12+na], ref_pos[nr*12+4+na], ref_pos[nr*12+8+na])),
+                                       max_atom_dev);
 
         dist_cutoff = 2*max_atom_dev + sqrtf(nonbonded_atom_cutoff2);
     }
 
-    virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("backbone_pairs"));
-
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
-        VecArrayStorage coords(3,round_up(n_residue,4));
-        vector<int>    ref_pos_atoms (n_residue);
-        vector<float3> ref_pos_coords(n_residue*4);
-
-        if(pot) *pot = 0.f;
-        for(int nr=0; nr<n_residue; ++nr) {
-            auto aff = load_vec<7>(alignment.output, params[nr].residue);
-            float U[9]; quat_to_rot(U, aff.v+3);
-            auto t = extract<0,3>(aff);
-            store_vec(coords,nr, t);
-
-            ref_pos_atoms[nr] = ref_pos[nr].n_atom;
-            for(int na=0; na<4; ++na) 
-                ref_pos_coords[nr*4+na] = apply_affine(U,t, ref_pos[nr].pos[na]);
+    // place the atoms of residue nr, one atom per lane
+    void place_residue(int nr) {
+        auto U = load_vec<9>(alignment.rotation, params[nr].residue);
+        auto t = load_vec<3>(alignment.output,   params[nr].residue);
+        store_vec(coords,nr, t);
+
+        const float* r = ref_pos .get() + nr*12;
+        float*       x = atom_pos.get() + nr*12;
+        auto rx = Float4(r), ry = Float4(r+4), rz = Float4(r+8);
+        for(int d=0; d<3; ++d)
+            (Float4(U[3*d])*rx + Float4(U[3*d+1])*ry + Float4(U[3*d+2])*rz + Float4(t[d])).store(x+4*d);
+    }
+
+    // add the potential of the atom pairs of residues nr1 and nr2 to pot_acc, and their
+    // derivatives to the alignment if deriv is set
+    void pair_terms(int nr1, int nr2, Float4& pot_acc, bool deriv) {
+        const Float4 cutoff2(nonbonded_atom_cutoff2);
+
+        auto t1 = load_vec<3>(coords,nr1);
+        auto t2 = load_vec<3>(coords,nr2);
+
+        const float* x1p = atom_pos.get() + nr1*12;
+        const float* x2p = atom_pos.get() + nr2*12;
+        auto x2 = make_vec3(Float4(x2p), Float4(x2p+4), Float4(x2p+8));  // atoms of nr2 in lanes
+        auto present2 = Float4(0.5f) < Float4(atom_present.get()+nr2*4);
+        auto t1v = make_vec3(Float4(t1[0]), Float4(t1[1]), Float4(t1[2]));
+        auto t2v = make_vec3(Float4(t2[0]), Float4(t2[1]), Float4(t2[2]));
+
+        // lanes are atoms of nr2, accumulated over the atoms of nr1
+        auto g_acc       = make_zero<3,Float4>();
+        auto torque1_acc = make_zero<3,Float4>();
+
+        bool hit = false;
+        for(int i1=0; i1<4; ++i1) {
+            if(!atom_present[nr1*4+i1]) continue;
+            auto x1 = make_vec3(Float4(x1p[i1]), Float4(x1p[4+i1]), Float4(x1p[8+i1]));
+
+            auto r = x1-x2;
+            auto r_mag2 = mag2(r);
+            auto hit_lanes = (r_mag2<=cutoff2) & present2;
+            if(hit_lanes.none()) continue;
+            hit = true;
+
+            auto V = nonbonded_kernel_and_deriv_over_r(r_mag2);
+            pot_acc = pot_acc + (hit_lanes & V.x());
+            auto g = (hit_lanes & V.y()) * r;
+
+            g_acc       += g;
+            torque1_acc += cross(x1-t1v, g);
+        }
+
+        if(hit && deriv) {
+            // torque on nr2 is sum of cross(x2-t2, -g), so it is formed from the summed g per lane
+            auto torque2_acc = cross(g_acc, x2-t2v);
+
+            Vec<6> combine_deriv1, combine_deriv2;
+            for(int d=0; d<3; ++d) {
+                float g_sum = sum_lanes(g_acc[d]);
+                combine_deriv1[d]   =  g_sum;
+                combine_deriv2[d]   = -g_sum;
+                combine_deriv1[3+d] = sum_lanes(torque1_acc[d]);
+                combine_deriv2[3+d] = sum_lanes(torque2_acc[d]);
+            }
+
+            update_vec(alignment.sens, params[nr1].residue, combine_deriv1);
+            update_vec(alignment.sens, params[nr2].residue, combine_deriv2);
         }
+    }
+
+    virtual void compute_value(ComputeMode mode) {
+        Timer timer("backbone_pairs");
+
+        for(int nr=0; nr<n_residue; ++nr) place_residue(nr);
 
         // acceptable_backbone_pair checks that nr2>=nr1+2
         pairlist.template find_edges<acceptable_backbone_pair>(dist_cutoff,
@@ -104,44 +171,36 @@ struct BackbonePairs : public PotentialNode
                 coords.x.get(), coords.row_width, id.get());
         int n_edge = pairlist.n_edge;
 
-        for(int ne=0; ne<n_edge; ne++) {
-            int nr1 = pairlist.edge_indices1[ne];
-            int nr2 = pairlist.edge_indices2[ne];
-
-            auto d1 = make_zero<3>(); auto torque1 = make_zero<3>(); auto t1 = load_vec<3>(coords,nr1);
-            auto d2 = make_zero<3>(); auto torque2 = make_zero<3>(); auto t2 = load_vec<3>(coords,nr2);
-
-            int n_atom1 = ref_pos_atoms[nr1];
-            int n_atom2 = ref_pos_atoms[nr2];
-
-            bool hit = false;
-            for(int i1=0; i1<n_atom1; ++i1) {
-                const float3 x1 = ref_pos_coords[nr1*4+i1];
+        Float4 pot_acc;
+        for(int ne=0; ne<n_edge; ne++)
+            pair_terms(pairlist.edge_indices1[ne], pairlist.edge_indices2[ne], pot_acc, true);
 
-                for(int i2=0; i2<n_atom2; ++i2) {
-                    const float3 x2 = ref_pos_coords[nr2*4+i2];
-
-                    const float3 r = x1-x2;
-                    const float r_mag2 = mag2(r);
-                    if(r_mag2>nonbonded_atom_cutoff2) continue;
-                    hit = true;
-                    const float deriv_over_r  = nonbonded_kernel_or_deriv_over_r<true> (r_mag2);
-                    if(pot)     *pot         += nonbonded_kernel_or_deriv_over_r<false>(r_mag2);
-                    const float3 g = deriv_over_r*r;
-
-                    d1 +=  g;  torque1 += cross(x1-t1,  g);
-                    d2 += -g;  torque2 += cross(x2-t2, -g);
-                }
-            }
-
-            if(hit) {
-                Vec<6> combine_deriv1; store<0,3>(combine_deriv1, d1); store<3,6>(combine_deriv1, torque1);
-                Vec<6> combine_deriv2; store<0,3>(combine_deriv2, d2); store<3,6>(combine_deriv2, torque2);
+        if(mode==PotentialAndDerivMode) potential = sum_lanes(pot_acc);
+    }
 
-                update_vec(alignment.sens, params[nr1].residue, combine_deriv1);
-                update_vec(alignment.sens, params[nr2].residue, combine_deriv2);
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        vector<int> moved;
+        for(int nr=0; nr<n_residue; ++nr)
+            if(arg_dirty[0]->contains(params[nr].residue)) {moved.push_back(nr); place_residue(nr);}
+        vector<char> is_moved(n_residue, 0);
+        for(int nr: moved) is_moved[nr] = 1;
+
+        // pairs are found by brute force, each pair of moved residues counted once
+        Float4 pot_acc;
+        for(int nr1: moved) {
+            auto t1 = load_vec<3>(coords,nr1);
+            for(int nr2=0; nr2<n_residue; ++nr2) {
+                if(is_moved[nr2] && nr2<=nr1) continue;
+                if(abs(id[nr1]-id[nr2]) <= 1) continue;
+                if(mag2(t1-load_vec<3>(coords,nr2)) >= sqr(dist_cutoff)) continue;
+                pair_terms(nr1, nr2, pot_acc, false);
             }
         }
+        return sum_lanes(pot_acc);
     }
+
+    virtual void reset_caches() override {pairlist.invalidate_cache();}
 };
 static RegisterNodeType<BackbonePairs,1> backbone_pairs_node("backbone_pairs");
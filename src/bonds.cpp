@@ -32,20 +32,35 @@ struct PosSpring : public PotentialNode
         traverse_dset<1,float>(grp, "spring_const", [&](size_t i,           float x) { p[i].spring_constant = x;});
     }
 
+    // potential of a term, adding its derivative to pos_sens if it is not null
+    static float term(const Params& p, VecArray posc, VecArray* pos_sens) {
+        float3 disp = load_vec<3>(posc, p.atom) - p.x0;
+        if(pos_sens) update_vec(*pos_sens, p.atom, p.spring_constant * disp);
+        return 0.5f * p.spring_constant * mag2(disp);
+    }
+
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("pos_spring")); 
+        Timer timer("pos_spring"); 
         float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
 
         if(pot) *pot = 0.f;
-        for(int nt=0; nt<n_elem; ++nt) {
-            auto &p = params[nt];
-            float3 disp = load_vec<3>(posc, p.atom) - p.x0;
-            if(pot) *pot += 0.5f * p.spring_constant * mag2(disp);
-            update_vec(pos_sens, p.atom, p.spring_constant * disp);
+        for(auto& p: params) {
+            float term_pot = term(p, posc, &pos_sens);
+            if(pot) *pot += term_pot;
         }
     }
+
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        auto& moved = *arg_dirty[0];
+        double pot = 0.;
+        for(auto& p: params)
+            if(moved.contains(p.atom)) pot += term(p, pos.output, nullptr);
+        return pot;
+    }
 };
 static RegisterNodeType<PosSpring,1> pos_spring_node("atom_pos_spring");
 
@@ -73,7 +88,7 @@ struct TensionPotential : public PotentialNode
     }
 
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("tension"));
+        Timer timer("tension");
 
         VecArray pos_c = pos.output;
         VecArray pos_sens = pos.sens;
@@ -146,7 +161,7 @@ struct AFMPotential : public PotentialNode
     }
 
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("AFM"));
+        Timer timer("AFM");
         
         if (mode == DerivMode) round_num += 1;
         time_estimate = time_initial + float(time_step)*round_num;
@@ -202,32 +217,48 @@ struct RamaCoord : public CoordNode
         }
     }
 
-    virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("rama_coord"));
-
+    void compute_element(int nt, const float* posv) {
         VecArray rama_pos = output;
-        float*   posv     = pos.output.x.get();
+        const auto& p = params[nt];
+        Float4 x[5];
+        for(int na: range(5)) x[na] = Float4(posv + 4*p.atom[na]);
 
-        for(int nt=0; nt<n_elem; ++nt) {
-            const auto& p = params[nt];
-            Float4 x[5];
-            for(int na: range(5)) x[na] = Float4(posv + 4*p.atom[na]);
+        for(int phipsi: range(2)) {  // phi then psi
+            Float4 d[5];
 
-            for(int phipsi: range(2)) {  // phi then psi
-                Float4 d[5];
+            rama_pos(phipsi,nt) = p.dummy_angle[phipsi]
+                ? -1.3963f   // -80 degrees if dummy angle
+                : dihedral_germ(x[0+phipsi],x[1+phipsi],x[2+phipsi],x[3+phipsi], // shift by 1 for psi
+                                d[0+phipsi],d[1+phipsi],d[2+phipsi],d[3+phipsi]).x();
 
-                rama_pos(phipsi,nt) = p.dummy_angle[phipsi]
-                    ? -1.3963f   // -80 degrees if dummy angle
-                    : dihedral_germ(x[0+phipsi],x[1+phipsi],x[2+phipsi],x[3+phipsi], // shift by 1 for psi
-                                    d[0+phipsi],d[1+phipsi],d[2+phipsi],d[3+phipsi]).x();
-
-                for(int na: range(5)) d[na].store(jac[nt].j[phipsi][na]);
-            }
+            for(int na: range(5)) d[na].store(jac[nt].j[phipsi][na]);
         }
     }
 
+    virtual void compute_value(ComputeMode mode) {
+        Timer timer("rama_coord");
+        float* posv = pos.output.x.get();
+        for(int nt=0; nt<n_elem; ++nt) compute_element(nt, posv);
+    }
+
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        if(old_args) return 0.;  // the elements are computed from the current positions
+        auto& moved = *arg_dirty[0];
+        float* posv = pos.output.x.get();
+        for(int nt=0; nt<n_elem; ++nt)
+            for(int na: range(5))
+                if(moved.contains(params[nt].atom[na])) {
+                    dirty.add(nt);
+                    compute_element(nt, posv);
+                    break;
+                }
+        return 0.;
+    }
+
     virtual void propagate_deriv() {
-        Timer timer(string("rama_coord_deriv"));
+        Timer timer("rama_coord_deriv");
         float* pos_sens = pos.sens.x.get();
 
         for(int nt=0; nt<n_elem; ++nt) {
@@ -294,27 +325,42 @@ struct DistSpring : public PotentialNode
                     });
     }
 
+    // potential of a term, adding its derivative to pos_sens if it is not null
+    static float term(const Params& p, VecArray posc, VecArray* pos_sens) {
+        auto x1 = load_vec<3>(posc, p.atom[0]);
+        auto x2 = load_vec<3>(posc, p.atom[1]);
+
+        auto disp = x1 - x2;
+        if(pos_sens) {
+            auto deriv = p.spring_constant * (1.f - p.equil_dist*inv_mag(disp)) * disp;
+            update_vec(*pos_sens, p.atom[0],  deriv);
+            update_vec(*pos_sens, p.atom[1], -deriv);
+        }
+        return 0.5f * p.spring_constant * sqr(mag(disp) - p.equil_dist);
+    }
+
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("dist_spring"));
+        Timer timer("dist_spring");
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
         float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
-        for(int nt=0; nt<n_elem; ++nt) {
-            auto& p = params[nt];
+        for(auto& p: params) {
+            float term_pot = term(p, posc, &pos_sens);
+            if(pot) *pot += term_pot;
+        }
+    }
 
-            auto x1 = load_vec<3>(posc, p.atom[0]);
-            auto x2 = load_vec<3>(posc, p.atom[1]);
+    virtual bool incremental_supported() const override {return true;}
 
-            auto disp = x1 - x2;
-            auto deriv = p.spring_constant * (1.f - p.equil_dist*inv_mag(disp)) * disp;
-            if(pot) *pot += 0.5f * p.spring_constant * sqr(mag(disp) - p.equil_dist);
-
-            update_vec(pos_sens, p.atom[0],  deriv);
-            update_vec(pos_sens, p.atom[1], -deriv);
-        }
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        auto& moved = *arg_dirty[0];
+        double pot = 0.;
+        for(auto& p: params)
+            if(moved.contains(p.atom[0]) || moved.contains(p.atom[1])) pot += term(p, pos.output, nullptr);
+        return pot;
     }
 };
 static RegisterNodeType<DistSpring,1> dist_spring_node("dist_spring");
@@ -348,7 +394,7 @@ struct CavityRadial : public PotentialNode
     }
 
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("cavity_radial"));
+        Timer timer("cavity_radial");
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
@@ -405,7 +451,7 @@ struct ZFlatBottom : public PotentialNode
     }
 
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("z_flat_bottom"));
+        Timer timer("z_flat_bottom");
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
@@ -457,7 +503,7 @@ struct SphericalWell : public PotentialNode
     }
 
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("spherical_well"));
+        Timer timer("spherical_well");
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
@@ -510,24 +556,17 @@ struct AngleSpring : public PotentialNode
         traverse_dset<1,float>(grp, "spring_const", [&](size_t i,           float x) { p[i].spring_constant = x;});
     }
 
-    virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("angle_spring"));
-
-        float* posc = pos.output.x.get();
-        float* pos_sens = pos.sens.x.get();
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
-        if(pot) *pot = 0.f;
-
-        for(int nt=0; nt<n_elem; ++nt) {
-            auto& p = params[nt];
-            auto atom1 = Float4(posc + 4*p.atom[0]);
-            auto atom2 = Float4(posc + 4*p.atom[1]);
-            auto atom3 = Float4(posc + 4*p.atom[2]);
+    // potential of a term, adding its derivative to pos_sens if it is not null
+    static float term(const Params& p, const float* posc, float* pos_sens) {
+        auto atom1 = Float4(posc + 4*p.atom[0]);
+        auto atom2 = Float4(posc + 4*p.atom[1]);
+        auto atom3 = Float4(posc + 4*p.atom[2]);
 
-            auto x1 = atom1 - atom3; auto inv_d1 = inv_mag(x1); auto x1h = x1*inv_d1;
-            auto x2 = atom2 - atom3; auto inv_d2 = inv_mag(x2); auto x2h = x2*inv_d2;
+        auto x1 = atom1 - atom3; auto inv_d1 = inv_mag(x1); auto x1h = x1*inv_d1;
+        auto x2 = atom2 - atom3; auto inv_d2 = inv_mag(x2); auto x2h = x2*inv_d2;
 
-            auto dp = dot(x1h, x2h);
+        auto dp = dot(x1h, x2h);
+        if(pos_sens) {
             auto force_prefactor = Float4(p.spring_constant) * (dp - Float4(p.equil_dp));
 
             auto d1 = force_prefactor * (x2h - x1h*dp) * inv_d1;
@@ -537,10 +576,34 @@ struct AngleSpring : public PotentialNode
             d1.update(pos_sens + 4*p.atom[0]);
             d2.update(pos_sens + 4*p.atom[1]);
             d3.update(pos_sens + 4*p.atom[2]);
+        }
+        return 0.5f * p.spring_constant * sqr(dp.x()-p.equil_dp);
+    }
+
+    virtual void compute_value(ComputeMode mode) {
+        Timer timer("angle_spring");
+
+        float* posc = pos.output.x.get();
+        float* pos_sens = pos.sens.x.get();
+        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        if(pot) *pot = 0.f;
 
-            if(pot) *pot += 0.5f * p.spring_constant * sqr(dp.x()-p.equil_dp);
+        for(auto& p: params) {
+            float term_pot = term(p, posc, pos_sens);
+            if(pot) *pot += term_pot;
         }
     }
+
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        auto& moved = *arg_dirty[0];
+        double pot = 0.;
+        for(auto& p: params)
+            if(moved.contains(p.atom[0]) || moved.contains(p.atom[1]) || moved.contains(p.atom[2]))
+                pot += term(p, pos.output.x.get(), nullptr);
+        return pot;
+    }
 };
 static RegisterNodeType<AngleSpring,1> angle_spring_node("angle_spring");
 
@@ -572,35 +635,314 @@ struct DihedralSpring : public PotentialNode
         traverse_dset<1,float>(grp, "spring_const", [&](size_t i,           float x) {p[i].spring_constant=x;});
     }
 
+    // potential of a term, adding its derivative to pos_sens if it is not null
+    static float term(const Params& p, const float* posc, float* pos_sens) {
+        Float4 x[4];
+        for(int na: range(4)) x[na] = Float4(posc + 4*p.atom[na]);
+
+        Float4 d[4];
+        float dihedral = dihedral_germ(x[0],x[1],x[2],x[3], d[0],d[1],d[2],d[3]).x();
+
+        // determine minimum periodic image (can be off by at most 2pi)
+        float displacement = dihedral - p.equil_dihedral;
+        displacement = (displacement> M_PI_F) ? displacement-2.f*M_PI_F : displacement;
+        displacement = (displacement<-M_PI_F) ? displacement+2.f*M_PI_F : displacement;
+
+        if(pos_sens) {
+            auto s = Float4(p.spring_constant * displacement);
+            for(int na: range(4)) d[na].scale_update(s, pos_sens + 4*p.atom[na]);
+        }
+        return 0.5f * p.spring_constant * sqr(displacement);
+    }
+
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("dihedral_spring"));
+        Timer timer("dihedral_spring");
 
         float* posc = pos.output.x.get();
         float* pos_sens = pos.sens.x.get();
         float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
-        for(int nt=0; nt<n_elem; ++nt) {
-            const auto& p = params[nt];
-            Float4 x[4];
-            for(int na: range(4)) x[na] = Float4(posc + 4*params[nt].atom[na]);
+        for(auto& p: params) {
+            float term_pot = term(p, posc, pos_sens);
+            if(pot) *pot += term_pot;
+        }
+    }
 
-            Float4 d[4];
-            float dihedral = dihedral_germ(x[0],x[1],x[2],x[3], d[0],d[1],d[2],d[3]).x();
+    virtual bool incremental_supported() const override {return true;}
 
-            // determine minimum periodic image (can be off by at most 2pi)
-            float displacement = dihedral - p.equil_dihedral;
-            displacement = (displacement> M_PI_F) ? displacement-2.f*M_PI_F : displacement;
-            displacement = (displacement<-M_PI_F) ? displacement+2.f*M_PI_F : displacement;
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        auto& moved = *arg_dirty[0];
+        double pot = 0.;
+        for(auto& p: params) {
+            bool any_moved = false;
+            for(int na: range(4)) any_moved |= bool(moved.contains(p.atom[na]));
+            if(any_moved) pot += term(p, pos.output.x.get(), nullptr);
+        }
+        return pot;
+    }
+};
+static RegisterNodeType<DihedralSpring,1> dihedral_spring_node("dihedral_spring");
 
-            auto s = Float4(p.spring_constant * displacement);
-            for(int na: range(4)) d[na].scale_update(s, pos_sens + 4*params[nt].atom[na]);
 
-            if(pot) *pot += 0.5f * p.spring_constant * sqr(displacement);
+// The spring terms of the nodes above, evaluated together in a single node.  Each kind of
+// term is stored as structure-of-arrays and evaluated 4 terms at a time, with the
+// positions gathered and the derivatives scattered once per term.  Each subgroup
+// (atom_pos_spring, dist_spring, angle_spring, dihedral_spring) is optional and has the
+// same format as the corresponding node.
+struct BondedTerms : public PotentialNode
+{
+    template <int n_atom, int n_param>
+    struct Terms {
+        int n_term;
+        unique_ptr<int32_t[]> offset[n_atom];  // atom index times row width of pos
+        unique_ptr<float[]>   param [n_param];
+
+        Terms(): n_term(0) {}
+
+        void read(hid_t grp, int row_width, const array<const char*,n_param>& param_names) {
+            n_term = get_dset_size(2, grp, "id")[0];
+            int n_pad = round_up(n_term,4);
+
+            auto id = read_dset<int>(grp, "id", {size_t(n_term), size_t(n_atom)});
+            for(int na: range(n_atom)) {
+                offset[na] = new_aligned<int32_t>(n_pad,4);
+                for(int nt: range(n_pad))  // padding repeats the first term with zero parameters
+                    offset[na][nt] = id[(nt<n_term ? nt : 0)*n_atom + na] * row_width;
+            }
+            for(int np: range(n_param)) {
+                auto p = read_dset<float>(grp, param_names[np], {size_t(n_term)});
+                param[np] = new_aligned<float>(n_pad,4);
+                for(int nt: range(n_pad)) param[np][nt] = nt<n_term ? p[nt] : 0.f;
+            }
+        }
+
+        Int4   atom (int na, int nt) const {return Int4  (offset[na].get()+nt);}
+        Float4 value(int np, int nt) const {return Float4(param [np].get()+nt);}
+
+        // bit mask of the terms nt..nt+3 that touch a moved atom
+        int dirty_mask(const DirtySet& moved, int row_width, int nt) const {
+            int mask = 0;
+            for(int i=0; i<4 && nt+i<n_term; ++i)
+                for(int na: range(n_atom))
+                    if(moved.contains(offset[na][nt+i]/row_width)) {mask |= 1<<i; break;}
+            return mask;
         }
+    };
+
+    CoordNode& pos;
+    Terms<1,4> pos_spring;       // x0 (3 components), spring_const
+    Terms<2,2> dist_spring;      // equil_dist, spring_const
+    Terms<3,2> angle_spring;     // equilibrium dot product, spring_const
+    Terms<4,2> dihedral_spring;  // equil_dihedral, spring_const
+    vector<int> bonded_atoms;
+
+    BondedTerms(hid_t grp, CoordNode& pos_):
+        PotentialNode(), pos(pos_)
+    {
+        int rw = pos.output.row_width;
+        if(h5_exists(grp, "atom_pos_spring")) {
+            auto g = open_group(grp, "atom_pos_spring");
+            int n = get_dset_size(1, g.get(), "id")[0];
+            check_size(g.get(), "x0", n, 3);
+            check_size(g.get(), "spring_const", n);
+
+            // id is 1-dimensional and x0 has 3 components per term, so Terms::read does not apply
+            pos_spring.n_term = n;
+            int n_pad = round_up(n,4);
+            auto id = read_dset<int>  (g.get(), "id", {size_t(n)});
+            auto x0 = read_dset<float>(g.get(), "x0", {size_t(n), 3u});
+            auto k  = read_dset<float>(g.get(), "spring_const", {size_t(n)});
+            pos_spring.offset[0] = new_aligned<int32_t>(n_pad,4);
+            for(int np: range(4)) pos_spring.param[np] = new_aligned<float>(n_pad,4);
+            for(int nt: range(n_pad)) {
+                pos_spring.offset[0][nt] = id[nt<n ? nt : 0] * rw;
+                for(int d: range(3)) pos_spring.param[d][nt] = nt<n ? x0[nt*3+d] : 0.f;
+                pos_spring.param[3][nt] = nt<n ? k[nt] : 0.f;
+            }
+        }
+        if(h5_exists(grp, "dist_spring")) {
+            auto g = open_group(grp, "dist_spring");
+            dist_spring.read(g.get(), rw, {{"equil_dist", "spring_const"}});
+            check_size(g.get(), "bonded_atoms", dist_spring.n_term);
+            bonded_atoms = read_dset<int>(g.get(), "bonded_atoms", {size_t(dist_spring.n_term)});
+        }
+        if(h5_exists(grp, "angle_spring"))
+            angle_spring.read(open_group(grp, "angle_spring").get(), rw, {{"equil_dist", "spring_const"}});
+        if(h5_exists(grp, "dihedral_spring"))
+            dihedral_spring.read(open_group(grp, "dihedral_spring").get(), rw, {{"equil_dist", "spring_const"}});
+
+        if(logging(LOG_DETAILED) && dist_spring.n_term)
+            default_logger->add_logger<float>("nonbonded_spring_energy", {1}, [&](float* buffer) {
+                    alignas(16) float pot[4];
+                    float* posc = pos.output.x.get();
+                    buffer[0] = 0.f;
+                    for(int nt=0; nt<dist_spring.n_term; nt+=4) {
+                        dist_batch(posc, nullptr, nt).store(pot);
+                        for(int i=0; i<4 && nt+i<dist_spring.n_term; ++i)
+                            if(!bonded_atoms[nt+i]) buffer[0] += pot[i];  // don't count bonded spring energy
+                    }});
+    }
+
+    // Each batch function evaluates terms nt..nt+3, adds their derivatives to sens if
+    // it is not null, and returns their potentials.
+
+    Float4 pos_spring_batch(const float* posc, float* sens, int nt) const {
+        auto& t = pos_spring;
+        auto x = aligned_gather_vec<3>(posc, t.atom(0,nt));
+        Vec<3,Float4> x0;
+        for(int d: range(3)) x0[d] = t.value(d,nt);
+        auto k = t.value(3,nt);
+
+        auto disp = x - x0;
+        auto pot = Float4(0.5f) * k * mag2(disp);
+        if(sens) {
+            auto deriv = k*disp;
+            aligned_scatter_update_vec_destructive(sens, t.atom(0,nt), deriv);
+        }
+        return pot;
+    }
+
+    Float4 dist_batch(const float* posc, float* sens, int nt) const {
+        auto& t = dist_spring;
+        auto x1 = aligned_gather_vec<3>(posc, t.atom(0,nt));
+        auto x2 = aligned_gather_vec<3>(posc, t.atom(1,nt));
+        auto equil_dist = t.value(0,nt);
+        auto k          = t.value(1,nt);
+
+        auto disp   = x1 - x2;
+        auto dist2  = mag2(disp);
+        auto inv_dist = rsqrt(dist2);
+        auto pot = Float4(0.5f) * k * sqr(dist2*inv_dist - equil_dist);
+        if(sens) {
+            auto d1 = (k * (Float4(1.f) - equil_dist*inv_dist)) * disp;
+            auto d2 = -d1;
+            aligned_scatter_update_vec_destructive(sens, t.atom(0,nt), d1);
+            aligned_scatter_update_vec_destructive(sens, t.atom(1,nt), d2);
+        }
+        return pot;
+    }
+
+    Float4 angle_batch(const float* posc, float* sens, int nt) const {
+        auto& t = angle_spring;
+        auto atom1 = aligned_gather_vec<3>(posc, t.atom(0,nt));
+        auto atom2 = aligned_gather_vec<3>(posc, t.atom(1,nt));
+        auto atom3 = aligned_gather_vec<3>(posc, t.atom(2,nt));
+        auto equil_dp = t.value(0,nt);
+        auto k        = t.value(1,nt);
+
+        auto x1 = atom1 - atom3; auto inv_d1 = inv_mag(x1); auto x1h = x1*inv_d1;
+        auto x2 = atom2 - atom3; auto inv_d2 = inv_mag(x2); auto x2h = x2*inv_d2;
+
+        auto dp = dot(x1h, x2h);
+        auto pot = Float4(0.5f) * k * sqr(dp - equil_dp);
+        if(sens) {
+            auto force_prefactor = k * (dp - equil_dp);
+            auto d1 = (force_prefactor*inv_d1) * (x2h - x1h*dp);
+            auto d2 = (force_prefactor*inv_d2) * (x1h - x2h*dp);
+            auto d3 = -(d1+d2);
+            aligned_scatter_update_vec_destructive(sens, t.atom(0,nt), d1);
+            aligned_scatter_update_vec_destructive(sens, t.atom(1,nt), d2);
+            aligned_scatter_update_vec_destructive(sens, t.atom(2,nt), d3);
+        }
+        return pot;
+    }
+
+    Float4 dihedral_batch(const float* posc, float* sens, int nt) const {
+        // same as dihedral_germ, but for 4 independent dihedrals
+        auto& t = dihedral_spring;
+        Vec<3,Float4> r[4];
+        for(int na: range(4)) r[na] = aligned_gather_vec<3>(posc, t.atom(na,nt));
+        auto equil_dihedral = t.value(0,nt);
+        auto k              = t.value(1,nt);
+
+        auto F = r[0]-r[1];
+        auto G = r[1]-r[2];
+        auto H = r[3]-r[2];
+
+        auto A = cross(F,G);
+        auto B = cross(H,G);
+        auto C = cross(B,A);
+
+        auto inv_Amag2 = inv_mag2(A);
+        auto inv_Bmag2 = inv_mag2(B);
+
+        auto Gmag2    = mag2(G);
+        auto inv_Gmag = rsqrt(Gmag2);
+        auto Gmag     = Gmag2 * inv_Gmag;
+
+        alignas(16) float y[4], x[4], dihedral[4];
+        dot(C,G)       .store(y);
+        (dot(A,B)*Gmag).store(x);
+        for(int i: range(4)) dihedral[i] = atan2f(y[i], x[i]);
+
+        // determine minimum periodic image (can be off by at most 2pi)
+        auto displacement = Float4(dihedral) - equil_dihedral;
+        displacement = ternary(Float4( M_PI_F) < displacement, displacement-Float4(2.f*M_PI_F), displacement);
+        displacement = ternary(displacement < Float4(-M_PI_F), displacement+Float4(2.f*M_PI_F), displacement);
+
+        auto pot = Float4(0.5f) * k * sqr(displacement);
+        if(sens) {
+            auto s = k * displacement;
+            auto d1 = (-s*Gmag*inv_Amag2) * A;
+            auto d4 = ( s*Gmag*inv_Bmag2) * B;
+            auto f_mid = (s*dot(F,G)*inv_Amag2*inv_Gmag) * A - (s*dot(H,G)*inv_Bmag2*inv_Gmag) * B;
+            auto d2 = f_mid - d1;
+            auto d3 = -d4 - f_mid;
+            aligned_scatter_update_vec_destructive(sens, t.atom(0,nt), d1);
+            aligned_scatter_update_vec_destructive(sens, t.atom(1,nt), d2);
+            aligned_scatter_update_vec_destructive(sens, t.atom(2,nt), d3);
+            aligned_scatter_update_vec_destructive(sens, t.atom(3,nt), d4);
+        }
+        return pot;
+    }
+
+    virtual void compute_value(ComputeMode mode) {
+        Timer timer("bonded");
+        const float* posc = pos.output.x.get();
+        float* sens = pos.sens.x.get();
+
+        auto pot = Float4();
+        for(int nt=0; nt<pos_spring     .n_term; nt+=4) pot = pot + pos_spring_batch(posc, sens, nt);
+        for(int nt=0; nt<dist_spring    .n_term; nt+=4) pot = pot + dist_batch      (posc, sens, nt);
+        for(int nt=0; nt<angle_spring   .n_term; nt+=4) pot = pot + angle_batch     (posc, sens, nt);
+        for(int nt=0; nt<dihedral_spring.n_term; nt+=4) pot = pot + dihedral_batch  (posc, sens, nt);
+
+        alignas(16) float pot_lanes[4];
+        pot.store(pot_lanes);
+        if(mode==PotentialAndDerivMode) potential = pot_lanes[0]+pot_lanes[1]+pot_lanes[2]+pot_lanes[3];
+    }
+
+    // sum of the potentials of the terms touching a moved atom
+    template <int n_atom, int n_param>
+    double dirty_sum(const Terms<n_atom,n_param>& t,
+            Float4 (BondedTerms::*batch)(const float*, float*, int) const, const DirtySet& moved) const {
+        const float* posc = pos.output.x.get();
+        int rw = pos.output.row_width;
+        alignas(16) float value[4];
+        double pot = 0.;
+        for(int nt=0; nt<t.n_term; nt+=4) {
+            int mask = t.dirty_mask(moved, rw, nt);
+            if(!mask) continue;
+            (this->*batch)(posc, nullptr, nt).store(value);
+            for(int i: range(4)) if(mask & (1<<i)) pot += value[i];
+        }
+        return pot;
+    }
+
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        auto& moved = *arg_dirty[0];
+        double pot = 0.;
+        pot += dirty_sum(pos_spring,      &BondedTerms::pos_spring_batch, moved);
+        pot += dirty_sum(dist_spring,     &BondedTerms::dist_batch,       moved);
+        pot += dirty_sum(angle_spring,    &BondedTerms::angle_batch,      moved);
+        pot += dirty_sum(dihedral_spring, &BondedTerms::dihedral_batch,   moved);
+        return pot;
     }
 };
-static RegisterNodeType<DihedralSpring,1> dihedral_spring_node("dihedral_spring");
+static RegisterNodeType<BondedTerms,1> bonded_node("bonded");
 
 
 struct ConstantCoord : public CoordNode
@@ -1,8 +1,13 @@
 #include "deriv_engine.h"
 #include "timing.h"
+#include "state_logger.h"
 #include <map>
 #include <algorithm>
 #include <memory>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <sys/mman.h>
 
 using namespace h5;
 
@@ -91,6 +96,12 @@ void check_arguments_length(const ArgList& arguments, int n_expected) {
             " arguments but got " + std::to_string(arguments.size());
 }
 
+FrameNode& as_frame_node(CoordNode& node) {
+    auto frame = dynamic_cast<FrameNode*>(&node);
+    if(!frame) throw std::string("expected rigid body frame argument (such as affine_alignment)");
+    return *frame;
+}
+
 void DerivEngine::add_node(
         const string& name, 
         unique_ptr<DerivComputation> fcn, 
@@ -101,6 +112,7 @@ void DerivEngine::add_node(
 
     nodes.emplace_back(name, move(fcn));
     auto& node = nodes.back();
+    schedule_valid = false;
 
     for(auto& nm: argument_names) { 
         int parent_idx = get_idx(nm);
@@ -121,11 +133,308 @@ int DerivEngine::get_idx(const string& name, bool must_exist) {
     return loc != nodes.end() ? loc-begin(nodes) : -1;
 }
 
+void DerivEngine::build_schedule() {
+    // Nodes are added only after all of their parents, so a single pass in each
+    // direction determines the levels that compute_bfs would assign.
+    int n_node = nodes.size();
+    for(int i=0; i<n_node; ++i) {
+        auto& n = nodes[i];
+        n.germ_exec_level = 0;
+        for(auto ip: n.parents) n.germ_exec_level = max(n.germ_exec_level, nodes[ip].germ_exec_level+1);
+    }
+    for(int i=n_node-1; i>=0; --i) {
+        auto& n = nodes[i];
+        n.deriv_exec_level = n.germ_exec_level;
+        for(auto ic: n.children) n.deriv_exec_level = max(n.deriv_exec_level, nodes[ic].deriv_exec_level+1);
+    }
+
+    // stable sorts preserve the node order within a level, matching compute_bfs
+    vector<int> germ_order(n_node), deriv_order(n_node);
+    for(int i=0; i<n_node; ++i) germ_order[i] = deriv_order[i] = i;
+    stable_sort(begin(germ_order), end(germ_order), [&](int i, int j) {
+            return nodes[i].germ_exec_level < nodes[j].germ_exec_level;});
+    stable_sort(begin(deriv_order), end(deriv_order), [&](int i, int j) {
+            return nodes[i].deriv_exec_level < nodes[j].deriv_exec_level;});
+
+    // a force group needs its own potential nodes and everything they depend on
+    vector<vector<bool>> in_group(2, vector<bool>(n_node, false));
+    for(int i=n_node-1; i>=0; --i) {
+        auto& n = nodes[i];
+        if(n.force_group<0 || n.force_group>1) throw string("invalid force_group for node ") + n.name;
+        for(int g: {0,1}) {
+            bool needed = n.computation->potential_term && n.force_group==g;
+            for(auto ic: n.children) needed = needed || in_group[g][ic];
+            in_group[g][i] = needed;
+        }
+    }
+    in_group[0][0] = in_group[1][0] = true;  // pos node
+
+    auto fill_schedule = [&](Schedule& sched, int mode, const vector<bool>& included) {
+        sched.forward .clear();
+        sched.backward.clear();
+
+        vector<int> sched_germ_order, sched_deriv_order;
+        for(int i: germ_order)  if(included[i]) sched_germ_order .push_back(i);
+        for(int i: deriv_order) if(included[i]) sched_deriv_order.push_back(i);
+
+        for(int i: sched_germ_order) {
+            auto comp = nodes[i].computation.get();
+            ScheduleEntry e;
+            e.computation = comp;
+            // nodes without support for PotentialOnlyMode must compute their derivatives anyway
+            e.mode  = (mode == PotentialOnlyMode && !comp->potential_only_supported())
+                ? PotentialAndDerivMode : ComputeMode(mode);
+            e.coord = comp->potential_term ? nullptr : static_cast<CoordNode*>(comp);
+            e.pot   = (mode != DerivMode && comp->potential_term)
+                ? static_cast<PotentialNode*>(comp) : nullptr;
+            sched.forward.push_back(e);
+        }
+        // no derivatives are propagated in PotentialOnlyMode
+        if(mode != PotentialOnlyMode)
+            for(int i: sched_deriv_order) sched.backward.push_back(nodes[i].computation.get());
+
+        sched.forward_batches  = make_batches(sched_germ_order,  [&](int i){return nodes[i].germ_exec_level;});
+        sched.backward_batches = mode != PotentialOnlyMode
+            ? make_batches(sched_deriv_order, [&](int i){return nodes[i].deriv_exec_level;})
+            : vector<vector<int>>();
+    };
+
+    vector<bool> all_nodes(n_node, true);
+    for(int mode: {DerivMode, PotentialAndDerivMode, PotentialOnlyMode})
+        fill_schedule(schedule[mode], mode, all_nodes);
+    for(int g: {0,1})
+        fill_schedule(group_schedule[g], DerivMode, in_group[g]);
+    schedule_valid = true;
+}
+
+void DerivEngine::build_arena(bool huge_pages) {
+    if(!schedule_valid) build_schedule();
+
+    vector<VecArrayStorage*> storage;
+    for(auto& e: schedule[PotentialAndDerivMode].forward) {
+        if(!e.coord) continue;
+        storage.push_back(&e.coord->output);
+        storage.push_back(&e.coord->sens);
+    }
+
+    auto round_up_size = [](size_t n, size_t alignment) {return ((n+alignment-1)/alignment)*alignment;};
+    const size_t line_floats = 64/sizeof(float);
+    size_t n_floats = 0;
+    for(auto s: storage) n_floats += round_up_size(s->size(), line_floats);
+
+    const size_t huge_page_bytes = size_t(1)<<21;
+    size_t n_bytes = max(n_floats*sizeof(float), size_t(64));
+    bool use_huge_pages = huge_pages && n_bytes >= huge_page_bytes;
+    size_t alignment = use_huge_pages ? huge_page_bytes : 64;
+    n_bytes = round_up_size(n_bytes, alignment);
+
+    void* p = nullptr;
+    if(posix_memalign(&p, alignment, n_bytes)) throw string("unable to allocate node arena");
+    unique_ptr<float,FreeDeleter> new_arena(static_cast<float*>(p));
+#ifdef MADV_HUGEPAGE
+    if(use_huge_pages) madvise(p, n_bytes, MADV_HUGEPAGE);  // only advice, so failure is harmless
+#endif
+    memset(p, 0, n_bytes);  // first touch
+
+    // the old arena, if any, is only freed after its contents are moved
+    float* loc = new_arena.get();
+    for(auto s: storage) {
+        s->move_to(loc);
+        loc += round_up_size(s->size(), line_floats);
+    }
+    swap(arena, new_arena);
+}
+
+bool DerivEngine::compute_incremental(VecArrayStorage& old_pos, const vector<int>& moved) {
+    if(moved.size() > incremental_max_fraction*pos->n_elem) return false;
+    Timer timer("compute_incremental");
+    int n_node = nodes.size();
+
+    // nodes were added in dependency order, so the parents of a node are updated before it
+    vector<DirtySet> dirty(n_node);
+    dirty[0].reset(pos->n_elem, {pos->output});
+    for(int na: moved) dirty[0].add(na, {old_pos});
+
+    double delta_potential = 0.;
+    vector<const DirtySet*> arg_dirty;
+    for(int i=1; i<n_node; ++i) {
+        auto& n = nodes[i];
+        auto comp  = n.computation.get();
+        auto coord = comp->potential_term ? nullptr : static_cast<CoordNode*>(comp);
+        auto pot   = comp->potential_term ? static_cast<PotentialNode*>(comp) : nullptr;
+
+        // the rotations of a frame are part of its value
+        vector<VecArray> arrays;
+        if(coord) {
+            arrays.push_back(coord->output);
+            if(auto frame = dynamic_cast<FrameNode*>(coord)) arrays.push_back(frame->rotation);
+        }
+        dirty[i].reset(coord ? coord->n_elem : 0, arrays);
+
+        arg_dirty.clear();
+        bool affected = false, few_dirty = true;
+        for(auto ip: n.parents) {
+            arg_dirty.push_back(&dirty[ip]);
+            affected  |= !dirty[ip].empty();
+            few_dirty &= dirty[ip].size() <= incremental_max_fraction*dirty[ip].mask.size();
+        }
+        if(!affected) continue;
+
+        if(comp->incremental_supported() && few_dirty) {
+            // each parent must be switched once, even if it is several arguments
+            auto parents = n.parents;
+            sort(begin(parents), end(parents));
+            parents.erase(unique(begin(parents), end(parents)), end(parents));
+
+            for(int ip: parents) dirty[ip].swap_saved();
+            double old_terms = comp->update_dirty(arg_dirty, dirty[i], true);
+            for(int ip: parents) dirty[ip].swap_saved();
+            double new_terms = comp->update_dirty(arg_dirty, dirty[i], false);
+
+            if(pot) {
+                pot->potential  += float(new_terms - old_terms);
+                delta_potential += new_terms - old_terms;
+            }
+        } else {
+            auto mode = comp->potential_only_supported() ? PotentialOnlyMode : PotentialAndDerivMode;
+            if(coord) {
+                // the elements whose values changed are dirty
+                vector<VecArrayStorage> old_storage;
+                old_storage.emplace_back(coord->output);
+                if(arrays.size()>1u) old_storage.emplace_back(static_cast<FrameNode*>(coord)->rotation);
+                vector<VecArray> old_arrays(begin(old_storage), end(old_storage));
+
+                comp->compute_value(mode);
+                for(int ne=0; ne<coord->n_elem; ++ne)
+                    for(int k: range(int(arrays.size())))
+                        if(!equal(&arrays[k](0,ne), &arrays[k](0,ne)+arrays[k].row_width, &old_arrays[k](0,ne))) {
+                            dirty[i].add(ne, old_arrays);
+                            break;
+                        }
+            } else {
+                float old_potential = pot->potential;
+                comp->compute_value(mode);
+                delta_potential += double(pot->potential) - double(old_potential);
+            }
+        }
+    }
+
+    potential += float(delta_potential);
+    return true;
+}
+
+vector<vector<int>> DerivEngine::make_batches(const vector<int>& order, const function<int(int)>& level) {
+    // Nodes accumulate into the sensitivities of their parents, so concurrent
+    // nodes must have disjoint parents.  Greedily fill batches in schedule order.
+    vector<vector<int>> batches;
+    vector<bool> parent_used(nodes.size(), false);
+
+    for(int start=0, n=order.size(); start<n; ) {
+        int stop = start;
+        while(stop<n && level(order[stop])==level(order[start])) ++stop;
+
+        vector<int> pending, rest;
+        for(int loc=start; loc<stop; ++loc) pending.push_back(loc);
+
+        while(pending.size()) {
+            batches.emplace_back();
+            fill(begin(parent_used), end(parent_used), false);
+            rest.clear();
+            for(int loc: pending) {
+                auto& pa = nodes[order[loc]].parents;
+                if(any_of(begin(pa), end(pa), [&](size_t ip) {return bool(parent_used[ip]);})) {
+                    rest.push_back(loc);
+                } else {
+                    for(auto ip: pa) parent_used[ip] = true;
+                    batches.back().push_back(loc);
+                }
+            }
+            swap(pending, rest);
+        }
+        start = stop;
+    }
+    return batches;
+}
+
+template <typename F>
+static void run_batches(const vector<vector<int>>& batches, int n_threads, F f) {
+    // Exceptions may not leave an OpenMP task, so the first one is stored and rethrown afterward
+    bool has_error = false;
+    string error_msg;
+    int replica = timer_replica();  // worker threads time on behalf of the calling replica
+    auto run = [&](int loc) {
+        ReplicaTimerScope timer_scope(replica);
+        try {
+            f(loc);
+        } catch(const string& e) {
+            #pragma omp critical (deriv_engine_task_error)
+            if(!has_error) {has_error = true; error_msg = e;}
+        } catch(...) {
+            #pragma omp critical (deriv_engine_task_error)
+            if(!has_error) {has_error = true; error_msg = "unknown error in task";}
+        }
+    };
+
+    #pragma omp parallel num_threads(n_threads)
+    #pragma omp single
+    for(auto& batch: batches) {
+        for(size_t i=1; i<batch.size(); ++i) {
+            int loc = batch[i];
+            #pragma omp task firstprivate(loc)
+            run(loc);
+        }
+        run(batch[0]);  // the spawning thread takes a share of the work
+        #pragma omp taskwait
+    }
+
+    if(has_error) throw error_msg;
+}
+
 void DerivEngine::compute(ComputeMode mode) {
+#ifdef DERIV_ENGINE_BFS_SCHEDULE
+    compute_bfs(mode);
+#else
+    if(!schedule_valid) build_schedule();
+    run_schedule(schedule[mode], mode);
+#endif
+}
+
+void DerivEngine::compute_force_group(int force_group) {
+    if(!schedule_valid) build_schedule();
+    run_schedule(group_schedule[force_group], DerivMode);
+}
+
+void DerivEngine::run_schedule(const Schedule& sched, ComputeMode mode) {
+    if(mode != DerivMode) potential = 0.f;
+
+    if(n_threads>1) {
+        run_batches(sched.forward_batches, n_threads, [&](int loc) {
+                const auto& e = sched.forward[loc];
+                e.computation->compute_value(e.mode);
+                if(e.coord) fill(e.coord->sens, 0.f);});
+        // sum in schedule order so that the potential does not depend on thread timing
+        for(const auto& e: sched.forward) if(e.pot) potential += e.pot->potential;
+
+        run_batches(sched.backward_batches, n_threads, [&](int loc) {
+                sched.backward[loc]->propagate_deriv();});
+        return;
+    }
+
+    for(const auto& e: sched.forward) {
+        e.computation->compute_value(e.mode);
+        if(e.pot) potential += e.pot->potential;
+        // ensure zero sensitivity for later derivative writing
+        if(e.coord) fill(e.coord->sens, 0.f);
+    }
+
+    for(auto comp: sched.backward) comp->propagate_deriv();
+}
+
+void DerivEngine::compute_bfs(ComputeMode mode) {
     // FIXME depth-first traversal would be simpler and more cache-friendly
     for(auto& n: nodes) n.germ_exec_level = n.deriv_exec_level = -1;
 
-    if(mode == PotentialAndDerivMode) potential = 0.f;
+    if(mode != DerivMode) potential = 0.f;
 
     // BFS traversal
     for(int lvl=0, not_finished=1; ; ++lvl, not_finished=0) {
@@ -138,9 +447,11 @@ void DerivEngine::compute(ComputeMode mode) {
                         });
 
                 if(all_parents) {
-                    n.computation->compute_value(mode);
+                    n.computation->compute_value(
+                            (mode == PotentialOnlyMode && !n.computation->potential_only_supported())
+                            ? PotentialAndDerivMode : mode);
                     n.germ_exec_level = lvl;
-                    if(mode == PotentialAndDerivMode && n.computation->potential_term) {
+                    if(mode != DerivMode && n.computation->potential_term) {
                         auto pot_node = static_cast<PotentialNode*>(n.computation.get());
                         potential += pot_node->potential;
                     }
@@ -159,7 +470,7 @@ void DerivEngine::compute(ComputeMode mode) {
                         return exec_lvl!=-1 && exec_lvl!=lvl; // do not execute at same level as your children
                         });
                 if(all_children) {
-                    n.computation->propagate_deriv();
+                    if(mode != PotentialOnlyMode) n.computation->propagate_deriv();
                     n.deriv_exec_level = lvl;
                 }
             }
@@ -181,7 +492,7 @@ void DerivEngine::integration_cycle(VecArray mom, float dt, float max_force, Int
 
     for(int stage=0; stage<3; ++stage) {
         compute(DerivMode);   // compute derivatives
-        Timer timer(string("integration"));
+        Timer timer("integration");
         integration_stage( 
                 mom,
                 pos->output,
@@ -192,10 +503,106 @@ void DerivEngine::integration_cycle(VecArray mom, float dt, float max_force, Int
 }
 
 
-DerivEngine initialize_engine_from_hdf5(int n_atom, hid_t potential_group, bool quiet)
+void DerivEngine::respa_integration_cycle(VecArray mom, float dt, float max_force, int slow_interval) {
+    // Impulse (r-RESPA) form of the kick-drift steps of integration_cycle: the slow
+    // force kick of the whole slow_interval is applied at the first of its steps
+    for(int stage=0; stage<3; ++stage, ++inner_step) {
+        if(!(inner_step%slow_interval)) {
+            compute_force_group(1);
+            Timer timer("integration");
+            integration_stage(mom, pos->output, pos->sens,
+                    dt*slow_interval, 0.f, max_force, pos->n_atom);
+        }
+
+        compute_force_group(0);
+        Timer timer("integration");
+        integration_stage(mom, pos->output, pos->sens,
+                dt, dt, max_force, pos->n_atom);
+    }
+}
+
+
+static NodeCreationFunction& node_creation_function(const string& nm) {
+    // some name in the node_creation_map must be a prefix of this name
+    auto& m = node_creation_map();
+    string node_type_name = "";
+    for(auto &kv : m) {
+        if(is_prefix(kv.first, nm))
+            node_type_name = kv.first;
+    }
+    if(node_type_name == "") throw string("No node type found for name '") + nm + "'";
+    return m[node_type_name];
+}
+
+
+static shared_ptr<H5Obj> copy_group_to_memory(hid_t group) {
+    // the core driver requires distinct names for simultaneously open files
+    static atomic<long> n_copy(0);
+    auto name = string("potential_source_") + to_string(n_copy++);
+
+    H5Lock lock;
+    auto fapl = h5_obj(H5Pclose, H5Pcreate(H5P_FILE_ACCESS));
+    h5_noerr(H5Pset_fapl_core(fapl.get(), 1<<20, false));  // never written to disk
+    auto file = h5_obj(H5Fclose, H5Fcreate(name.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl.get()));
+    h5_noerr(H5Ocopy(group, ".", file.get(), "potential", H5P_DEFAULT, H5P_DEFAULT));
+    return make_shared<H5Obj>(move(file));
+}
+
+
+DerivEngine DerivEngine::clone() const
+{
+    DerivEngine engine(pos->n_atom);
+    engine.n_threads  = n_threads;
+    engine.incremental_max_fraction = incremental_max_fraction;
+    engine.inner_step = inner_step;
+    engine.potential  = potential;
+    engine.potential_source = potential_source;
+    copy(pos->output, engine.pos->output);
+
+    // loggers belong to the original engine
+    auto saved_logger = default_logger;
+    default_logger.reset();
+
+    try {
+        // nodes were added in dependency order, so arguments are always cloned first
+        for(size_t i=1; i<nodes.size(); ++i) {
+            auto& n = nodes[i];
+            ArgList arguments;
+            vector<string> argument_names;
+            for(auto p: n.parents) {
+                arguments.push_back(dynamic_cast<CoordNode*>(engine.nodes[p].computation.get()));
+                argument_names.push_back(nodes[p].name);
+            }
+
+            unique_ptr<DerivComputation> computation(n.computation->clone(arguments));
+            if(!computation) {
+                if(!potential_source) 
+                    throw "node " + n.name + " cannot be cloned without the potential source";
+                auto grp = open_group(potential_source->get(), ("potential/"+n.name).c_str());
+                computation.reset(node_creation_function(n.name)(grp.get(), arguments));
+
+                // parameters may have been changed by set_param since the source was read
+                auto param = n.computation->get_param();
+                if(param != computation->get_param()) computation->set_param(param);
+            }
+            engine.add_node(n.name, move(computation), argument_names);
+            engine.nodes.back().force_group = n.force_group;
+        }
+    } catch(...) {
+        default_logger = saved_logger;
+        throw;
+    }
+    default_logger = saved_logger;
+
+    engine.build_schedule();
+    return engine;
+}
+
+
+DerivEngine initialize_engine_from_hdf5(int n_atom, hid_t potential_group, bool quiet, bool retain_source)
 {
     DerivEngine engine(n_atom);
-    auto& m = node_creation_map();
+    if(retain_source) engine.potential_source = copy_group_to_memory(potential_group);
 
     map<string, pair<bool,vector<string>>> dep_graph;  // bool indicates node is active
     dep_graph["pos"] = make_pair(true, vector<string>());
@@ -231,14 +638,7 @@ DerivEngine initialize_engine_from_hdf5(int n_atom, hid_t potential_group, bool
     for(auto &nm : topo_order) {
         // if(!quiet)  printf("initializing %-27s%s", nm.c_str(), nm=="pos" ? "\n" : ""); 
         if(nm=="pos") continue;  // pos node is added specially
-        // some name in the node_creation_map must be a prefix of this name
-        string node_type_name = "";
-        for(auto &kv : m) {
-            if(is_prefix(kv.first, nm))
-                node_type_name = kv.first;
-        }
-        if(node_type_name == "") throw string("No node type found for name '") + nm + "'";
-        NodeCreationFunction& node_func = m[node_type_name];
+        NodeCreationFunction& node_func = node_creation_function(nm);
 
         auto argument_names = read_attribute<vector<string>>(potential_group, nm.c_str(), "arguments");
         ArgList arguments;
@@ -261,11 +661,13 @@ DerivEngine initialize_engine_from_hdf5(int n_atom, hid_t potential_group, bool
             auto grp = open_group(potential_group,nm.c_str());
             auto computation = unique_ptr<DerivComputation>(node_func(grp.get(),arguments));
             engine.add_node(nm, move(computation), argument_names);
+            engine.nodes.back().force_group = read_attribute<int>(grp.get(), ".", "force_group", 0);
         } catch(const string &e) {
             throw "while adding '" + nm + "', " + e;
         }
     }
 
+    engine.build_schedule();
     return engine;
 }
 
@@ -4,9 +4,11 @@
 #include "h5_support.h"
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <functional>
 #include <initializer_list>
 #include <map>
+#include <memory>
 #include "vector_math.h"
 
 //!\brief Copy VecArray to a flat float* array
@@ -41,7 +43,51 @@ recenter(
 //! \brief Whether to compute potential value as well as its derivative
 enum ComputeMode {
     DerivMode = 0, //!< Only derivative must be computed correctly (potential may not be correct)
-    PotentialAndDerivMode = 1 //!< Compute potential and derivative correctly
+    PotentialAndDerivMode = 1, //!< Compute potential and derivative correctly
+    PotentialOnlyMode = 2 //!< Only potential must be computed correctly (derivative is not computed)
+};
+
+struct CoordNode;
+
+//! \brief Vector of non-null CoordNode pointers
+typedef std::vector<CoordNode*> ArgList;
+
+//! \brief Elements of a node output changed by a partial update (see DerivEngine::compute_incremental)
+//!
+//! Marking an element saves its value in each of arrays (the node output, and the rotations of
+//! a FrameNode), so that swap_saved can switch the node between its values before and after
+//! the update.
+struct DirtySet {
+    std::vector<int>      elems;   //!< dirty elements, each listed once
+    std::vector<char>     mask;    //!< nonzero for dirty elements
+    std::vector<VecArray> arrays;  //!< arrays whose rows are saved for dirty elements
+    std::vector<float>    saved;   //!< saved rows, for each element in the order of arrays
+
+    //! Mark all of n_elem elements clean
+    void reset(int n_elem, std::vector<VecArray> arrays_ = {}) {
+        elems.clear(); mask.assign(n_elem, 0); arrays = std::move(arrays_); saved.clear();
+    }
+    //! Mark element i dirty, saving its current value
+    void add(int i) {add(i, arrays);}
+    //! Mark element i dirty, where values holds its value before the update in place of arrays
+    void add(int i, const std::vector<VecArray>& values) {
+        if(mask[i]) return;
+        mask[i] = 1;
+        elems.push_back(i);
+        for(auto& a: values) saved.insert(saved.end(), &a(0,i), &a(0,i)+a.row_width);
+    }
+    //! Exchange the saved values of the dirty elements with those in arrays
+    void swap_saved() {
+        auto s = saved.begin();
+        for(int i: elems)
+            for(auto& a: arrays) {
+                std::swap_ranges(&a(0,i), &a(0,i)+a.row_width, s);
+                s += a.row_width;
+            }
+    }
+    bool contains(int i) const {return mask[i];}
+    bool empty() const {return elems.empty();}
+    int  size()  const {return elems.size();}
 };
 
 //! \brief Differentiable computation node
@@ -63,6 +109,12 @@ struct DerivComputation
     //! \brief Uses its sensitivity to its output to add to sensivities of its inputs
     virtual void propagate_deriv() =0;
 
+    //! \brief True if compute_value handles PotentialOnlyMode
+    //!
+    //! Nodes that return true may skip their derivative work in PotentialOnlyMode.  For
+    //! other nodes, DerivEngine calls compute_value(PotentialAndDerivMode) instead.
+    virtual bool potential_only_supported() const {return false;}
+
     //! \brief Return arbitrary subset of parameters
     virtual std::vector<float> get_param() const {return std::vector<float>();}
 
@@ -77,6 +129,37 @@ struct DerivComputation
     virtual std::vector<float> get_value_by_name(const char* log_name) {
         throw std::string("No values implemented");
     }
+
+    //! \brief Copy of this computation that takes its inputs from args
+    //!
+    //! Parameter tables that are not modified by compute_value may be shared with
+    //! the original, but all other state must be copied.  The copy does not register
+    //! any loggers.  Returns null if the node does not support cloning, in which case
+    //! DerivEngine::clone constructs the node again from its HDF5 group.
+    virtual DerivComputation* clone(const ArgList& args) const {return nullptr;}
+
+    //! \brief Discard state kept between evaluations only to accelerate them
+    //!
+    //! Examples are pairlist caches and warm starts of iterative solvers.  After this call,
+    //! the node must evaluate exactly as a newly constructed node would, so that a simulation
+    //! restarted from a checkpoint reproduces the uninterrupted simulation bit for bit.
+    virtual void reset_caches() {}
+
+    //! \brief True if update_dirty is implemented
+    //!
+    //! For other nodes, DerivEngine::compute_incremental recomputes the whole node.
+    virtual bool incremental_supported() const {return false;}
+
+    //! \brief Update for a change of the dirty argument elements (see DerivEngine::compute_incremental)
+    //!
+    //! arg_dirty has an entry for each argument.  Called twice, first with old_args true while
+    //! the arguments hold their values before the change, then with old_args false for their
+    //! current values.  A CoordNode must mark in dirty each output element that changes before
+    //! modifying it, and must have updated them after the second call.  A PotentialNode returns
+    //! the sum of its terms that depend on dirty argument elements, so that its potential
+    //! changes by the difference of the two calls.  Derivatives need not be updated.
+    virtual double update_dirty(const std::vector<const DirtySet*>& arg_dirty, DirtySet& dirty,
+            bool old_args) {return 0.;}
 };
 
 //! Specialization of DerivComputation for derived coordinates
@@ -96,6 +179,22 @@ struct CoordNode : public DerivComputation
 };
 
 
+//! \brief Specialization of CoordNode for rigid body frames
+//!
+//! Each output element is a translation followed by a unit quaternion.  The rotation
+//! matrix of each frame is computed along with the output, so that the nodes placing
+//! points in these frames need not convert the quaternions themselves.
+struct FrameNode : public CoordNode
+{
+    VecArrayStorage rotation; //!< row-major rotation matrix of each frame (9 components)
+
+    //! Initialize from the number of frames
+    FrameNode(int n_elem_):
+        CoordNode(n_elem_, 7),
+        rotation(9, round_up(n_elem,4)) {}
+};
+
+
 //! Specialization of DerivComputation for potential terms
 struct PotentialNode : public DerivComputation
 {
@@ -141,6 +240,11 @@ struct Pos : public CoordNode
 };
 
 
+//! \brief Deleter for memory from posix_memalign
+struct FreeDeleter {
+    void operator()(float* p) const {free(p);}
+};
+
 //! Main class to represent differentiable computational graph
 struct DerivEngine
 {
@@ -155,12 +259,18 @@ struct DerivEngine
         int germ_exec_level; //!< Directed acyclic graph height of compute_value computation
         int deriv_exec_level;//!< Directed acyclic graph height of propagate_deriv computation
 
+        //! \brief Force group of a potential node for multiple time step integration
+        //!
+        //! 0 is the fast group evaluated at every step, and 1 is the slow group.  Read from
+        //! the force_group attribute of the node (default 0).
+        int force_group;
+
         //! \brief Construct from name and unique_ptr to computation
         Node(std::string name_, std::unique_ptr<DerivComputation> computation_):
-            name(name_), computation(std::move(computation_)) {};
+            name(name_), computation(std::move(computation_)), force_group(0) {};
         //! \brief Construct from name and raw pointer to computation
         Node(std::string name_, DerivComputation* computation_):
-            name(name_), computation(computation_) {};
+            name(name_), computation(computation_), force_group(0) {};
         Node(const Node& other) = delete;
         //! \brief Move constructor (Node's are not copyable)
         Node(Node&& other):
@@ -169,10 +279,15 @@ struct DerivEngine
             parents(std::move(other.parents)),
             children(std::move(other.children)),
             germ_exec_level(other.germ_exec_level),
-            deriv_exec_level(other.deriv_exec_level)
+            deriv_exec_level(other.deriv_exec_level),
+            force_group(other.force_group)
         {}
     };
 
+    //! \brief Storage for the output and sens of every CoordNode (null until build_arena)
+    //!
+    //! Declared before nodes, so that it outlives them.
+    std::unique_ptr<float,FreeDeleter> arena;
     //! \brief vector of all Node's in the computation graph
     //!
     //! nodes[0] is guaranteed to be the Pos node
@@ -182,14 +297,62 @@ struct DerivEngine
     //! \brief potential energy output of the computation graph
     //!
     //! The potential should only be read after calling compute(PotentialAndDerivMode)
-    //! and may be any value after the completion of compute(DerivMode)
+    //! or compute(PotentialOnlyMode) and may be any value after the completion of
+    //! compute(DerivMode)
     float potential;
 
+    //! \brief Single compute_value step of a precompiled Schedule
+    struct ScheduleEntry {
+        DerivComputation* computation; //!< node to execute
+        ComputeMode    mode;   //!< mode passed to compute_value
+        CoordNode*     coord;  //!< non-null if sens must be zeroed after compute_value
+        PotentialNode* pot;    //!< non-null if potential must be accumulated after compute_value
+    };
+
+    //! \brief Flat execution order of the graph for a single ComputeMode
+    //!
+    //! The order is exactly that of the BFS traversal in compute_bfs, but it is
+    //! determined only once so that compute needs no per-call bookkeeping.
+    struct Schedule {
+        std::vector<ScheduleEntry>     forward;  //!< compute_value calls in execution order
+        std::vector<DerivComputation*> backward; //!< propagate_deriv calls in execution order
+
+        //! \brief Groups of indices into forward that may execute concurrently
+        //!
+        //! Batches never mix DAG levels and nodes in a batch share no parents,
+        //! so their writes to parent sensitivities cannot conflict.
+        std::vector<std::vector<int>> forward_batches;
+        //! \brief Groups of indices into backward that may execute concurrently
+        std::vector<std::vector<int>> backward_batches;
+    };
+
+    //! \brief Precompiled schedules, indexed by ComputeMode
+    Schedule schedule[3];
+    //! \brief DerivMode schedules of only the nodes needed by each force group
+    Schedule group_schedule[2];
+    //! \brief False if nodes were added since the schedules were last built
+    bool schedule_valid;
+    //! \brief Number of OpenMP threads used to execute independent nodes (1 means serial)
+    int n_threads;
+    //! \brief Largest fraction of dirty elements for which compute_incremental updates a node
+    //! incrementally rather than recomputing it (past about 2% of the atoms of a large system,
+    //! recomputing is faster)
+    float incremental_max_fraction;
+    //! \brief Number of inner steps taken by respa_integration_cycle
+    long inner_step;
+    //! \brief In-memory copy of the potential group, used by clone for nodes
+    //! that do not implement DerivComputation::clone (null if not retained)
+    std::shared_ptr<h5::H5Obj> potential_source;
+
     //! \brief Default constructor (not used)
-    DerivEngine() {}
+    DerivEngine(): schedule_valid(false), n_threads(1), incremental_max_fraction(0.02f), inner_step(0) {}
     //! \brief Construct from number of atoms
     DerivEngine(int n_atom): 
-        potential(0.f)
+        potential(0.f),
+        schedule_valid(false),
+        n_threads(1),
+        incremental_max_fraction(0.02f),
+        inner_step(0)
     {
         nodes.emplace_back("pos", new Pos(n_atom));
         pos = dynamic_cast<Pos*>(nodes[0].computation.get());
@@ -223,27 +386,98 @@ struct DerivEngine
 
     //! \brief Execute computational graph
     //!
-    //! See ComputeMode for details.
+    //! See ComputeMode for details.  Replays the precompiled schedule for the mode,
+    //! building it first if the graph has changed.  If n_threads>1, the batches of
+    //! each level are run as OpenMP tasks.  Compiling with
+    //! -DDERIV_ENGINE_BFS_SCHEDULE uses compute_bfs instead.  PotentialOnlyMode
+    //! skips propagate_deriv entirely, so pos->sens is not valid afterward.
     void compute(ComputeMode mode);
 
+    //! \brief Execute computational graph by level-by-level BFS traversal
+    //!
+    //! Slow reference implementation of compute, retained for debugging the schedule.
+    void compute_bfs(ComputeMode mode);
+
+    //! \brief Compute derivatives of the potential nodes in one force group only
+    //!
+    //! Only the nodes that the force group depends on are executed.  pos->sens
+    //! receives the derivative of the group's potential.
+    void compute_force_group(int force_group);
+
+    //! \brief Replay a schedule (see compute)
+    void run_schedule(const Schedule& sched, ComputeMode mode);
+
+    //! \brief Build the forward and backward schedules for all ComputeMode's
+    //!
+    //! Also sets germ_exec_level and deriv_exec_level for each Node.
+    void build_schedule();
+
+    //! \brief Split a schedule order into batches of nodes that may run concurrently
+    std::vector<std::vector<int>> make_batches(const std::vector<int>& order, 
+            const std::function<int(int)>& level);
+
+    //! \brief Move the output and sens of all CoordNode's into one contiguous arena
+    //!
+    //! Buffers are laid out in forward schedule order, each 64-byte aligned.  The
+    //! arena is zeroed and filled by the calling thread, so that on NUMA machines its
+    //! pages are local to that thread, which should be the thread that integrates
+    //! this engine.  If huge_pages, transparent huge pages are requested for the
+    //! arena.  Node values are preserved, and clone does not copy the arena.
+    void build_arena(bool huge_pages=false);
+
+    //! \brief Update the outputs and potential after a move of only the atoms in moved
+    //!
+    //! On entry, the node outputs and potentials must be those of old_pos (for example after
+    //! compute(PotentialOnlyMode) there), and pos->output may differ from old_pos only for
+    //! the moved atoms.  Nodes are updated in order, each with DerivComputation::update_dirty
+    //! if it supports it and at most incremental_max_fraction of the elements of each argument
+    //! are dirty, and otherwise recomputed whole.  Returns false without changing anything if
+    //! more than incremental_max_fraction of the atoms moved, in which case compute should be
+    //! used.  Derivatives are not updated.
+    bool compute_incremental(VecArrayStorage& old_pos, const std::vector<int>& moved);
+
+    //! \brief Call DerivComputation::reset_caches for every node
+    void reset_caches() {for(auto& n: nodes) n.computation->reset_caches();}
+
     //! \brief Integration scheme (i.e. position and velocity update weights) to use
     enum IntegratorType {Verlet=0, Predescu=1};
 
+    //! \brief Deep copy of the engine, including positions, force groups, and parameters
+    //!
+    //! Nodes are copied with DerivComputation::clone where available, so that
+    //! parameter tables are shared and no spline fitting is repeated.  Other nodes
+    //! are reconstructed from potential_source, and an exception is thrown if such
+    //! a node exists and the source was not retained.  Reconstructed nodes are given
+    //! the current parameters of the original (see DerivComputation::get_param) where
+    //! these differ from the source.  Cloning reads HDF5 and must not run concurrently
+    //! with other HDF5 access.
+    DerivEngine clone() const;
+
     //! \brief Perform a full integration cycle (3 time steps)
     //!
     //! See integration_stage for details.
     void integration_cycle(VecArray mom, float dt, float max_force,
             IntegratorType type = Verlet);
+
+    //! \brief Perform a full integration cycle (3 time steps) with multiple time steps (RESPA)
+    //!
+    //! The fast force group is applied at every step as in integration_cycle with
+    //! Verlet weights.  The slow force group is applied as an impulse of slow_interval*dt
+    //! every slow_interval steps, counted by inner_step across cycles.  With
+    //! slow_interval 1, this is equivalent to integration_cycle apart from the cost of
+    //! evaluating the force groups separately.
+    void respa_integration_cycle(VecArray mom, float dt, float max_force, int slow_interval);
 };
 
 //! \brief Count the number hbonds for a system
 double get_n_hbond(DerivEngine &engine);
 
 //! \brief Construct DerivEngine from potential group
-DerivEngine initialize_engine_from_hdf5(int n_atom, hid_t potential_group, bool quiet=false);
-
-//! \brief Vector of non-null CoordNode pointers
-typedef std::vector<CoordNode*> ArgList;
+//!
+//! If retain_source, an in-memory copy of the potential group is kept so that
+//! DerivEngine::clone can reconstruct nodes that do not implement clone.
+DerivEngine initialize_engine_from_hdf5(int n_atom, hid_t potential_group, bool quiet=false,
+        bool retain_source=false);
 
 //! \brief DerivComputation factory
 //!
@@ -272,6 +506,9 @@ void check_elem_width_lower_bound(const CoordNode& node, int elem_width_lower_bo
 //! \brief Throw except if ArgList is not length n_expected
 void check_arguments_length(const ArgList& arguments, int n_expected);
 
+//! \brief Throw exception if node is not a FrameNode (such as affine_alignment), else return it
+FrameNode& as_frame_node(CoordNode& node);
+
 //! \brief Register class that takes n_args
 template <typename NodeClass, int n_args>
 struct RegisterNodeType {
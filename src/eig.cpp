@@ -274,7 +274,7 @@ symm_QR_4x4(
 }
 
 
-struct AffineAlignment : public CoordNode
+struct AffineAlignment : public FrameNode
 {
     struct Params {
         alignas(16) int32_t atom_offsets[3][4];
@@ -288,7 +288,7 @@ struct AffineAlignment : public CoordNode
     unique_ptr<Float4[]> evecs_storage;
 
     AffineAlignment(hid_t grp, CoordNode& pos_):
-        CoordNode(get_dset_size(2, grp, "atoms")[0], 7),
+        FrameNode(get_dset_size(2, grp, "atoms")[0]),
         n_group(round_up(n_elem,4)/4),
         
         pos(pos_), params(n_group),
@@ -314,79 +314,113 @@ struct AffineAlignment : public CoordNode
         }
     }
 
-    virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("affine_alignment"));
-
+    void compute_group(int ng, const float* posc) {
         VecArray rigid_body = output;
-        float* posc = pos.output.x.get();
+        const auto& p = params[ng];
+
+        auto atom1 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[0]));
+        auto atom2 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[1]));
+        auto atom3 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[2]));
+
+        auto center = S(1.f/3.f)*(atom1+atom2+atom3);
+        atom1 -= center;
+        atom2 -= center;
+        atom3 -= center;
+
+        auto ref_geom1 = make_vec3(Float4(p.ref_geom[0][0]), Float4(p.ref_geom[0][1]), Float4(p.ref_geom[0][2]));
+        auto ref_geom2 = make_vec3(Float4(p.ref_geom[1][0]), Float4(p.ref_geom[1][1]), Float4(p.ref_geom[1][2]));
+        auto ref_geom3 = make_vec3(Float4(p.ref_geom[2][0]), Float4(p.ref_geom[2][1]), Float4(p.ref_geom[2][2]));
+
+        S R_[3][3];
+        #define R(i,j) (R_[i][j])
+        for(int i=0; i<3; ++i)
+            for(int j=0; j<3; ++j)
+                R(i,j) = atom1[j] * ref_geom1[i]
+                       + atom2[j] * ref_geom2[i]
+                       + atom3[j] * ref_geom3[i];
+
+        S F[10] = {R(0,0)+R(1,1)+R(2,2), R(1,2)-R(2,1),         R(2,0)-R(0,2),         R(0,1)-R(1,0),
+                                         R(0,0)-R(1,1)-R(2,2),  R(0,1)+R(1,0),         R(0,2)+R(2,0),
+                                                               -R(0,0)+R(1,1)-R(2,2),  R(1,2)+R(2,1),
+                                                                                      -R(0,0)-R(1,1)+R(2,2)};
+        #undef R
+
+        // S evals[4], evecs[16];
+        Float4* restrict evals = evals_storage.get() + ng* 4;
+        Float4* restrict evecs = evecs_storage.get() + ng*16;
+
+        symm_QR_4x4(evals, evecs, F, 1e-5f, 100);
+
+        // swap largest eigenvalue into location 0
+        for(int i=1; i<4; ++i) {
+            auto do_flip = evals[0] < evals[i];
+
+            auto eval0 = ternary(do_flip, evals[i], evals[0]);
+            auto evali = ternary(do_flip, evals[0], evals[i]);
+            evals[0] = eval0;
+            evals[i] = evali;
+
+            for(int d=0; d<4; ++d) {
+                auto evec0 = ternary(do_flip, evecs[i*4+d], evecs[0*4+d]);
+                auto eveci = ternary(do_flip, evecs[0*4+d], evecs[i*4+d]);
+                evecs[0*4+d] = evec0;
+                evecs[i*4+d] = eveci;
+            }
+        }
 
-        for(int ng=0; ng<n_group; ++ng) {
-            const auto& p = params[ng];
+        Vec<8,S> body; // really 7 components but I need the eight for the transpose
+        for(int j=0; j<3; ++j) body[j] = center[j];
+        for(int j=0; j<4; ++j) body[3+j] = evecs[0*4+j];
 
-            auto atom1 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[0]));
-            auto atom2 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[1]));
-            auto atom3 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[2]));
-
-            auto center = S(1.f/3.f)*(atom1+atom2+atom3);
-            atom1 -= center;
-            atom2 -= center;
-            atom3 -= center;
-
-            auto ref_geom1 = make_vec3(Float4(p.ref_geom[0][0]), Float4(p.ref_geom[0][1]), Float4(p.ref_geom[0][2]));
-            auto ref_geom2 = make_vec3(Float4(p.ref_geom[1][0]), Float4(p.ref_geom[1][1]), Float4(p.ref_geom[1][2]));
-            auto ref_geom3 = make_vec3(Float4(p.ref_geom[2][0]), Float4(p.ref_geom[2][1]), Float4(p.ref_geom[2][2]));
-
-            S R_[3][3];
-            #define R(i,j) (R_[i][j])
-            for(int i=0; i<3; ++i)
-                for(int j=0; j<3; ++j)
-                    R(i,j) = atom1[j] * ref_geom1[i]
-                           + atom2[j] * ref_geom2[i]
-                           + atom3[j] * ref_geom3[i];
-
-            S F[10] = {R(0,0)+R(1,1)+R(2,2), R(1,2)-R(2,1),         R(2,0)-R(0,2),         R(0,1)-R(1,0),
-                                             R(0,0)-R(1,1)-R(2,2),  R(0,1)+R(1,0),         R(0,2)+R(2,0),
-                                                                   -R(0,0)+R(1,1)-R(2,2),  R(1,2)+R(2,1),
-                                                                                          -R(0,0)-R(1,1)+R(2,2)};
-            #undef R
-
-            // S evals[4], evecs[16];
-            Float4* restrict evals = evals_storage.get() + ng* 4;
-            Float4* restrict evecs = evecs_storage.get() + ng*16;
-
-            symm_QR_4x4(evals, evecs, F, 1e-5f, 100);
-
-            // swap largest eigenvalue into location 0
-            for(int i=1; i<4; ++i) {
-                auto do_flip = evals[0] < evals[i];
-
-                auto eval0 = ternary(do_flip, evals[i], evals[0]);
-                auto evali = ternary(do_flip, evals[0], evals[i]);
-                evals[0] = eval0;
-                evals[i] = evali;
-
-                for(int d=0; d<4; ++d) {
-                    auto evec0 = ternary(do_flip, evecs[i*4+d], evecs[0*4+d]);
-                    auto eveci = ternary(do_flip, evecs[0*4+d], evecs[i*4+d]);
-                    evecs[0*4+d] = evec0;
-                    evecs[i*4+d] = eveci;
-                }
-            }
+        transpose4(body[0],body[1],body[2],body[3]);
+        for(int i=0; i<4; ++i) body[i].store(&rigid_body(0,4*ng+i));
 
-            Vec<8,S> body; // really 7 components but I need the eight for the transpose
-            for(int j=0; j<3; ++j) body[j] = center[j];
-            for(int j=0; j<4; ++j) body[3+j] = evecs[0*4+j];
+        transpose4(body[4],body[5],body[6],body[7]);
+        for(int i=0; i<4; ++i) body[4+i].store(&rigid_body(4,4*ng+i));
 
-            transpose4(body[0],body[1],body[2],body[3]);
-            for(int i=0; i<4; ++i) body[i].store(&rigid_body(0,4*ng+i));
+        // rotation matrices (as in quat_to_rot) for the nodes placing points in the frames
+        const S a = evecs[0], b = evecs[1], c = evecs[2], d = evecs[3];
+        const S two_ = two<S>();
+        Vec<12,S> U; // 9 components padded for the transpose
+        U[0] = a*a+b*b-c*c-d*d;  U[1] = two_*b*c-two_*a*d; U[2] = two_*b*d+two_*a*c;
+        U[3] = two_*b*c+two_*a*d; U[4] = a*a-b*b+c*c-d*d;  U[5] = two_*c*d-two_*a*b;
+        U[6] = two_*b*d-two_*a*c; U[7] = two_*c*d+two_*a*b; U[8] = a*a-b*b-c*c+d*d;
+        U[9] = U[10] = U[11] = zero<S>();
 
-            transpose4(body[4],body[5],body[6],body[7]);
-            for(int i=0; i<4; ++i) body[4+i].store(&rigid_body(4,4*ng+i));
+        for(int j=0; j<12; j+=4) {
+            transpose4(U[j],U[j+1],U[j+2],U[j+3]);
+            for(int i=0; i<4; ++i) U[j+i].store(&rotation(j,4*ng+i));
+        }
+    }
+
+    virtual void compute_value(ComputeMode mode) {
+        Timer timer("affine_alignment");
+        float* posc = pos.output.x.get();
+        for(int ng=0; ng<n_group; ++ng) compute_group(ng, posc);
+    }
+
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        if(old_args) return 0.;  // the elements are computed from the current positions
+        auto& moved = *arg_dirty[0];
+        for(int ne=0; ne<n_elem; ++ne)
+            for(int j: range(3))
+                if(moved.contains(params[ne/4].atom_offsets[j][ne%4]/pos.output.row_width)) {dirty.add(ne); break;}
+
+        // residues are computed in groups of 4, so each group is computed once
+        float* posc = pos.output.x.get();
+        int last_group = -1;
+        for(int ne: dirty.elems) {
+            if(ne/4 == last_group) continue;
+            compute_group(ne/4, posc);
+            last_group = ne/4;
         }
+        return 0.;
     }
 
     virtual void propagate_deriv() {
-        Timer timer(string("affine_alignment_deriv"));
+        Timer timer("affine_alignment_deriv");
         float* pos_sens = pos.sens.x.get();
 
         for(int ng=0; ng<n_group; ++ng) {
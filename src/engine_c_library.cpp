@@ -1,16 +1,25 @@
 #include "engine_c_library.h"
 #include "deriv_engine.h"
 #include <algorithm>
+#include <cstring>
 #include "spline.h"
 
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
 using namespace h5;
 using namespace std;
 
 DerivEngine* construct_deriv_engine(int n_atom, const char* potential_file, bool quiet) try {
-    H5Obj config = h5_obj(H5Fclose, H5Fopen(potential_file, H5F_ACC_RDONLY, H5P_DEFAULT));
+    H5Obj config;
+    {
+        H5Lock lock;
+        config = h5_obj(H5Fclose, H5Fopen(potential_file, H5F_ACC_RDONLY, H5P_DEFAULT));
+    }
     auto potential_group = open_group(config.get(), "/input/potential");
     
-    auto engine = new DerivEngine(initialize_engine_from_hdf5(n_atom, potential_group.get(), quiet));
+    auto engine = new DerivEngine(initialize_engine_from_hdf5(n_atom, potential_group.get(), quiet, true));
     return engine;
 } catch(const string& e) {
     fprintf(stderr, "\n\nERROR: %s\n", e.c_str());
@@ -25,6 +34,19 @@ void free_deriv_engine(DerivEngine* engine) {
 }
 
 
+DerivEngine* clone_deriv_engine(DerivEngine* engine) try {
+    return new DerivEngine(engine->clone());
+} catch(const char* e) {
+    fprintf(stderr, "\n\nERROR: %s\n", e);
+    return 0;
+} catch(const string& e) {
+    fprintf(stderr, "\n\nERROR: %s\n", e.c_str());
+    return 0;
+} catch(...) {
+    return 0;
+}
+
+
 // 0 indicates success, anything else is failure
 int evaluate_energy(float* energy, DerivEngine* engine, const float* pos) try {
     VecArray a = engine->pos->output;
@@ -64,6 +86,141 @@ int evaluate_deriv(float* deriv, DerivEngine* engine, const float* pos) try {
 }
 
 
+struct EnginePool {
+    DerivEngine* source;  // parameters are taken from this engine
+    vector<unique_ptr<DerivEngine>> engines;
+    vector<vector<float>> param;  // parameters of each node of the pool engines
+};
+
+
+EnginePool* construct_engine_pool(DerivEngine* engine, int n_engine) try {
+    if(n_engine<1) throw string("engine pool must have at least one engine");
+
+    unique_ptr<EnginePool> pool(new EnginePool);
+    pool->source = engine;
+    for(int i=0; i<n_engine; ++i)
+        pool->engines.emplace_back(new DerivEngine(engine->clone()));
+    for(auto& n: engine->nodes)
+        pool->param.push_back(n.computation->get_param());
+    return pool.release();
+} catch(const string& e) {
+    fprintf(stderr, "\n\nERROR: %s\n", e.c_str());
+    return 0;
+} catch(...) {
+    return 0;
+}
+
+
+void free_engine_pool(EnginePool* pool) {
+    delete pool;
+}
+
+
+// 0 indicates success, anything else is failure
+int evaluate_frames(int n_frame, float* energy, float* node_energy, float* deriv,
+        EnginePool* pool, const float* pos) try {
+    auto& source = *pool->source;
+    int n_atom   = source.pos->n_atom;
+    int n_engine = pool->engines.size();
+
+    vector<int> potential_nodes;
+    for(int i: range(source.nodes.size()))
+        if(source.nodes[i].computation->potential_term) potential_nodes.push_back(i);
+
+    // the pool must see any parameters set on the source engine since the last call, but
+    // set_param may refit splines, so only changed parameters are copied
+    for(int i: range(source.nodes.size())) {
+        auto param = source.nodes[i].computation->get_param();
+        if(param == pool->param[i]) continue;
+        for(auto& e: pool->engines) e->nodes[i].computation->set_param(param);
+        pool->param[i] = move(param);
+    }
+
+    // Each engine takes a contiguous block of frames, so that consecutive frames
+    // benefit from any state carried between evaluations (e.g. rotamer warm starts)
+    // and the results do not depend on thread timing
+    bool has_error = false;
+    string error_msg;
+    #pragma omp parallel num_threads(n_engine)
+    {
+#if defined(_OPENMP)
+        int i_engine = omp_get_thread_num();
+        int n_team   = omp_get_num_threads();
+#else
+        int i_engine = 0;
+        int n_team   = 1;
+#endif
+        auto& engine = *pool->engines[i_engine];
+        try {
+            for(int nf=(long(n_frame)*i_engine)/n_team; nf<(long(n_frame)*(i_engine+1))/n_team; ++nf) {
+                VecArray a = engine.pos->output;
+                for(int na: range(n_atom))
+                    for(int d: range(3))
+                        a(d,na) = pos[(long(nf)*n_atom+na)*3+d];
+
+                engine.compute(deriv ? PotentialAndDerivMode : PotentialOnlyMode);
+                energy[nf] = engine.potential;
+
+                if(node_energy)
+                    for(int i: range(potential_nodes.size()))
+                        node_energy[long(nf)*potential_nodes.size()+i] = 
+                            static_cast<PotentialNode*>(engine.nodes[potential_nodes[i]].computation.get())->potential;
+
+                if(deriv) {
+                    VecArray b = engine.pos->sens;
+                    for(int na: range(n_atom))
+                        for(int d: range(3))
+                            deriv[(long(nf)*n_atom+na)*3+d] = b(d,na);
+                }
+            }
+        } catch(const char* e) {
+            #pragma omp critical (evaluate_frames_error)
+            if(!has_error) {has_error = true; error_msg = e;}
+        } catch(const string& e) {
+            #pragma omp critical (evaluate_frames_error)
+            if(!has_error) {has_error = true; error_msg = e;}
+        } catch(...) {
+            #pragma omp critical (evaluate_frames_error)
+            if(!has_error) {has_error = true; error_msg = "unknown error";}
+        }
+    }
+    if(has_error) throw error_msg;
+    return 0;
+} catch(const char* e) {
+    fprintf(stderr, "\n\nERROR: %s\n", e);
+    return 1;
+} catch(const string& e) {
+    fprintf(stderr, "\n\nERROR: %s\n", e.c_str());
+    return 1;
+} catch(...) {
+    return 1;
+}
+
+
+int get_n_potential_node(int* n_node, DerivEngine* engine) {
+    *n_node = 0;
+    for(auto& n: engine->nodes) *n_node += n.computation->potential_term;
+    return 0;
+}
+
+
+int get_potential_node_name(int n_char, char* name, DerivEngine* engine, int i_node) try {
+    for(auto& n: engine->nodes) {
+        if(!n.computation->potential_term) continue;
+        if(i_node--) continue;
+        if(int(n.name.size())+1 > n_char) throw string("name buffer too small for ") + n.name;
+        strcpy(name, n.name.c_str());
+        return 0;
+    }
+    throw string("potential node index out of range");
+} catch(const string& s) {
+    fprintf(stderr, "ERROR: %s\n", s.c_str());
+    return 1;
+} catch(...) {
+    return 1;
+}
+
+
 int set_param(int n_param, const float* param, DerivEngine* engine, const char* node_name) try {
     vector<float> param_v(param, param+n_param);
     engine->get(string(node_name)).computation->set_param(param_v);
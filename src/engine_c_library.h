@@ -5,6 +5,7 @@
 
 extern "C" {
     struct DerivEngine;
+    struct EnginePool;
 
     // defined in main.h
     // int upside_main(int argc, const char* const char*)
@@ -12,9 +13,25 @@ extern "C" {
     DerivEngine* construct_deriv_engine(int n_atom, const char* potential_file, bool quiet);
     void free_deriv_engine(DerivEngine* engine);
 
+    // Deep copy of engine that does not read the potential file again
+    DerivEngine* clone_deriv_engine(DerivEngine* engine);
+
     int evaluate_energy(float* energy, DerivEngine* engine, const float* pos);
     int evaluate_deriv (float* deriv,  DerivEngine* engine, const float* pos);
 
+    // Batched evaluation of many frames on a pool of engines running in parallel.  The pool
+    // takes the parameters of engine at each call of evaluate_frames.
+    EnginePool* construct_engine_pool(DerivEngine* engine, int n_engine);
+    void free_engine_pool(EnginePool* pool);
+
+    // pos is (n_frame,n_atom,3), energy is (n_frame,), node_energy is (n_frame,n_potential_node),
+    // and deriv is (n_frame,n_atom,3).  node_energy and deriv may be null if not needed.
+    int evaluate_frames(int n_frame, float* energy, float* node_energy, float* deriv,
+            EnginePool* pool, const float* pos);
+
+    int get_n_potential_node   (int* n_node, DerivEngine* engine);
+    int get_potential_node_name(int n_char, char* name, DerivEngine* engine, int i_node);
+
     int set_param      (int n_param, const  float* param,  DerivEngine* engine, const char* node_name);
 
     int get_param_deriv(int n_param,  float* deriv,  DerivEngine* engine, const char* node_name);
@@ -83,7 +83,7 @@ struct EnvironmentCoverage : public CoordNode {
     }
 
     virtual void compute_value(ComputeMode mode) override {
-        Timer timer(string("environment_coverage"));
+        Timer timer("environment_coverage");
 
         igraph.compute_edges();
 
@@ -92,14 +92,27 @@ struct EnvironmentCoverage : public CoordNode {
             output(0, igraph.edge_indices1[ne]) += igraph.edge_value[ne];
     }
 
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        // edges touching a moved element are subtracted at their old values and added at their new
+        float sign = old_args ? -1.f : 1.f;
+        igraph.visit_dirty_edges(*arg_dirty[0], arg_dirty[1], [&](int ne, int ns, float value) {
+                dirty.add(ne);
+                output(0,ne) += sign*value;});
+        return 0.;
+    }
+
     virtual void propagate_deriv() override {
-        Timer timer(string("d_environment_coverage"));
+        Timer timer("d_environment_coverage");
 
         for(int ne: range(igraph.n_edge))
             igraph.edge_sensitivity[ne] = sens(0,igraph.edge_indices1[ne]);
         igraph.propagate_derivatives();
     }
 
+    virtual void reset_caches() override {igraph.reset_caches();}
+
     virtual std::vector<float> get_param() const override {return igraph.get_param();}
 #ifdef PARAM_DERIV
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
@@ -1,8 +1,26 @@
 #include "h5_support.h"
+#include <mutex>
 
 
 namespace h5 {
 
+namespace {
+    std::mutex& h5_mutex() {
+        static std::mutex mut;
+        return mut;
+    }
+    thread_local int h5_lock_depth = 0;  // H5Lock's held by this thread
+}
+
+H5Lock::H5Lock() {
+    if(!h5_lock_depth) h5_mutex().lock();
+    ++h5_lock_depth;
+}
+
+H5Lock::~H5Lock() {
+    if(!--h5_lock_depth) h5_mutex().unlock();
+}
+
 hid_t h5_noerr(hid_t i) {
     if(i<0) {
         // H5Eprint2(H5E_DEFAULT, stderr);
@@ -26,6 +44,7 @@ H5Obj h5_obj(H5DeleterFunc &deleter, hid_t obj)
 
 std::vector<hsize_t> get_dset_size(int ndims, hid_t group, const char* name) 
 try {
+    H5Lock lock;
     std::vector<hsize_t> ret(ndims, 0);
     auto dset  = h5_obj(H5Dclose, H5Dopen2(group, name, H5P_DEFAULT));
     auto space = h5_obj(H5Sclose, H5Dget_space(dset.get()));
@@ -42,6 +61,7 @@ try {
 
 
 bool h5_exists(hid_t base, const char* nm) {
+    H5Lock lock;
     // Note that this function does not do the full dance specified in 
     // the documentation for H5Oexists_by_name.  I don't think this will cause
     // false results but if there is a problem, consult the h5 docs.
@@ -56,6 +76,7 @@ bool h5_exists(hid_t base, const char* nm) {
 
 bool read_attribute(void* attr_value_output, hid_t h5, const char* path, const char* attr_name, hid_t predtype)
 try {
+    H5Lock lock;
     if(!h5_exists(h5, path))
         throw std::string("path does not exist in h5 file");
 
@@ -74,6 +95,7 @@ catch(const std::string &e) {
 template <>
 std::vector<std::string> read_attribute<std::vector<std::string>>(hid_t h5, const char* path, const char* attr_name) 
 try {
+    H5Lock lock;
     if(!h5_exists(h5, path))
         throw std::string("path does not exist in h5 file");
 
@@ -111,6 +133,7 @@ void write_string_attribute(
         hid_t h5, const char* path, const char* attr_name,
         const std::string& value) 
 try {
+    H5Lock lock;
     // Create a string datatype of the appropriate size and null-terminated
     auto attr_type = h5_obj(H5Tclose, H5Tcopy(H5T_C_S1));
     h5_noerr(H5Tset_size(attr_type.get(), 1+value.size()));  // include 0 byte in size
@@ -128,6 +151,20 @@ try {
         std::string(path) + "', " + e;
 }
 
+void write_attribute(hid_t h5, const char* path, const char* attr_name, const void* value, hid_t predtype)
+try {
+    H5Lock lock;
+    auto attr_space = h5_obj(H5Sclose, H5Screate(H5S_SCALAR));
+    auto attr = h5_obj(H5Aclose, H5Acreate_by_name(
+                h5, path, attr_name,
+                predtype, attr_space.get(),
+                H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
+    h5_noerr(H5Awrite(attr.get(), predtype, value));
+} catch(const std::string &e) {
+    throw "while writing attribute '" + std::string(attr_name) + "' of '" +
+        std::string(path) + "', " + e;
+}
+
 void check_size(hid_t group, const char* name, std::vector<size_t> sz)
 {
     size_t ndim = sz.size();
@@ -159,8 +196,19 @@ void check_size(hid_t group, const char* name, size_t sz1, size_t sz2, size_t sz
 void check_size(hid_t group, const char* name, size_t sz1, size_t sz2, size_t sz3, size_t sz4, size_t sz5) 
 { check_size(group, name, std::vector<size_t>{{sz1,sz2,sz3,sz4,sz5}}); }
 
+void read_dset_raw(hid_t group, const char* name, hid_t predtype, const std::vector<size_t>& sz, void* dest)
+try {
+    H5Lock lock;
+    check_size(group, name, sz);
+    auto dset = h5_obj(H5Dclose, H5Dopen2(group, name, H5P_DEFAULT));
+    h5_noerr(H5Dread(dset.get(), predtype, H5S_ALL, H5S_ALL, H5P_DEFAULT, dest));
+} catch(const std::string &e) {
+    throw "while reading '" + std::string(name) + "', " + e;
+}
+
 
 H5Obj ensure_group(hid_t loc, const char* nm) {
+    H5Lock lock;
     return h5_obj(H5Gclose, h5_exists(loc, nm) 
             ? H5Gopen2(loc, nm, H5P_DEFAULT)
             : H5Gcreate2(loc, nm, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
@@ -168,12 +216,14 @@ H5Obj ensure_group(hid_t loc, const char* nm) {
 
 H5Obj open_group(hid_t loc, const char* nm) 
 try {
+    H5Lock lock;
     return h5_obj(H5Gclose, H5Gopen2(loc, nm, H5P_DEFAULT));
 } catch(std::string &s) {
     throw std::string("unable to open group ") + nm + " (does it exist?), " + s;
 }
 
 void ensure_not_exist(hid_t loc, const char* nm) {
+    H5Lock lock;
     if(h5_exists(loc, nm)) H5Ldelete(loc, nm, H5P_DEFAULT);
 }
 
@@ -200,6 +250,7 @@ H5Obj create_earray(hid_t group, const char* name, hid_t dtype,
         const std::vector<hsize_t>& chunk_dims_v,
         bool compression_level)  // 1 is often recommended
 {
+    H5Lock lock;
     if(dims_v.size() != chunk_dims_v.size()) throw std::string("invalid chunk dims");
     std::vector<hsize_t> dims = dims_v;
     std::vector<hsize_t> chunk_dims = chunk_dims_v;
@@ -232,6 +283,7 @@ H5Obj create_earray(hid_t group, const char* name, hid_t dtype,
 
 void append_to_dset(hid_t dset, hid_t hdf_predtype, size_t n_new_data_elems, const void* new_data, int append_dim)
 try {
+    H5Lock lock;
     // Load current data size
     auto space = h5_obj(H5Sclose, H5Dget_space(dset));
     int ndims = h5_noerr(H5Sget_simple_extent_ndims(space.get()));
@@ -276,6 +328,7 @@ catch(const std::string &e) {
 
 std::vector<std::string> 
 node_names_in_group(const hid_t loc, const std::string grp_name) {
+    H5Lock lock;
     std::vector<std::string> names;
 
     H5G_info_t info;
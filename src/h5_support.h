@@ -9,7 +9,7 @@
 
 #include <hdf5.h>
 
-//! NB this library is not threadsafe.  It is up to the user to deal with this fact
+//! HDF5 calls from several threads must be serialized by holding an H5Lock (see below)
 namespace h5 {
 
 //! \cond
@@ -30,6 +30,20 @@ inline bool h5_bool_return(htri_t value) {
     return value>0;  // true condition for htri_t
 }
 
+//! \brief Scoped lock serializing HDF5 calls between threads
+//!
+//! HDF5 is often built without thread safety, so threads that call HDF5 concurrently
+//! (e.g. while constructing several systems at once) must hold this lock.  It may be
+//! nested within a thread.  The functions of this header, and the deleter of H5Obj, hold
+//! it only for their HDF5 calls, so that callers may do their other work concurrently.
+//! Direct calls to HDF5 must be made holding the lock.
+struct H5Lock {
+    H5Lock();
+    ~H5Lock();
+    H5Lock(const H5Lock&) = delete;
+    H5Lock& operator=(const H5Lock&) = delete;
+};
+
 //! Wrapper to make hid_t compatible with smart pointers
 struct Hid_t {   // special type for saner hid_t
     hid_t ref;
@@ -52,7 +66,7 @@ struct H5Deleter
 
     H5Deleter(): deleter(nullptr) {}
     H5Deleter(H5DeleterFunc *deleter_): deleter(deleter_) {}
-    void operator()(pointer p) {if(deleter) (*deleter)(p);} // no error check since destructors can't throw
+    void operator()(pointer p) {if(deleter) {H5Lock lock; (*deleter)(p);}} // no error check since destructors can't throw
 };
 
 //! Wrapper for hid_t reference with custom deleter
@@ -66,11 +80,13 @@ H5Obj h5_obj(H5DeleterFunc &deleter, hid_t obj);
 
 //! Duplicate an H5Obj by increasing the reference count of the underlying object
 inline H5Obj duplicate_obj(H5Obj& obj) {
+    H5Lock lock;
     H5Iinc_ref(obj.get());
     return H5Obj(obj.get(), obj.get_deleter());
 }
 
 static H5Obj open_file(char* path, decltype(H5F_ACC_RDONLY) flags) {
+    H5Lock lock;
     if(flags == H5F_ACC_RDONLY || flags == H5F_ACC_RDWR)
         return h5_obj(H5Fclose, H5Fopen(path, flags, H5P_DEFAULT));
     else 
@@ -121,6 +137,15 @@ void write_string_attribute(
         hid_t h5, const char* path, const char* attr_name,
         const std::string& value);
 
+// Write a scalar attribute.  See below for a typesafe overload.
+void write_attribute(hid_t h5, const char* path, const char* attr_name, const void* value, hid_t predtype);
+
+//! Write a scalar attribute
+template<class T>
+void write_attribute(hid_t h5, const char* path, const char* attr_name, const T& value) {
+    write_attribute(h5, path, attr_name, &value, select_predtype<T>());
+}
+
 void check_size(hid_t group, const char* name, std::vector<size_t> sz); //!< Check the dimension sizes of an arbitrary dataset
 void check_size(hid_t group, const char* name, size_t sz); //!< Check the dimension sizes of an 1D dataset
 void check_size(hid_t group, const char* name, size_t sz1, size_t sz2); //!< Check the dimension sizes of an 2D dataset
@@ -128,6 +153,29 @@ void check_size(hid_t group, const char* name, size_t sz1, size_t sz2, size_t sz
 void check_size(hid_t group, const char* name, size_t sz1, size_t sz2, size_t sz3, size_t sz4); //!< Check the dimension sizes of an 4D dataset
 void check_size(hid_t group, const char* name, size_t sz1, size_t sz2, size_t sz3, size_t sz4, size_t sz5); //!< Check the dimension sizes of an 5D dataset
 
+//! \brief Read a whole dataset into dest with a single H5Dread, after checking its shape
+
+//! The elements are stored in C order, and dest must hold at least the product of sz
+//! elements of the type given by predtype.  The read is performed directly into dest,
+//! so dest may be an aligned or padded buffer owned by the caller.
+void read_dset_raw(hid_t group, const char* name, hid_t predtype, const std::vector<size_t>& sz, void* dest);
+
+//! Read a whole dataset of shape sz into a caller-provided buffer, in C order
+template <typename T>
+void read_dset(hid_t group, const char* name, const std::vector<size_t>& sz, T* dest) {
+    read_dset_raw(group, name, select_predtype<T>(), sz, dest);
+}
+
+//! Read a whole dataset of shape sz into a new vector, in C order
+template <typename T>
+std::vector<T> read_dset(hid_t group, const char* name, const std::vector<size_t>& sz) {
+    size_t n_elem = 1;
+    for(auto d: sz) n_elem *= d;
+    std::vector<T> data(n_elem);
+    read_dset_raw(group, name, select_predtype<T>(), sz, data.data());
+    return data;
+}
+
 H5Obj ensure_group(hid_t loc, const char* nm);    //!< Ensure that a group of a specific name exists
 H5Obj open_group(hid_t loc, const char* nm);      //!< Open an existing group
 void ensure_not_exist(hid_t loc, const char* nm); //!< Delete a group if it exists
@@ -228,22 +276,26 @@ struct traverse_dataset_iteraction_helper<5,T,F> {
 template<int ndims, typename T, typename F>
 void traverse_dset(hid_t group, const char* name, const F& f)
 try {
-    auto dset  = h5_obj(H5Dclose, H5Dopen2(group, name, H5P_DEFAULT));
-    auto space = h5_obj(H5Sclose, H5Dget_space(dset.get()));
-
-    if(H5Sget_simple_extent_ndims(space.get()) != ndims) 
-        throw std::string("wrong shape for array, expected " +
-            std::to_string(ndims) + " dimension(s) but got " +
-            std::to_string(H5Sget_simple_extent_ndims(space.get())) +
-            " dimension(s).");
-    hsize_t dims[ndims]; h5_noerr(H5Sget_simple_extent_dims(space.get(), dims, NULL));
-
-    size_t dim_product = 1;
-    for(int i=0; i<ndims; ++i) dim_product *= dims[i];
-
-    auto tmp = std::unique_ptr<T[]>(new T[dim_product]);
-
-    h5_noerr(H5Dread(dset.get(), select_predtype<T>(), H5S_ALL, H5S_ALL, H5P_DEFAULT, tmp.get()));
+    hsize_t dims[ndims];
+    std::unique_ptr<T[]> tmp;
+    {
+        H5Lock lock;  // f is called without the lock
+        auto dset  = h5_obj(H5Dclose, H5Dopen2(group, name, H5P_DEFAULT));
+        auto space = h5_obj(H5Sclose, H5Dget_space(dset.get()));
+
+        if(H5Sget_simple_extent_ndims(space.get()) != ndims) 
+            throw std::string("wrong shape for array, expected " +
+                std::to_string(ndims) + " dimension(s) but got " +
+                std::to_string(H5Sget_simple_extent_ndims(space.get())) +
+                " dimension(s).");
+        h5_noerr(H5Sget_simple_extent_dims(space.get(), dims, NULL));
+
+        size_t dim_product = 1;
+        for(int i=0; i<ndims; ++i) dim_product *= dims[i];
+
+        tmp.reset(new T[dim_product]);
+        h5_noerr(H5Dread(dset.get(), select_predtype<T>(), H5S_ALL, H5S_ALL, H5P_DEFAULT, tmp.get()));
+    }
     traverse_dataset_iteraction_helper<ndims,T,F>()(tmp.get(), dims, f);
 } catch(const std::string &e) {
     throw "while traversing '" + std::string(name) + "', " + e;
@@ -255,23 +307,29 @@ template<int ndims, typename F>
 void traverse_string_dset(
         hid_t group, const char* name, const F& f)
 try {
-    auto dset  = h5_obj(H5Dclose, H5Dopen2(group, name, H5P_DEFAULT));
-    auto space = h5_obj(H5Sclose, H5Dget_space(dset.get()));
-    auto dtype = h5_obj(H5Tclose, H5Dget_type(dset.get()));
-    if(H5Tis_variable_str(dtype.get())) throw std::string("variable-length strings not supported");
-
-    size_t maxchars = H5Tget_size(dtype.get());
-    if(maxchars==0) throw std::string("H5Tget_size error"); // defined error value
-
-    if(H5Sget_simple_extent_ndims(space.get()) != ndims) throw std::string("wrong size for id array");
-    hsize_t dims[ndims]; h5_noerr(H5Sget_simple_extent_dims(space.get(), dims, NULL));
-
-    size_t dim_product = 1;
-    for(int i=0; i<ndims; ++i) dim_product *= dims[i];
-
-    // the extra 1+ accounts for the space to hold the NULL-terminator
-    auto tmp = std::unique_ptr<char[]>(new char[dim_product*(1u+maxchars)]);
-    h5_noerr(H5Dread(dset.get(), dtype.get(), H5S_ALL, H5S_ALL, H5P_DEFAULT, tmp.get()));
+    hsize_t dims[ndims];
+    size_t maxchars;
+    std::unique_ptr<char[]> tmp;
+    {
+        H5Lock lock;  // f is called without the lock
+        auto dset  = h5_obj(H5Dclose, H5Dopen2(group, name, H5P_DEFAULT));
+        auto space = h5_obj(H5Sclose, H5Dget_space(dset.get()));
+        auto dtype = h5_obj(H5Tclose, H5Dget_type(dset.get()));
+        if(H5Tis_variable_str(dtype.get())) throw std::string("variable-length strings not supported");
+
+        maxchars = H5Tget_size(dtype.get());
+        if(maxchars==0) throw std::string("H5Tget_size error"); // defined error value
+
+        if(H5Sget_simple_extent_ndims(space.get()) != ndims) throw std::string("wrong size for id array");
+        h5_noerr(H5Sget_simple_extent_dims(space.get(), dims, NULL));
+
+        size_t dim_product = 1;
+        for(int i=0; i<ndims; ++i) dim_product *= dims[i];
+
+        // the extra 1+ accounts for the space to hold the NULL-terminator
+        tmp.reset(new char[dim_product*(1u+maxchars)]);
+        h5_noerr(H5Dread(dset.get(), dtype.get(), H5S_ALL, H5S_ALL, H5P_DEFAULT, tmp.get()));
+    }
 
     // I must wrap the traversal function to provide the requested std::string
     // FIXME this only works for 1 dimension
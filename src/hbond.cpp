@@ -56,42 +56,57 @@ struct Infer_H_O : public CoordNode
     }
 
 
-    virtual void compute_value(ComputeMode mode) override {
-        Timer timer(string("infer_H_O"));
+    void compute_element(int nv) {
+        // For output, first three components are position of H/O and second three are HN/OC bond direction
+        // Bond direction is a unit vector
+        // curr is the N or C atom
+        // This algorithm assumes perfect 120 degree bond angles
 
         VecArray posc  = pos.output;
-        for(int nv=0; nv<n_virtual; ++nv) {
-            // For output, first three components are position of H/O and second three are HN/OC bond direction
-            // Bond direction is a unit vector
-            // curr is the N or C atom
-            // This algorithm assumes perfect 120 degree bond angles
+        auto& p = params[nv];
 
-            auto& p = params[nv];
+        auto prev_c = Float4(&posc(0,p.atom[0]));
+        auto curr_c = Float4(&posc(0,p.atom[1]));
+        auto next_c = Float4(&posc(0,p.atom[2]));
 
-            auto prev_c = Float4(&posc(0,p.atom[0]));
-            auto curr_c = Float4(&posc(0,p.atom[1]));
-            auto next_c = Float4(&posc(0,p.atom[2]));
+        auto prev = prev_c - curr_c; auto prev_invmag = inv_mag(prev); prev *= prev_invmag;
+        auto next = next_c - curr_c; auto next_invmag = inv_mag(next); next *= next_invmag;
+        auto disp = prev   + next  ; auto disp_invmag = inv_mag(disp); disp *= disp_invmag;
 
-            auto prev = prev_c - curr_c; auto prev_invmag = inv_mag(prev); prev *= prev_invmag;
-            auto next = next_c - curr_c; auto next_invmag = inv_mag(next); next *= next_invmag;
-            auto disp = prev   + next  ; auto disp_invmag = inv_mag(disp); disp *= disp_invmag;
+        auto hbond_dir = -disp;
+        auto hbond_pos = fmadd(Float4(p.bond_length),hbond_dir, curr_c);
 
-            auto hbond_dir = -disp;
-            auto hbond_pos = fmadd(Float4(p.bond_length),hbond_dir, curr_c);
+        // store derived values for derivatives later
+        prev.blend<0,0,0,1>(prev_invmag).store(data_for_deriv + nv*3*4 + 0);
+        next.blend<0,0,0,1>(next_invmag).store(data_for_deriv + nv*3*4 + 4);
+        disp.blend<0,0,0,1>(disp_invmag).store(data_for_deriv + nv*3*4 + 8);
 
-            // store derived values for derivatives later
-            prev.blend<0,0,0,1>(prev_invmag).store(data_for_deriv + nv*3*4 + 0);
-            next.blend<0,0,0,1>(next_invmag).store(data_for_deriv + nv*3*4 + 4);
-            disp.blend<0,0,0,1>(disp_invmag).store(data_for_deriv + nv*3*4 + 8);
+        // write pos
+        hbond_pos.store(&output(0,nv));
+        hbond_dir.store(&output(3,nv), Alignment::unaligned);
+    }
 
-            // write pos
-            hbond_pos.store(&output(0,nv));
-            hbond_dir.store(&output(3,nv), Alignment::unaligned);
-        }
+    virtual void compute_value(ComputeMode mode) override {
+        Timer timer("infer_H_O");
+        for(int nv=0; nv<n_virtual; ++nv) compute_element(nv);
+    }
+
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        if(old_args) return 0.;  // the elements are computed from the current positions
+        for(int nv=0; nv<n_virtual; ++nv)
+            for(int na: range(3))
+                if(arg_dirty[0]->contains(params[nv].atom[na])) {
+                    dirty.add(nv);
+                    compute_element(nv);
+                    break;
+                }
+        return 0.;
     }
 
     virtual void propagate_deriv() override {
-        Timer timer(string("infer_H_O_deriv"));
+        Timer timer("infer_H_O_deriv");
         VecArray pos_sens = pos.sens;
 
         for(int nv=0; nv<n_virtual; ++nv) {
@@ -206,10 +221,12 @@ namespace {
                 auto angular1 = hbond_angular_potential(dotHOC, p4, p5);
                 auto angular2 = hbond_angular_potential(dotOHN, p4, p5);
 
-                hb      =  radial.x() * angular1.x() * angular2.x();
-                auto c0 =  radial.y() * angular1.x() * angular2.x();
-                auto c1 =  radial.x() * angular1.y() * angular2.x();
-                auto c2 = -radial.x() * angular1.x() * angular2.y();
+                // lanes outside the angular cutoff are zero, so that an edge does not depend on
+                // the other edges evaluated with it
+                hb      =  within_angular_cutoff & ( radial.x() * angular1.x() * angular2.x());
+                auto c0 =  within_angular_cutoff & ( radial.y() * angular1.x() * angular2.x());
+                auto c1 =  within_angular_cutoff & ( radial.x() * angular1.y() * angular2.x());
+                auto c2 =  within_angular_cutoff & (-radial.x() * angular1.x() * angular2.y());
 
                 drOC = c1*rHO;
                 drHN = c2*rHO;
@@ -310,17 +327,21 @@ struct ProteinHBond : public CoordNode
         }
     }
 
+    // copy the H/O position and bond direction of virtual nv, with the hbond score zeroed
+    void load_virtual(int nv) {
+        VecArray vs = output;
+        VecArray ho = infer.output;
+        Float4(&ho(0,nv)).store(&vs(0,nv));
+        Float4(&ho(4,nv)).store(&vs(4,nv)); // result is already zero padded
+    }
+
     virtual void compute_value(ComputeMode mode) override {
-        Timer timer(string("protein_hbond"));
+        Timer timer("protein_hbond");
 
         int n_virtual = n_donor + n_acceptor;
         VecArray vs = output;
-        VecArray ho = infer.output;
 
-        for(int nv: range(n_virtual)) {
-            Float4(&ho(0,nv)).store(&vs(0,nv));
-            Float4(&ho(4,nv)).store(&vs(4,nv)); // result is already zero padded
-        }
+        for(int nv: range(n_virtual)) load_virtual(nv);
 
         // Compute protein hbonding score and its derivative
         igraph.compute_edges();
@@ -335,8 +356,36 @@ struct ProteinHBond : public CoordNode
         for(int nv: range(n_virtual)) vs(6,nv) = 1.f-expf(-vs(6,nv));
     }
 
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        // a virtual changes if it moved or has an edge to a moved virtual, before or after
+        auto& moved = *arg_dirty[0];
+        if(old_args) {
+            for(int nd: range(n_donor))    if(moved.contains(igraph.loc1[nd])) dirty.add(nd);
+            for(int na: range(n_acceptor)) if(moved.contains(igraph.loc2[na])) dirty.add(na+n_donor);
+        }
+        igraph.visit_dirty_edges(moved, &moved, [&](int nd, int na, float hb_log) {
+                dirty.add(nd); dirty.add(na+n_donor);});
+        if(old_args) return 0.;
+
+        // recompute the changed virtuals from all of their edges
+        DirtySet changed;
+        changed.reset(infer.n_elem);
+        for(int nv: dirty.elems) {
+            load_virtual(nv);
+            changed.add(nv<n_donor ? igraph.loc1[nv] : igraph.loc2[nv-n_donor]);
+        }
+        VecArray vs = output;
+        igraph.visit_dirty_edges(changed, &changed, [&](int nd, int na, float hb_log) {
+                if(dirty.contains(nd))         vs(6,nd)         += hb_log;
+                if(dirty.contains(na+n_donor)) vs(6,na+n_donor) += hb_log;});
+        for(int nv: dirty.elems) vs(6,nv) = 1.f-expf(-vs(6,nv));
+        return 0.;
+    }
+
     virtual void propagate_deriv() override {
-        Timer timer(string("protein_hbond_deriv"));
+        Timer timer("protein_hbond_deriv");
 
         // we accumulated derivatives for z = 1-exp(-log(no_hb))
         // so we need to convert back with z_sens*(1.f-hb)
@@ -364,6 +413,8 @@ struct ProteinHBond : public CoordNode
             update_vec(pd2, igraph.loc2[na], load_vec<6>(sens, na+n_donor));
         }
     }
+
+    virtual void reset_caches() override {igraph.reset_caches();}
 };
 static RegisterNodeType<ProteinHBond,1> hbond_node("protein_hbond");
 
@@ -378,7 +429,7 @@ struct HBondCoverage : public CoordNode {
         n_sc(igraph.n_elem2) {}
 
     virtual void compute_value(ComputeMode mode) override {
-        Timer timer(string("hbond_coverage"));
+        Timer timer("hbond_coverage");
 
         // Compute coverage and its derivative
         igraph.compute_edges();
@@ -389,14 +440,27 @@ struct HBondCoverage : public CoordNode {
         }
     }
 
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        // edges touching a moved element are subtracted at their old values and added at their new
+        float sign = old_args ? -1.f : 1.f;
+        igraph.visit_dirty_edges(*arg_dirty[0], arg_dirty[1], [&](int nh, int ns, float value) {
+                dirty.add(ns);
+                output(0,ns) += sign*value;});
+        return 0.;
+    }
+
     virtual void propagate_deriv() override {
-        Timer timer(string("hbond_coverage_deriv"));
+        Timer timer("hbond_coverage_deriv");
 
         for(int ne: range(igraph.n_edge))
             igraph.edge_sensitivity[ne] = sens(0,igraph.edge_indices2[ne]);
         igraph.propagate_derivatives();
     }
 
+    virtual void reset_caches() override {igraph.reset_caches();}
+
     virtual std::vector<float> get_param() const override {return igraph.get_param();}
 #ifdef PARAM_DERIV
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
@@ -428,7 +492,7 @@ struct HBondEnergy : public HBondCounter
     {}
 
     virtual void compute_value(ComputeMode mode) override {
-        Timer timer(string("hbond_energy"));
+        Timer timer("hbond_energy");
         float tot_hb = 0.f;
         VecArray pp      = protein_hbond.output;
         VecArray pp_sens = protein_hbond.sens;
@@ -443,6 +507,15 @@ struct HBondEnergy : public HBondCounter
         n_hbond = tot_hb;
     }
 
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        float dirty_hb = 0.f;
+        for(int nv: arg_dirty[0]->elems) dirty_hb += protein_hbond.output(6,nv);
+        n_hbond += old_args ? -dirty_hb : dirty_hb;
+        return double(dirty_hb)*E_protein;
+    }
+
     virtual std::vector<float> get_param() const override {return vector<float>(1,E_protein);}
 #ifdef PARAM_DERIV
     virtual std::vector<float> get_param_deriv() override {return vector<float>(1,float(n_hbond));}
@@ -104,7 +104,7 @@ struct FixedHMM : public PotentialNode
     }
 
     virtual void compute_value(ComputeMode mode) override {
-        Timer timer(string("hmm"));
+        Timer timer("hmm");
         VecArray n1b = node_1body.output;
 
         float pot = energy_offset*(n_residue-1.f);  // correct for energy offset
@@ -294,7 +294,7 @@ struct TorusDBN_Emission : public CoordNode {
     }
 
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("torus_dbn"));
+        Timer timer("torus_dbn");
         VecArray rpos = rama.output;
         for(int nr=0; nr<n_residue; ++nr) {
             float phi = rpos(0,params[nr].residue);
@@ -315,7 +315,7 @@ struct TorusDBN_Emission : public CoordNode {
     }
 
     virtual void propagate_deriv() {
-        Timer timer(string("torus_dbn_deriv"));
+        Timer timer("torus_dbn_deriv");
         Map<Matrix<float,Dynamic,Dynamic,RowMajor>> state_sens(sens.x.get(), n_residue, ru(n_state));
         cs_sens = cs_to_emission*state_sens.transpose();
 
@@ -6,16 +6,34 @@
 #include "vector_math.h"
 #include "h5_support.h"
 #include "timing.h"
+#include "param_store.h"
 #include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
 #include "Float4.h"
 
+// Number of candidate pairs above which PairlistComputation rebuilds its cache using a cell list
+// (roughly the crossover of the two methods for symmetric lists in pairlist_benchmark.cpp)
+#ifndef CELL_LIST_MIN_PAIRS
+#define CELL_LIST_MIN_PAIRS 2000000
+#endif
 
-template <typename T>
-inline T* operator+(const std::unique_ptr<T[]>& ptr, int i) {
+
+template <typename T, typename D>
+inline T* operator+(const std::unique_ptr<T[],D>& ptr, int i) {
     // little function to make unique_ptr for an array do pointer arithmetic
     return ptr.get()+i;
 }
 
+template <typename T>
+inline const T* operator+(const std::shared_ptr<const T>& ptr, int i) {
+    // same for shared parameter arrays
+    return ptr.get()+i;
+}
+
 template <typename T>
 void fill_n(std::unique_ptr<T[]> &ptr, int n_elem, const T& value) {
     std::fill_n(ptr.get(), n_elem, value);
@@ -28,6 +46,338 @@ static T&& message(const std::string& s, T&& x) {
 }
 
 
+//! \brief Verlet cache of all pairs of elements within a buffered cutoff
+//!
+//! The cache is independent of element ids, so that it may be shared by several
+//! PairlistComputation's over the same positions (see shared_pair_cache).  Each of them
+//! applies its own id filter and cutoff to the cached pairs.  The cache remains valid for the
+//! largest cutoff and buffer requested by any user.
+template <bool symmetric>
+struct PairCache {
+    const int n_elem1, n_elem2;
+
+    int edge_capacity;
+    std::unique_ptr<int32_t[]>  edge_indices1, edge_indices2;
+    int n_edge;
+    uint64_t generation;  //!< incremented whenever the cache is rebuilt
+
+    bool  cache_valid;
+    float cache_buffer;
+    float max_cutoff;
+    float cache_cutoff;
+    std::unique_ptr<float[]>    cache_pos1, cache_pos2;
+
+    // Above this many candidate pairs, the cache is rebuilt with a cell list rather than
+    // by checking every pair.  Both methods produce exactly the same edges in the same order.
+    long cell_list_min_pairs;
+    std::vector<int32_t>  cell_start, cell_cursor, cell_members, elem_cell;
+    std::vector<uint64_t> candidate_mask;
+
+    std::mutex mut;  // users may run concurrently (see DerivEngine::n_threads)
+
+    PairCache(int n_elem1_, int n_elem2_, int max_n_edge):
+        n_elem1(n_elem1_), n_elem2(n_elem2_),
+        edge_capacity(round_up(max_n_edge,16)),
+        edge_indices1(new_aligned<int32_t>(edge_capacity, 4)),
+        edge_indices2(new_aligned<int32_t>(edge_capacity, 4)),
+        n_edge(0),
+        generation(0u),
+        cache_valid(false),
+        cache_buffer(1.f), // reasonable value that the user can modify
+        max_cutoff(0.f),
+        cache_cutoff(0.f),
+        cache_pos1(new_aligned<float>(round_up(n_elem1,16)*4,             4)),
+        cache_pos2(new_aligned<float>(round_up(symmetric?16:n_elem2,16)*4,4)),
+        cell_list_min_pairs(CELL_LIST_MIN_PAIRS)
+    {
+        for(int i=0; i<n_elem1; i+=4)
+            for(int j=0; j<4; ++j) Float4(1e10f).store(cache_pos1+4*(i+j));
+        if(!symmetric)
+            for(int i=0; i<n_elem2; i+=4)
+                for(int j=0; j<4; ++j) Float4(1e10f).store(cache_pos2+4*(i+j));
+    }
+
+    // the buffer only ever grows, so that it is sufficient for every user
+    void request_buffer(float new_buffer) {
+        std::lock_guard<std::mutex> lock(mut);
+        if(new_buffer>cache_buffer) {cache_buffer = new_buffer; cache_valid = false;}
+    }
+    void change_cell_list_min_pairs(long new_min_pairs) {cell_list_min_pairs=new_min_pairs;}
+    void invalidate() {cache_valid = false;}
+
+    bool use_cell_list() const {
+        long n_pair = long(n_elem1)*long(n_elem2);
+        return (symmetric ? n_pair/2 : n_pair) >= cell_list_min_pairs;
+    }
+
+    void grow_edges() {
+        int new_capacity = 2*edge_capacity;
+        for(auto arr: {&edge_indices1, &edge_indices2}) {
+            auto new_arr = new_aligned<int32_t>(new_capacity, 4);
+            std::copy_n(arr->get(), edge_capacity, new_arr.get());
+            *arr = std::move(new_arr);
+        }
+        edge_capacity = new_capacity;
+    }
+
+    // Test a group of 4 first elements against second element i2 and append the hits
+    int append_cache_edges(int ne, const Vec<3,Float4>& x1, const Int4& i1_vec, int32_t i2, const Float4& cutoff2) {
+        const float* p = (symmetric?cache_pos1:cache_pos2)+i2*4;
+        auto  x2 = make_vec3(Float4(p[0]), Float4(p[1]),  Float4(p[2]));
+        auto near = mag2(x1-x2)<cutoff2;
+        if(near.none()) return ne;
+
+        auto i2_vec = Int4(i2);
+        Int4 is_hit = symmetric 
+            ? (i1_vec<i2_vec) & near.cast_int()
+            :                   near.cast_int();
+        int is_hit_bits = is_hit.movemask();
+
+        if(ne+4 > edge_capacity) grow_edges();
+
+        // i2_vec is constant, so we don't have to left pack
+        int n_hit = popcnt_nibble(is_hit_bits);
+        i1_vec.left_pack(is_hit_bits).store(edge_indices1+ne, Alignment::unaligned);
+        i2_vec                       .store(edge_indices2+ne, Alignment::unaligned);
+        return ne + n_hit;
+    }
+
+    int find_cache_edges_all_pairs() {
+        alignas(16) int32_t offset_v[4] = {0,1,2,3};
+        Int4 offset(offset_v);
+        auto cutoff2 = Float4(sqr(cache_cutoff));
+
+        int ne = 0;
+        for(int32_t i1=0; i1<n_elem1; i1+=4) {
+            Float4 v0(cache_pos1+(i1+0)*4), // aligned_pos1 size was rounded up
+                   v1(cache_pos1+(i1+1)*4), 
+                   v2(cache_pos1+(i1+2)*4), 
+                   v3(cache_pos1+(i1+3)*4);
+            transpose4(v0,v1,v2,v3); // v3 will be unused at the end
+            auto  x1 = make_vec3(v0,v1,v2);
+            auto  i1_vec = Int4(i1) + offset;
+
+            for(int32_t i2=symmetric?i1+1:0; i2<n_elem2; ++i2)
+                ne = append_cache_edges(ne, x1, i1_vec, i2, cutoff2);
+        }
+        return ne;
+    }
+
+    int find_cache_edges_cell_list() {
+        const float* pos2 = (symmetric ? cache_pos1 : cache_pos2).get();
+
+        // Bin the second set of elements into a uniform grid with cells no smaller than the cutoff
+        float lo[3] = { 1e30f, 1e30f, 1e30f};
+        float hi[3] = {-1e30f,-1e30f,-1e30f};
+        for(int i2=0; i2<n_elem2; ++i2) {
+            for(int d=0; d<3; ++d) {
+                lo[d] = std::min(lo[d], pos2[i2*4+d]);
+                hi[d] = std::max(hi[d], pos2[i2*4+d]);
+            }
+        }
+
+        // Coarsen the grid if it would have many more cells than elements (e.g. extended chains)
+        double cell_width = cache_cutoff;
+        const double max_cells = 2.*n_elem2 + 27.;
+        int n_cell[3];
+        for(;;) {
+            double total = 1.;
+            for(int d=0; d<3; ++d) {
+                double extent = std::min(double(hi[d]-lo[d]) / cell_width, 1e6);
+                n_cell[d] = extent>0. ? int(extent)+1 : 1;
+                total *= n_cell[d];
+            }
+            if(total <= max_cells) break;
+            cell_width *= std::max(1.1, cbrt(total/max_cells));
+        }
+        const float inv_width = 1.f/float(cell_width);
+
+        // Points outside the grid are clamped to the boundary cells.  This is safe because the
+        // grid contains every element of the second set.
+        auto cell_coord = [&](const float* x, int d) {
+            float c = std::min(std::max((x[d]-lo[d])*inv_width, 0.f), float(n_cell[d]-1));
+            int ic = int(c);
+            return ic<0 ? 0 : (ic>=n_cell[d] ? n_cell[d]-1 : ic);  // also guards against NaN
+        };
+
+        // counting sort of the elements by cell
+        int n_cell_total = n_cell[0]*n_cell[1]*n_cell[2];
+        cell_start.assign(n_cell_total+1, 0);
+        cell_members.resize(n_elem2);
+        elem_cell.resize(n_elem2);
+        for(int i2=0; i2<n_elem2; ++i2) {
+            const float* x = pos2+i2*4;
+            int c = (cell_coord(x,0)*n_cell[1] + cell_coord(x,1))*n_cell[2] + cell_coord(x,2);
+            elem_cell[i2] = c;
+            cell_start[c+1]++;
+        }
+        for(int c=0; c<n_cell_total; ++c) cell_start[c+1] += cell_start[c];
+        cell_cursor.assign(begin(cell_start), end(cell_start)-1);
+        for(int i2=0; i2<n_elem2; ++i2) cell_members[cell_cursor[elem_cell[i2]]++] = i2;
+
+        alignas(16) int32_t offset_v[4] = {0,1,2,3};
+        Int4 offset(offset_v);
+        auto cutoff2 = Float4(sqr(cache_cutoff));
+
+        // Candidates are marked in a bitmask that is scanned in increasing index order, which
+        // reproduces the all-pairs edge order without sorting.
+        candidate_mask.assign((n_elem2+63)/64, 0ull);
+
+        int ne = 0;
+        for(int32_t i1=0; i1<n_elem1; i1+=4) {
+            // Elements of a group are usually close together, so visit the block of cells
+            // adjacent to any of them
+            int c_lo[3], c_hi[3];
+            for(int d=0; d<3; ++d) {
+                c_lo[d] = n_cell[d]; c_hi[d] = -1;
+                for(int j=0; j<4; ++j) {
+                    int c = cell_coord(cache_pos1+(i1+j)*4, d);
+                    c_lo[d] = std::min(c_lo[d], c);
+                    c_hi[d] = std::max(c_hi[d], c);
+                }
+                c_lo[d] = std::max(c_lo[d]-1, 0);
+                c_hi[d] = std::min(c_hi[d]+1, n_cell[d]-1);
+            }
+
+            int word_lo = candidate_mask.size(), word_hi = -1;
+            for(int cx=c_lo[0]; cx<=c_hi[0]; ++cx) {
+                for(int cy=c_lo[1]; cy<=c_hi[1]; ++cy) {
+                    int row = (cx*n_cell[1] + cy)*n_cell[2];
+                    for(int k=cell_start[row+c_lo[2]]; k<cell_start[row+c_hi[2]+1]; ++k) {
+                        int32_t i2 = cell_members[k];
+                        if(symmetric && i2<=i1) continue;
+                        candidate_mask[i2>>6] |= 1ull<<(i2&63);
+                        word_lo = std::min(word_lo, i2>>6);
+                        word_hi = std::max(word_hi, i2>>6);
+                    }
+                }
+            }
+
+            Float4 v0(cache_pos1+(i1+0)*4),
+                   v1(cache_pos1+(i1+1)*4), 
+                   v2(cache_pos1+(i1+2)*4), 
+                   v3(cache_pos1+(i1+3)*4);
+            transpose4(v0,v1,v2,v3); // v3 will be unused at the end
+            auto  x1 = make_vec3(v0,v1,v2);
+
+            auto  i1_vec = Int4(i1) + offset;
+
+            for(int w=word_lo; w<=word_hi; ++w) {
+                uint64_t bits = candidate_mask[w];
+                candidate_mask[w] = 0ull;  // leave the mask clear for the next group
+                for(; bits; bits &= bits-1) {
+                    int32_t i2 = w*64 + __builtin_ctzll(bits);
+                    ne = append_cache_edges(ne, x1, i1_vec, i2, cutoff2);
+                }
+            }
+        }
+        return ne;
+    }
+
+    //! \brief Rebuild the cache if any element has moved too far, and return the generation
+    //!
+    //! The caller must hold mut until it has finished reading the cached edges.
+    uint64_t ensure_valid(float cutoff,
+            const float* aligned_pos1, const int pos1_stride,
+            const float* aligned_pos2, const int pos2_stride)
+    {
+        if(cutoff>max_cutoff) {max_cutoff = cutoff; cache_valid = false;}
+
+        Timer t1("pairlist_cache_check");
+        // Find maximum deviation from cached positions to determine if cache must be rebuilt
+        auto max_dist_exceeded = Float4();
+        auto max_cache_dist2 = Float4(sqr(0.5f*(cache_cutoff - max_cutoff)));
+
+        for(int i=0; i<n_elem1; i+=4) {
+            auto x = Float4(aligned_pos1+pos1_stride*(i+0)) - Float4(cache_pos1+4*(i+0));
+            auto y = Float4(aligned_pos1+pos1_stride*(i+1)) - Float4(cache_pos1+4*(i+1));
+            auto z = Float4(aligned_pos1+pos1_stride*(i+2)) - Float4(cache_pos1+4*(i+2));
+            auto w = Float4(aligned_pos1+pos1_stride*(i+3)) - Float4(cache_pos1+4*(i+3));
+
+            transpose4(x,y,z,w);
+            max_dist_exceeded |= max_cache_dist2 < x*x+y*y+z*z;
+        }
+        if(!symmetric) {
+            for(int i=0; i<n_elem2; i+=4) {
+                auto x = Float4(aligned_pos2+pos2_stride*(i+0)) - Float4(cache_pos2+4*(i+0));
+                auto y = Float4(aligned_pos2+pos2_stride*(i+1)) - Float4(cache_pos2+4*(i+1));
+                auto z = Float4(aligned_pos2+pos2_stride*(i+2)) - Float4(cache_pos2+4*(i+2));
+                auto w = Float4(aligned_pos2+pos2_stride*(i+3)) - Float4(cache_pos2+4*(i+3));
+
+                transpose4(x,y,z,w);
+                max_dist_exceeded |= max_cache_dist2 < x*x+y*y+z*z;
+            }
+        }
+        t1.stop();
+
+        // We don't do early bailout since the cache should be valid most of the time
+        if(cache_valid && max_dist_exceeded.none()) return generation;
+
+        // If we reach here, we must rebuild the cache
+
+        Timer t2("pairlist_cache_rebuild");
+        // Store the new cache positions
+        cache_cutoff = max_cutoff + cache_buffer;
+
+        for(int i=0; i<n_elem1; i+=4) {
+            Float4(aligned_pos1+pos1_stride*(i+0)).store(cache_pos1+4*(i+0));
+            Float4(aligned_pos1+pos1_stride*(i+1)).store(cache_pos1+4*(i+1));
+            Float4(aligned_pos1+pos1_stride*(i+2)).store(cache_pos1+4*(i+2));
+            Float4(aligned_pos1+pos1_stride*(i+3)).store(cache_pos1+4*(i+3));
+        }
+        if(!symmetric) {
+            for(int i=0; i<n_elem2; i+=4) {
+                Float4(aligned_pos2+pos2_stride*(i+0)).store(cache_pos2+4*(i+0));
+                Float4(aligned_pos2+pos2_stride*(i+1)).store(cache_pos2+4*(i+1));
+                Float4(aligned_pos2+pos2_stride*(i+2)).store(cache_pos2+4*(i+2));
+                Float4(aligned_pos2+pos2_stride*(i+3)).store(cache_pos2+4*(i+3));
+            }
+        }
+
+        // Find all cache pairs
+        n_edge = use_cell_list() ? find_cache_edges_cell_list() : find_cache_edges_all_pairs();
+        if(round_up(n_edge,4) > edge_capacity) grow_edges();
+        for(int i=n_edge; i<round_up(n_edge,4); ++i) {
+            // we need something sane to fill out the last group of 4 so just duplicate the interactions
+            edge_indices1[i] = edge_indices1[i-i%4];
+            edge_indices2[i] = edge_indices2[i-i%4];
+        }
+        cache_valid = true;
+        return ++generation;
+    }
+};
+
+
+//! \brief Key identifying the positions of a PairCache: source nodes and element indices
+//!
+//! The second node and indices are empty for symmetric interactions.
+typedef std::tuple<const void*, std::vector<index_t>, const void*, std::vector<index_t>> PairCacheKey;
+
+//! \brief Obtain the PairCache shared by all users of the same key, creating it if necessary
+//!
+//! The registry holds only weak references, so a cache is freed with its last user.  The
+//! entries of freed caches are removed whenever a new cache is created, so that engines
+//! that are repeatedly built and destroyed do not grow the registry.
+template <bool symmetric>
+std::shared_ptr<PairCache<symmetric>> shared_pair_cache(const PairCacheKey& key, int max_n_edge) {
+    static std::mutex registry_mut;
+    static std::map<PairCacheKey, std::weak_ptr<PairCache<symmetric>>> registry;
+
+    std::lock_guard<std::mutex> lock(registry_mut);
+    auto cache = registry[key].lock();
+    if(!cache) {
+        for(auto it=registry.begin(); it!=registry.end(); )
+            it = it->second.expired() ? registry.erase(it) : std::next(it);
+
+        int n_elem1 = std::get<1>(key).size();
+        int n_elem2 = symmetric ? n_elem1 : std::get<3>(key).size();
+        cache = std::make_shared<PairCache<symmetric>>(n_elem1, n_elem2, max_n_edge);
+        registry[key] = cache;
+    }
+    return cache;
+}
+
+
 template <bool symmetric>
 struct PairlistComputation {
     typedef Int4(*acceptable_id_pair_t)(const Int4&,const Int4&);
@@ -38,11 +388,13 @@ struct PairlistComputation {
         int n_edge;
 
     protected:
-        bool cache_valid;
-        float cache_buffer;
-        float cache_cutoff;
-        std::unique_ptr<float[]>    cache_pos1, cache_pos2;
+        // The cached pairs are filtered by id into this pairlist's own cache edge list, which
+        // is only redone when the shared cache is rebuilt or the ids change.
+        std::shared_ptr<PairCache<symmetric>> cache;
+        bool     cache_valid;
+        uint64_t cache_generation;
         std::unique_ptr<int32_t[]>  cache_id1,  cache_id2;
+        int cache_edge_capacity;
         std::unique_ptr<int32_t[]>  cache_edge_indices1, cache_edge_indices2;
         std::unique_ptr<int32_t[]>  cache_edge_id1,      cache_edge_id2;
         int cache_n_edge;
@@ -53,108 +405,48 @@ struct PairlistComputation {
                 const float* aligned_pos1, const int pos1_stride, int* id1, 
                 const float* aligned_pos2, const int pos2_stride, int* id2)
         {
-            Timer t1("pairlist_cache_check");
-            // Find maximum deviation from cached positions to determine if cache must be rebuilt
-            auto max_dist_exceeded = Float4();
-            auto id_changed = Int4();
-            auto max_cache_dist2 = Float4(sqr(0.5f*(cache_cutoff - cutoff)));
-
-            for(int i=0; i<n_elem1; i+=4) {
-                auto x = Float4(aligned_pos1+pos1_stride*(i+0)) - Float4(cache_pos1+4*(i+0));
-                auto y = Float4(aligned_pos1+pos1_stride*(i+1)) - Float4(cache_pos1+4*(i+1));
-                auto z = Float4(aligned_pos1+pos1_stride*(i+2)) - Float4(cache_pos1+4*(i+2));
-                auto w = Float4(aligned_pos1+pos1_stride*(i+3)) - Float4(cache_pos1+4*(i+3));
-
-                transpose4(x,y,z,w);
-                max_dist_exceeded |= max_cache_dist2 < x*x+y*y+z*z;
-
-                // To ensure the caching is completely transparent, we must also ensure that the id's have not 
-                // changed.  Hopefully, this check is quite quick.
-                id_changed |= Int4(id1+i)!=Int4(cache_id1+i);
-            }
-            if(!symmetric) {
-                for(int i=0; i<n_elem2; i+=4) {
-                    auto x = Float4(aligned_pos2+pos2_stride*(i+0)) - Float4(cache_pos2+4*(i+0));
-                    auto y = Float4(aligned_pos2+pos2_stride*(i+1)) - Float4(cache_pos2+4*(i+1));
-                    auto z = Float4(aligned_pos2+pos2_stride*(i+2)) - Float4(cache_pos2+4*(i+2));
-                    auto w = Float4(aligned_pos2+pos2_stride*(i+3)) - Float4(cache_pos2+4*(i+3));
-
-                    transpose4(x,y,z,w);
-                    max_dist_exceeded |= max_cache_dist2 < x*x+y*y+z*z;
-                    id_changed |= Int4(id2+i)!=Int4(cache_id2+i);
-                }
-            }
-            t1.stop();
-
-            // We don't do early bailout since the cache should be valid most of the time
-            if(cache_valid && max_dist_exceeded.none() && id_changed.none()) return;
-            // printf("cache rebuild\n");
+            std::lock_guard<std::mutex> lock(cache->mut);
+            auto generation = cache->ensure_valid(cutoff, aligned_pos1, pos1_stride, aligned_pos2, pos2_stride);
 
-            // If we reach here, we must rebuild the cache
+            // To ensure the caching is completely transparent, we must also ensure that the id's have not 
+            // changed.  Hopefully, this check is quite quick.
+            auto id_changed = Int4();
+            for(int i=0; i<n_elem1; i+=4) id_changed |= Int4(id1+i)!=Int4(cache_id1+i);
+            if(!symmetric)
+                for(int i=0; i<n_elem2; i+=4) id_changed |= Int4(id2+i)!=Int4(cache_id2+i);
 
-            Timer t2("pairlist_cache_rebuild");
-            // Store the new cache positions
-            cache_cutoff = cutoff + cache_buffer;
+            if(cache_valid && generation==cache_generation && id_changed.none()) return;
 
-            for(int i=0; i<n_elem1; i+=4) {
-                Float4(aligned_pos1+pos1_stride*(i+0)).store(cache_pos1+4*(i+0));
-                Float4(aligned_pos1+pos1_stride*(i+1)).store(cache_pos1+4*(i+1));
-                Float4(aligned_pos1+pos1_stride*(i+2)).store(cache_pos1+4*(i+2));
-                Float4(aligned_pos1+pos1_stride*(i+3)).store(cache_pos1+4*(i+3));
-                Int4(id1+i).store(cache_id1+i);
-            }
-            if(!symmetric) {
-                for(int i=0; i<n_elem2; i+=4) {
-                    Float4(aligned_pos2+pos2_stride*(i+0)).store(cache_pos2+4*(i+0));
-                    Float4(aligned_pos2+pos2_stride*(i+1)).store(cache_pos2+4*(i+1));
-                    Float4(aligned_pos2+pos2_stride*(i+2)).store(cache_pos2+4*(i+2));
-                    Float4(aligned_pos2+pos2_stride*(i+3)).store(cache_pos2+4*(i+3));
-                    Int4(id2+i).store(cache_id2+i);
-                }
+            Timer timer("pairlist_cache_filter");
+            for(int i=0; i<n_elem1; i+=4) Int4(id1+i).store(cache_id1+i);
+            if(!symmetric)
+                for(int i=0; i<n_elem2; i+=4) Int4(id2+i).store(cache_id2+i);
+
+            if(cache->edge_capacity > cache_edge_capacity) {
+                cache_edge_capacity = cache->edge_capacity;
+                cache_edge_indices1 = new_aligned<int32_t>(cache_edge_capacity, 4);
+                cache_edge_indices2 = new_aligned<int32_t>(cache_edge_capacity, 4);
+                cache_edge_id1      = new_aligned<int32_t>(cache_edge_capacity, 4);
+                cache_edge_id2      = new_aligned<int32_t>(cache_edge_capacity, 4);
             }
 
-            // Find all cache pairs
-            alignas(16) int32_t offset_v[4] = {0,1,2,3};
-            Int4 offset(offset_v);
-            auto cutoff2 = Float4(sqr(cache_cutoff));
-
             int ne = 0;
-            for(int32_t i1=0; i1<n_elem1; i1+=4) {
-                Float4 v0(cache_pos1+(i1+0)*4), // aligned_pos1 size was rounded up
-                       v1(cache_pos1+(i1+1)*4), 
-                       v2(cache_pos1+(i1+2)*4), 
-                       v3(cache_pos1+(i1+3)*4);
-                transpose4(v0,v1,v2,v3); // v3 will be unused at the end
-                auto  x1 = make_vec3(v0,v1,v2);
-
-                auto  my_id1 = Int4(cache_id1+i1);
-                auto  i1_vec = Int4(i1) + offset;
-
-                for(int32_t i2=symmetric?i1+1:0; i2<n_elem2; ++i2) {
-                    const float* p = (symmetric?cache_pos1:cache_pos2)+i2*4;
-                    auto  x2 = make_vec3(Float4(p[0]), Float4(p[1]),  Float4(p[2]));
-                    auto near = mag2(x1-x2)<cutoff2;
-                    if(near.none()) continue;
-
-                    auto my_id2 = Int4((symmetric?cache_id1:cache_id2)[i2]);
-                    auto i2_vec = Int4(i2);
-
-                    Int4 is_hit = acceptable_id_pair(my_id1,my_id2) & (symmetric 
-                        ? (i1_vec<i2_vec) & near.cast_int()
-                        :                   near.cast_int());
-                    int is_hit_bits = is_hit.movemask();
-
-                    // i2_vec and my_id2 is constant, so we don't have to left pack
-                    // left_pack requires a read, so do before the writes
-
-                    // write out pairs
-                    int n_hit = popcnt_nibble(is_hit_bits);
-                    i1_vec.left_pack(is_hit_bits).store(cache_edge_indices1+ne, Alignment::unaligned);
-                    my_id1.left_pack(is_hit_bits).store(cache_edge_id1     +ne, Alignment::unaligned);
-                    i2_vec                       .store(cache_edge_indices2+ne, Alignment::unaligned);
-                    my_id2                       .store(cache_edge_id2     +ne, Alignment::unaligned);
-                    ne += n_hit;
-                }
+            for(int i_edge=0; i_edge<cache->n_edge; i_edge+=4) {
+                auto i1 = Int4(cache->edge_indices1+i_edge);
+                auto i2 = Int4(cache->edge_indices2+i_edge);
+                auto my_id1 = Int4(id1, i1);
+                auto my_id2 = Int4(symmetric?id1:id2, i2);
+
+                int is_hit_bits = acceptable_id_pair(my_id1,my_id2).movemask();
+                int n_valid = cache->n_edge-i_edge;
+                if(n_valid<4) is_hit_bits &= (1<<n_valid)-1;  // exclude padding
+
+                int n_hit = popcnt_nibble(is_hit_bits);
+                i1    .left_pack(is_hit_bits).store(cache_edge_indices1+ne, Alignment::unaligned);
+                i2    .left_pack(is_hit_bits).store(cache_edge_indices2+ne, Alignment::unaligned);
+                my_id1.left_pack(is_hit_bits).store(cache_edge_id1     +ne, Alignment::unaligned);
+                my_id2.left_pack(is_hit_bits).store(cache_edge_id2     +ne, Alignment::unaligned);
+                ne += n_hit;
             }
             cache_n_edge = ne;
             for(int i=ne; i<round_up(ne,4); ++i) {
@@ -163,12 +455,24 @@ struct PairlistComputation {
                 cache_edge_indices1[i] = cache_edge_indices1[i-i%4];
                 cache_edge_indices2[i] = cache_edge_indices2[i-i%4]; // just put something sane here
             }
+            cache_generation = generation;
             cache_valid = true;
-            // printf("found %i cache edges\n", cache_n_edge);
         }
 
     public:
-        void change_cache_buffer(float new_buffer) {cache_buffer=new_buffer;}
+        void change_cache_buffer(float new_buffer) {cache->request_buffer(new_buffer);}
+
+        //! \brief Force the cached pairs to be rebuilt on the next find_edges
+        void invalidate_cache() {cache->invalidate(); cache_valid = false;}
+
+        //! \brief Use the PairCache shared by all pairlists over the same positions
+        void share_cache(const PairCacheKey& key) {
+            auto shared = shared_pair_cache<symmetric>(key, cache->edge_capacity);
+            shared->request_buffer(cache->cache_buffer);
+            cache = shared;
+            cache_valid = false;
+        }
+
         PairlistComputation(int n_elem1_, int n_elem2_, int max_n_edge):
             n_elem1(n_elem1_), n_elem2(n_elem2_),
 
@@ -179,23 +483,84 @@ struct PairlistComputation {
 
             n_edge(0),
 
+            cache(std::make_shared<PairCache<symmetric>>(n_elem1, n_elem2, max_n_edge)),
             cache_valid(false),
-            cache_buffer(1.f), // reasonable value that the user can modify
-            cache_pos1(new_aligned<float>(round_up(n_elem1,16)*4,             4)),
-            cache_pos2(new_aligned<float>(round_up(symmetric?16:n_elem2,16)*4,4)),
+            cache_generation(0u),
             cache_id1(new_aligned<int32_t>(round_up(n_elem1,16),4)),
             cache_id2(new_aligned<int32_t>(round_up(n_elem2,16),4)),
-            cache_edge_indices1(new_aligned<int32_t>(max_n_edge, 4)),
-            cache_edge_indices2(new_aligned<int32_t>(max_n_edge, 4)),
-            cache_edge_id1     (new_aligned<int32_t>(max_n_edge, 4)),
-            cache_edge_id2     (new_aligned<int32_t>(max_n_edge, 4)),
+            cache_edge_capacity(cache->edge_capacity),
+            cache_edge_indices1(new_aligned<int32_t>(cache_edge_capacity, 4)),
+            cache_edge_indices2(new_aligned<int32_t>(cache_edge_capacity, 4)),
+            cache_edge_id1     (new_aligned<int32_t>(cache_edge_capacity, 4)),
+            cache_edge_id2     (new_aligned<int32_t>(cache_edge_capacity, 4)),
             cache_n_edge(0)
-        {
-            for(int i=0; i<n_elem1; i+=4)
-                for(int j=0; j<4; ++j) Float4(1e10f).store(cache_pos1+4*(i+j));
-            if(!symmetric)
-                for(int i=0; i<n_elem2; i+=4)
-                    for(int j=0; j<4; ++j) Float4(1e10f).store(cache_pos2+4*(i+j));
+        {}
+
+        // Refine whole groups of 8 cache edges, appending to the edge list at ne, and
+        // return the number of cache edges processed
+        SIMD_TARGET_AVX2
+        int refine_edges_width8(float cutoff,
+                const float* aligned_pos1, const int pos1_stride,
+                const float* aligned_pos2, const int pos2_stride, int& ne) {
+            const float* pos2 = symmetric?aligned_pos1:aligned_pos2;
+            Float8 cutoff2(sqr(cutoff));
+            Int8 stride1(pos1_stride), stride2(pos2_stride);
+
+            int i_edge=0;
+            for(; i_edge+8<=cache_n_edge; i_edge+=8) {
+                auto i1   = Int8(cache_edge_indices1+i_edge, Alignment::unaligned);
+                auto i2   = Int8(cache_edge_indices2+i_edge, Alignment::unaligned);
+                auto eid1 = Int8(cache_edge_id1     +i_edge, Alignment::unaligned);
+                auto eid2 = Int8(cache_edge_id2     +i_edge, Alignment::unaligned);
+
+                auto offset1 = i1*stride1;
+                auto offset2 = i2*stride2;
+                auto dx = Float8(aligned_pos1+0, offset1) - Float8(pos2+0, offset2);
+                auto dy = Float8(aligned_pos1+1, offset1) - Float8(pos2+1, offset2);
+                auto dz = Float8(aligned_pos1+2, offset1) - Float8(pos2+2, offset2);
+                auto dist2 = dx*dx + dy*dy + dz*dz;
+
+                int acceptable = (dist2<cutoff2).movemask();
+                i1  .left_pack(acceptable).store(edge_indices1+ne, Alignment::unaligned);
+                i2  .left_pack(acceptable).store(edge_indices2+ne, Alignment::unaligned);
+                eid1.left_pack(acceptable).store(edge_id1     +ne, Alignment::unaligned);
+                eid2.left_pack(acceptable).store(edge_id2     +ne, Alignment::unaligned);
+                ne += _mm_popcnt_u32(acceptable);
+            }
+            return i_edge;
+        }
+
+        // Same as refine_edges_width8 for groups of 16
+        SIMD_TARGET_AVX512
+        int refine_edges_width16(float cutoff,
+                const float* aligned_pos1, const int pos1_stride,
+                const float* aligned_pos2, const int pos2_stride, int& ne) {
+            const float* pos2 = symmetric?aligned_pos1:aligned_pos2;
+            Float16 cutoff2(sqr(cutoff));
+            Int16 stride1(pos1_stride), stride2(pos2_stride);
+
+            int i_edge=0;
+            for(; i_edge+16<=cache_n_edge; i_edge+=16) {
+                auto i1   = Int16(cache_edge_indices1+i_edge, Alignment::unaligned);
+                auto i2   = Int16(cache_edge_indices2+i_edge, Alignment::unaligned);
+                auto eid1 = Int16(cache_edge_id1     +i_edge, Alignment::unaligned);
+                auto eid2 = Int16(cache_edge_id2     +i_edge, Alignment::unaligned);
+
+                auto offset1 = i1*stride1;
+                auto offset2 = i2*stride2;
+                auto dx = Float16(aligned_pos1+0, offset1) - Float16(pos2+0, offset2);
+                auto dy = Float16(aligned_pos1+1, offset1) - Float16(pos2+1, offset2);
+                auto dz = Float16(aligned_pos1+2, offset1) - Float16(pos2+2, offset2);
+                auto dist2 = dx*dx + dy*dy + dz*dz;
+
+                int acceptable = (dist2<cutoff2).movemask();
+                i1  .compress_store(edge_indices1+ne, acceptable);
+                i2  .compress_store(edge_indices2+ne, acceptable);
+                eid1.compress_store(edge_id1     +ne, acceptable);
+                eid2.compress_store(edge_id2     +ne, acceptable);
+                ne += _mm_popcnt_u32(acceptable);
+            }
+            return i_edge;
         }
 
         template<acceptable_id_pair_t acceptable_id_pair>
@@ -208,13 +573,21 @@ struct PairlistComputation {
                     aligned_pos2, pos2_stride, id2);
             // Timer timer("pairlist_refine");
 
-            int ne=0;
-            alignas(16) int32_t offset_v[4] = {0,1,2,3};
-            Int4 offset(offset_v);
+            // Refine as much of the cache as possible with the widest vectors available on this
+            // processor, then finish with 4-wide vectors, which handle the padding at the end.
+            int ne=0, i_edge=0;
+            switch(runtime_simd_width()) {
+                case 16: i_edge = refine_edges_width16(cutoff, aligned_pos1, pos1_stride,
+                                 aligned_pos2, pos2_stride, ne); break;
+                case  8: i_edge = refine_edges_width8 (cutoff, aligned_pos1, pos1_stride,
+                                 aligned_pos2, pos2_stride, ne); break;
+                default: break;
+            }
+
             Float4 cutoff2(sqr(cutoff));
 
             int acceptable = 0;
-            for(int i_edge=0; i_edge<cache_n_edge; i_edge+=4) {
+            for(; i_edge<cache_n_edge; i_edge+=4) {
                 auto i1 = Int4(cache_edge_indices1+i_edge);
                 auto i2 = Int4(cache_edge_indices2+i_edge);
                 auto eid1 = Int4(cache_edge_id1+i_edge);
@@ -295,7 +668,8 @@ struct InteractionGraph{
     std::unique_ptr<float[]>    edge_deriv;  // this may become a SIMD-type vector
     std::unique_ptr<float[]>    edge_sensitivity; // must be filled by user of this class
 
-    std::unique_ptr<float[]> interaction_param;
+    // shared with other nodes having identical parameters, so never modified in place
+    std::shared_ptr<const float> interaction_param;
 
     std::unique_ptr<float[]> pos1_deriv, pos2_deriv;
 
@@ -332,8 +706,6 @@ struct InteractionGraph{
         edge_deriv      (new_aligned<float>  (max_n_edge*(n_dim1+n_dim2), align_bytes)),
         edge_sensitivity(new_aligned<float>  (max_n_edge,                 align_bytes)),
 
-        interaction_param(new_aligned<float>(n_type1*n_type2*n_param, 4)),
-
         pos1_deriv(new_aligned<float>(round_up(n_elem1,16)*n_dim1a,             maxint(4,simd_width))),
         pos2_deriv(new_aligned<float>(round_up(symmetric?16:n_elem2,16)*n_dim2a, maxint(4,simd_width)))
 
@@ -355,29 +727,27 @@ struct InteractionGraph{
         check_elem_width_lower_bound(*pos_node1, n_dim1);
         if(!s) check_elem_width_lower_bound(*pos_node2, n_dim2);
 
-        check_size(grp, "interaction_param", n_type1, n_type2, n_param);
-        traverse_dset<3,float>(grp, "interaction_param", [&](size_t nt1, size_t nt2, size_t np, float x) {
-                interaction_param[(nt1*n_type2+nt2)*n_param+np] = x;});
+        // whole-dataset reads, since these arrays are large for big systems
+        interaction_param = intern_param_array(
+                read_dset<float>(grp, "interaction_param", {size_t(n_type1), size_t(n_type2), size_t(n_param)}));
         update_cutoffs();
 
-        check_size(grp, suffix1("index").c_str(), n_elem1); if(!s) check_size(grp, "index2", n_elem2);
-        check_size(grp, suffix1("type").c_str(),  n_elem1); if(!s) check_size(grp, "type2",  n_elem2);
-        check_size(grp, suffix1("id").c_str(),    n_elem1); if(!s) check_size(grp, "id2",    n_elem2);
-
         for(int i=0; i<round_up(n_elem1,16); ++i) id1[i] = 0;  // padding
-        traverse_dset<1,int>(grp,suffix1("index").c_str(),[&](size_t nr,int x){loc1.push_back(x);});
-        traverse_dset<1,int>(grp,suffix1("type" ).c_str(),[&](size_t nr,int x){types1[nr]=x;});
-        traverse_dset<1,int>(grp,suffix1("id"   ).c_str(),[&](size_t nr,int x){id1   [nr]=x;});
+        loc1 = read_dset<index_t>(grp, suffix1("index").c_str(), {size_t(n_elem1)});
+        read_dset(grp, suffix1("type").c_str(), {size_t(n_elem1)}, types1.get());
+        read_dset(grp, suffix1("id"  ).c_str(), {size_t(n_elem1)}, id1.get());
 
         if(!s) {
             for(int i=0; i<round_up(n_elem2,16); ++i) id2[i] = 0;  // padding
-            traverse_dset<1,int>(grp,"index2",[&](size_t nr,int x){loc2.push_back(x);});
-            traverse_dset<1,int>(grp,"type2", [&](size_t nr,int x){types2[nr]=x;});
-            traverse_dset<1,int>(grp,"id2",   [&](size_t nr,int x){id2   [nr]=x;});
+            loc2 = read_dset<index_t>(grp, "index2", {size_t(n_elem2)});
+            read_dset(grp, "type2", {size_t(n_elem2)}, types2.get());
+            read_dset(grp, "id2",   {size_t(n_elem2)}, id2.get());
         } else {
             for(int nr: range(n_elem2)) types2[nr] = types1[nr];
             for(int nr: range(n_elem2)) id2   [nr] = id1   [nr];
         }
+
+        pairlist.share_cache(PairCacheKey(pos_node1, loc1, s?nullptr:pos_node2, loc2));
     }
 
     void update_cutoffs() {
@@ -397,6 +767,8 @@ struct InteractionGraph{
         // printf("using cache_buffer %.2f for %i %i %i\n", new_buffer, n_dim1, n_dim2, int(symmetric));
     }
 
+    void reset_caches() {pairlist.invalidate_cache();}
+
     std::vector<float> get_param() const {
         return {interaction_param.get(), interaction_param.get()+n_type1*n_type2*n_param};
     }
@@ -420,7 +792,7 @@ struct InteractionGraph{
                 std::to_string(n_type1*n_type2*IType::n_param) + " params of shape (" +
                 std::to_string(n_type1)+", "+std::to_string(n_type2)+", "+
                 std::to_string(IType::n_param)+")";
-        std::copy(begin(new_param), end(new_param), interaction_param.get());
+        interaction_param = intern_param_array(new_param);  // copy-on-write
         update_cutoffs();
     }
 
@@ -440,6 +812,84 @@ struct InteractionGraph{
         return retval;
     }
 
+    //! \brief Call f(i1,i2,value) for each edge with at least one dirty element
+    //!
+    //! d1 and d2 are the dirty sets of pos_node1 and pos_node2 (d2 is unused if symmetric).
+    //! Pairs are found by brute force from the dirty elements, so this is only efficient when
+    //! few elements are dirty (see DerivEngine::incremental_max_fraction).  Edges are computed
+    //! from the current node outputs, with the same cutoff and id exclusions as compute_edges,
+    //! and symmetric pairs are visited once.
+    template <typename F>
+    void visit_dirty_edges(const DirtySet& d1, const DirtySet* d2, const F& f) {
+        VecArray posv1 = pos_node1->output;
+        VecArray posv2 = (symmetric ? pos_node1 : pos_node2)->output;
+        auto& loc2s = symmetric ? loc1 : loc2;
+        auto& d2s   = symmetric ? d1 : *d2;
+        const float cutoff2 = sqr(cutoff);
+
+        alignas(16) float coord1_buf[4*n_dim1a];
+        alignas(16) float coord2_buf[4*n_dim2a];
+        alignas(16) int32_t offset1[4] = {0, n_dim1a, 2*n_dim1a, 3*n_dim1a};
+        alignas(16) int32_t offset2[4] = {0, n_dim2a, 2*n_dim2a, 3*n_dim2a};
+        const float* interaction_ptr[4];
+        int pending1[4], pending2[4];
+        int n_pending = 0;
+
+        auto flush = [&]() {
+            for(int j=n_pending; j<4; ++j) {  // pad with copies of the first pair
+                interaction_ptr[j] = interaction_ptr[0];
+                for(int d=0; d<n_dim1a; ++d) coord1_buf[j*n_dim1a+d] = coord1_buf[d];
+                for(int d=0; d<n_dim2a; ++d) coord2_buf[j*n_dim2a+d] = coord2_buf[d];
+            }
+            auto coord1 = aligned_gather_vec<n_dim1>(coord1_buf, Int4(offset1));
+            auto coord2 = aligned_gather_vec<n_dim2>(coord2_buf, Int4(offset2));
+            Vec<n_dim1,Float4> dd1;
+            Vec<n_dim2,Float4> dd2;
+            alignas(16) float value[4];
+            IType::compute_edge(dd1,dd2, interaction_ptr, coord1,coord2).store(value);
+            for(int j=0; j<n_pending; ++j) f(pending1[j], pending2[j], value[j]);
+            n_pending = 0;
+        };
+
+        auto add_pair = [&](int i1, int i2) {
+            auto x1 = load_vec<n_dim1>(posv1, loc1 [i1]);
+            auto x2 = load_vec<n_dim2>(posv2, loc2s[i2]);
+            auto disp = extract<0,3>(x1) - extract<0,3>(x2);
+            if(!(mag2(disp) < cutoff2)) return;
+            if(!IType::acceptable_id_pair(Int4(id1[i1]), Int4(id2[i2])).any()) return;
+
+            interaction_ptr[n_pending] = interaction_param + (types1[i1]*n_type2 + types2[i2])*n_param;
+            store_vec(coord1_buf+n_pending*n_dim1a, x1);
+            store_vec(coord2_buf+n_pending*n_dim2a, x2);
+            pending1[n_pending] = i1;
+            pending2[n_pending] = i2;
+            if(++n_pending == 4) flush();
+        };
+
+        auto dirty1 = [&](int i1) {return d1 .contains(loc1 [i1]);};
+        auto dirty2 = [&](int i2) {return d2s.contains(loc2s[i2]);};
+
+        for(int i1=0; i1<n_elem1; ++i1) {
+            if(!dirty1(i1)) continue;
+            for(int i2=0; i2<n_elem2; ++i2) {
+                // for symmetric interactions, count each pair once and skip self pairs
+                if(symmetric && (i2==i1 || (i2<i1 && dirty2(i2)))) continue;
+                add_pair(i1,i2);
+            }
+        }
+        if(!symmetric) {
+            for(int i2=0; i2<n_elem2; ++i2) {
+                if(!dirty2(i2)) continue;
+                for(int i1=0; i1<n_elem1; ++i1)
+                    if(!dirty1(i1)) add_pair(i1,i2);
+            }
+        }
+        if(n_pending) flush();
+    }
+
+    // The interaction kernels are written against Float4, so compute_edges and
+    // propagate_derivatives process 4 edges at a time.  Only the pairlist refinement
+    // uses 8 and 16 lanes.
     template<bool param_deriv=false>
     void compute_edges() {
         // Copy in the data to packed arrays to ensure contiguity
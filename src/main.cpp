@@ -10,8 +10,12 @@
 #include <set>
 #include "random.h"
 #include "state_logger.h"
+#include "param_store.h"
 #include <csignal>
 #include <map>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
 
 #if defined(_OPENMP)
 #include <omp.h>
@@ -90,6 +94,80 @@ struct SignalHandlerHandler {
 
     
 
+// Binary snapshot of the complete simulation state for exact restarts.  Values are stored
+// in native byte order, so a checkpoint can only be read on the same architecture.
+struct Checkpoint {
+    vector<char> bytes;
+    size_t read_pos;
+
+    Checkpoint(): read_pos(0u) {}
+
+    template <typename T>
+    void put_array(const T* x, size_t n) {
+        auto p = reinterpret_cast<const char*>(x);
+        bytes.insert(bytes.end(), p, p+n*sizeof(T));
+    }
+    template <typename T>
+    void put(const T& x) {put_array(&x, 1);}
+
+    template <typename T>
+    void get_array(T* x, size_t n) {
+        if(read_pos + n*sizeof(T) > bytes.size()) throw string("checkpoint is truncated");
+        memcpy(x, bytes.data()+read_pos, n*sizeof(T));
+        read_pos += n*sizeof(T);
+    }
+    template <typename T>
+    T get() {T x; get_array(&x, 1); return x;}
+
+    // file layout is the magic string, the format version, the byte count and the bytes
+    static constexpr const char* magic = "UPSIDE_CHECKPOINT";
+    static constexpr uint32_t version = 1u;
+
+    // The file is written under a temporary name and renamed, so that an existing
+    // checkpoint is never left partially overwritten.
+    void write(const string& path) const {
+        string tmp_path = path + ".tmp";
+        FILE* f = fopen(tmp_path.c_str(), "wb");
+        if(!f) throw string("unable to open checkpoint file ") + tmp_path;
+        uint32_t file_version = version;
+        uint64_t n_bytes = bytes.size();
+        bool ok = fwrite(magic, strlen(magic)+1, 1, f) == 1u &&
+                  fwrite(&file_version, sizeof(file_version), 1, f) == 1u &&
+                  fwrite(&n_bytes, sizeof(n_bytes), 1, f) == 1u &&
+                  fwrite(bytes.data(), 1, n_bytes, f) == n_bytes &&
+                  !fflush(f) && !fsync(fileno(f));
+        ok = !fclose(f) && ok;
+        if(!ok || rename(tmp_path.c_str(), path.c_str()))
+            throw string("unable to write checkpoint file ") + path;
+    }
+
+    static Checkpoint read(const string& path) {
+        Checkpoint ck;
+        FILE* f = fopen(path.c_str(), "rb");
+        if(!f) throw string("unable to open checkpoint file ") + path;
+        vector<char> file_magic(strlen(magic)+1);
+        uint32_t file_version = 0u;
+        uint64_t n_bytes = 0u;
+        bool ok = fread(file_magic.data(), file_magic.size(), 1, f) == 1u &&
+                  !memcmp(file_magic.data(), magic, file_magic.size()) &&
+                  fread(&file_version, sizeof(file_version), 1, f) == 1u &&
+                  file_version == version &&
+                  fread(&n_bytes, sizeof(n_bytes), 1, f) == 1u;
+        if(ok) {
+            ck.bytes.resize(n_bytes);
+            ok = fread(ck.bytes.data(), 1, n_bytes, f) == n_bytes;
+        }
+        fclose(f);
+        if(!ok) throw string("invalid or truncated checkpoint file ") + path;
+        return ck;
+    }
+
+    void check_finished() const {
+        if(read_pos != bytes.size()) throw string("checkpoint contains unexpected trailing data");
+    }
+};
+
+
 struct System {
     int n_atom;
     uint32_t random_seed;
@@ -102,12 +180,67 @@ struct System {
     VecArrayStorage mom; // momentum
     OrnsteinUhlenbeckThermostat thermostat;
     uint64_t round_num;
-    System(): round_num(0) {}
+    double cycle_energy_change; // total energy change over the last measured integration cycle
+    System(): round_num(0), cycle_energy_change(0.) {}
+
+    double total_energy(float dt) {
+        // The integrator leaves the momenta half a step behind the positions, so they
+        // are advanced by half a step for the kinetic energy
+        engine.compute(PotentialAndDerivMode);
+        double kinetic = 0.;
+        for(int na=0; na<n_atom; ++na)
+            kinetic += 0.5*mag2(load_vec<3>(mom,na) - (0.5f*dt)*load_vec<3>(engine.pos->sens,na));
+        return engine.potential + kinetic;
+    }
 
     void set_temperature(float new_temp) {
         temperature = new_temp;
         thermostat.set_temp(temperature);
     }
+
+    // The random streams depend only on the seed, the round and the thermostat invocation
+    // count, so these with the coordinates determine the rest of the trajectory
+    void save_state(Checkpoint& ck) {
+        ck.put<int32_t> (n_atom);
+        ck.put<uint64_t>(round_num);
+        ck.put<float>   (temperature);
+        ck.put<uint64_t>(thermostat.get_n_invocations());
+        ck.put<int64_t> (engine.inner_step);
+        ck.put<double>  (cycle_energy_change);
+
+        VecArray pos = engine.pos->output;
+        for(int na=0; na<n_atom; ++na) for(int d=0; d<3; ++d) ck.put<float>(pos(d,na));
+        for(int na=0; na<n_atom; ++na) for(int d=0; d<3; ++d) ck.put<float>(mom(d,na));
+
+        ck.put<int32_t>(mc_samplers.samplers.size());
+        for(auto& s: mc_samplers.samplers) {
+            ck.put<uint64_t>(s->move_stats.n_success);
+            ck.put<uint64_t>(s->move_stats.n_attempt);
+        }
+    }
+
+    void load_state(Checkpoint& ck) {
+        int ck_n_atom = ck.get<int32_t>();
+        if(ck_n_atom != n_atom) throw string("checkpoint has ") + to_string(ck_n_atom) +
+            " atoms for a system with " + to_string(n_atom) + " atoms";
+        round_num = ck.get<uint64_t>();
+        set_temperature(ck.get<float>());
+        thermostat.set_n_invocations(ck.get<uint64_t>());
+        engine.inner_step   = ck.get<int64_t>();
+        cycle_energy_change = ck.get<double>();
+
+        VecArray pos = engine.pos->output;
+        for(int na=0; na<n_atom; ++na) for(int d=0; d<3; ++d) pos(d,na) = ck.get<float>();
+        for(int na=0; na<n_atom; ++na) for(int d=0; d<3; ++d) mom(d,na) = ck.get<float>();
+
+        if(ck.get<int32_t>() != int(mc_samplers.samplers.size()))
+            throw string("checkpoint and command line disagree about Monte Carlo samplers");
+        for(auto& s: mc_samplers.samplers) {
+            s->move_stats.n_success = ck.get<uint64_t>();
+            s->move_stats.n_attempt = ck.get<uint64_t>();
+        }
+        engine.reset_caches();
+    }
 };
 
 
@@ -142,8 +275,11 @@ struct ReplicaExchange {
     vector<vector<SwapPair>> swap_sets;
     vector<int> replica_indices;
     vector<vector<SwapPair*>> participating_swaps;
+    double exchange_time;  // wall time spent in attempt_swaps (seconds)
 
-    ReplicaExchange(vector<System>& systems, vector<string> swap_sets_strings) {
+    ReplicaExchange(vector<System>& systems, vector<string> swap_sets_strings):
+        exchange_time(0.)
+    {
         int n_system = systems.size();
         for(int ns: range(n_system)) {
             replica_indices.push_back(ns);
@@ -218,26 +354,56 @@ struct ReplicaExchange {
         }
     }
 
+    void save_state(Checkpoint& ck) {
+        ck.put<int32_t>(replica_indices.size());
+        ck.put_array(replica_indices.data(), replica_indices.size());
+        for(auto& ss: swap_sets) {
+            ck.put<int32_t>(ss.size());
+            for(auto& sw: ss) {
+                ck.put<uint64_t>(sw.n_attempt);
+                ck.put<uint64_t>(sw.n_success);
+            }
+        }
+    }
+
+    void load_state(Checkpoint& ck) {
+        if(ck.get<int32_t>() != int(replica_indices.size()))
+            throw string("checkpoint has a different number of replicas");
+        ck.get_array(replica_indices.data(), replica_indices.size());
+        for(auto& ss: swap_sets) {
+            if(ck.get<int32_t>() != int(ss.size()))
+                throw string("checkpoint and command line disagree about swap sets");
+            for(auto& sw: ss) {
+                sw.n_attempt = ck.get<uint64_t>();
+                sw.n_success = ck.get<uint64_t>();
+            }
+        }
+    }
+
     void reset_stats() {
         for(auto& ss: swap_sets)
             for(auto& sw: ss)
                 sw.n_success = sw.n_attempt = 0u;
     }
 
-    void attempt_swaps(uint32_t seed, uint64_t round, vector<System>& systems) {
+    void attempt_swaps(uint32_t seed, uint64_t round, vector<System>& systems, int n_threads) {
+        Timer timer("replica_exchange");
+        auto tstart = chrono::high_resolution_clock::now();
         int n_system = systems.size();
 
         vector<float> beta;
         for(auto &sys: systems) beta.push_back(1.f/sys.temperature);
 
-        // compute the boltzmann factors for everyone
-        auto compute_log_boltzmann = [&]() {
-            vector<float> result(n_system);
-            for(int i=0; i<n_system; ++i) {
-                systems[i].engine.compute(PotentialAndDerivMode);
-                result[i] = -beta[i]*systems[i].engine.potential;
+        // compute the boltzmann factors for the selected systems, which are independent
+        // so that they may be evaluated in parallel
+        auto compute_log_boltzmann = [&](vector<float>& result, const vector<int>& which) {
+            #pragma omp parallel for schedule(dynamic,1) num_threads(n_threads)
+            for(int i=0; i<int(which.size()); ++i) {
+                int ns = which[i];
+                ReplicaTimerScope timer_scope(ns);
+                systems[ns].engine.compute(PotentialOnlyMode);
+                result[ns] = -beta[ns]*systems[ns].engine.potential;
             }
-            return result;
         };
 
         // swap coordinates and the associated system indices
@@ -248,15 +414,23 @@ struct ReplicaExchange {
 
         RandomGenerator random(seed, REPLICA_EXCHANGE_RANDOM_STREAM, 0u, round);
 
+        // The energy of each system is computed with its own Hamiltonian for every
+        // configuration it holds, so this is correct for Hamiltonian parallel tempering
+        // as well.  After the first swap set, each system holds either its configuration
+        // from before the swap or the swapped configuration, and both energies are known.
+        vector<int> all_systems(n_system);
+        for(int ns: range(n_system)) all_systems[ns] = ns;
+        vector<float> old_lboltz(n_system), new_lboltz(n_system);
+        compute_log_boltzmann(old_lboltz, all_systems);
+
         for(auto& set: swap_sets) {
-            // FIXME the first energy computation is unnecessary if we are not on the first swap set
-            // It is important that the energy is computed more than once in case
-            // we are doing Hamiltonian parallel tempering rather than 
-            // temperature parallel tempering
-            
-            auto old_lboltz = compute_log_boltzmann();
-            for(auto& swap_pair: set) coord_swap(swap_pair.sys1, swap_pair.sys2);
-            auto new_lboltz  = compute_log_boltzmann();
+            vector<int> set_systems;
+            for(auto& swap_pair: set) {
+                coord_swap(swap_pair.sys1, swap_pair.sys2);
+                set_systems.push_back(swap_pair.sys1);
+                set_systems.push_back(swap_pair.sys2);
+            }
+            compute_log_boltzmann(new_lboltz, set_systems);
 
             // reverse all swaps that should not occur by metropolis criterion
             for(auto& swap_pair: set) {
@@ -269,9 +443,12 @@ struct ReplicaExchange {
                     coord_swap(s1,s2);
                 } else {
                     swap_pair.n_success++;
+                    old_lboltz[s1] = new_lboltz[s1];
+                    old_lboltz[s2] = new_lboltz[s2];
                 }
             }
         }
+        exchange_time += chrono::duration<double>(chrono::high_resolution_clock::now() - tstart).count();
     }
 };
 
@@ -295,14 +472,6 @@ vector<float> potential_deriv_agreement(DerivEngine& engine) {
         output[0] = engine.potential;
     };
 
-    for(auto &n: engine.nodes) {
-        if(n.computation->potential_term) {
-            auto &v = dynamic_cast<PotentialNode&>(*n.computation.get()).potential;
-            printf("%s: % 4.3f\n", n.name.c_str(), v);
-        }
-    }
-    printf("\n\n");
-
     auto central_diff_jac = central_difference_deriviative(do_compute, input, output, 1e-3);
     vector<float> deriv_array;
     for(int na=0; na<n_atom; ++na)
@@ -343,12 +512,29 @@ try {
             false, -1., "float", cmd);
     ValueArg<double> frame_interval_arg("", "frame-interval", "simulation time between frames", 
             true, -1., "float", cmd);
+    ValueArg<double> pos_precision_arg("", "pos-precision", 
+            "if positive, log positions as pos_quantized instead of pos, rounded to multiples of this "
+            "precision (e.g. 0.001) and stored as differences from the previous frame.  This makes the "
+            "positions 2-4 times smaller on disk, depending on the precision and the frame interval.  "
+            "mdtraj_upside.py decodes pos_quantized (default 0., full precision)",
+            false, 0., "float", cmd);
+    ValueArg<double> scalar_interval_arg("", "scalar-interval", 
+            "simulation time between samples of the scalar observables kinetic, potential and temperature, "
+            "which are logged with their times in scalar_time.  Must be smaller than the frame interval to "
+            "have any effect (default is the frame interval)",
+            false, -1., "float", cmd);
     ValueArg<double> replica_interval_arg("", "replica-interval", 
             "simulation time between applications of replica exchange (0 means no replica exchange, default 0.)", 
             false, 0., "float", cmd);
     ValueArg<double> mc_interval_arg("", "monte-carlo-interval", 
             "simulation time between attempts to do Monte Carlo moves (0. means no MC moves, default 0.)", 
             false, 0., "float", cmd);
+    ValueArg<int> respa_interval_arg("", "respa-interval", 
+            "number of time steps between applications of the slow force group (potential nodes with "
+            "force_group attribute 1) in multiple time step integration.  If given, the energy change over "
+            "one integration cycle is logged at each frame as cycle_energy_change to check the choice "
+            "(default 1, all forces at every time step)",
+            false, 1, "int", cmd);
     ValueArg<double> thermostat_interval_arg("", "thermostat-interval", 
             "simulation time between applications of the thermostat", 
             false, -1., "float", cmd);
@@ -360,6 +546,10 @@ try {
     SwitchArg disable_z_recenter_arg("", "disable-z-recentering", 
             "Disable z-recentering of protein in the universe", 
             cmd, false);
+    SwitchArg huge_pages_arg("", "huge-pages",
+            "Request transparent huge pages for the node buffers of each system.  On NUMA machines, also set "
+            "OMP_PROC_BIND so that each system stays near its buffers.",
+            cmd, false);
     SwitchArg raise_signal_on_exit_if_received_arg("", "re-raise-signal", 
             "(Developer use only) Used for obscure details of signal handling.  No effect on simulation.", 
             cmd, false);
@@ -372,6 +562,28 @@ try {
             "of the potential for the initial structure.  This may give strange answers for native structures "
             "(no steric clashes may given an agreement of NaN) or random structures (where bonds and angles are "
             "exactly at their equilibrium values).  Interpret these results at your own risk.", cmd, false);
+    ValueArg<int> threads_per_replica_arg("", "threads-per-replica", 
+            "number of OpenMP threads used to evaluate independent potential nodes within each system.  "
+            "Replicas run in parallel over the remaining threads (default 1)",
+            false, 1, "int", cmd);
+    ValueArg<int> log_queue_length_arg("", "log-queue-length", 
+            "number of buffered output flushes of each system that may wait for the background HDF5 "
+            "writer before the simulation waits for it to catch up (default 4)",
+            false, 4, "int", cmd);
+    ValueArg<double> checkpoint_interval_arg("", "checkpoint-interval", 
+            "simulation time between checkpoints of the complete simulation state, which are written "
+            "between integration cycles of all systems (0 means no checkpoints, default 0.)",
+            false, 0., "float", cmd);
+    ValueArg<string> checkpoint_file_arg("", "checkpoint-file", 
+            "path of the checkpoint file, which is replaced atomically by each new checkpoint "
+            "(default is the first configuration file with .checkpoint appended)",
+            false, "", "path", cmd);
+    ValueArg<string> restart_from_arg("", "restart-from", 
+            "continue the simulation from a checkpoint file, reproducing the uninterrupted simulation exactly.  "
+            "The other arguments must match those of the checkpointed simulation, and --duration remains the "
+            "total simulation time.  The seed is taken from the checkpoint.  The existing /output is kept as "
+            "/output_previous_N, and may contain frames after the time of the checkpoint.",
+            false, "", "path", cmd);
     ValueArg<string> set_param_arg("", "set-param", "Developer use only", false, "", "param_arg", cmd);
     UnlabeledMultiArg<string> config_args("config_files","configuration .h5 files", true, "h5_files");
     cmd.add(config_args);
@@ -404,10 +616,34 @@ try {
         uint64_t n_round = round(duration / (3*dt));
         int thermostat_interval = max(1.,round(thermostat_interval_arg.getValue() / (3*dt)));
         int frame_interval = max(1.,round(frame_interval_arg.getValue() / (3*dt)));
+        int scalar_interval = scalar_interval_arg.getValue() > 0.
+            ? min(frame_interval, int(max(1.,round(scalar_interval_arg.getValue() / (3*dt)))))
+            : frame_interval;
+
+        int respa_interval = respa_interval_arg.getValue();
+        if(respa_interval<1) throw string("--respa-interval must be at least 1");
+        bool log_cycle_energy = respa_interval_arg.isSet();
 
         unsigned long big_prime = 4294967291ul;  // largest prime smaller than 2^32
         uint32_t base_random_seed = uint32_t(seed_arg.getValue() % big_prime);
 
+        int checkpoint_interval = checkpoint_interval_arg.getValue() > 0.
+            ? max(1.,round(checkpoint_interval_arg.getValue() / (3*dt)))
+            : 0;
+        string checkpoint_path = checkpoint_file_arg.getValue();
+        if(checkpoint_path == "") checkpoint_path = config_args.getValue()[0] + ".checkpoint";
+
+        bool restarting = restart_from_arg.getValue() != "";
+        Checkpoint restart;
+        if(restarting) {
+            restart = Checkpoint::read(restart_from_arg.getValue());
+            base_random_seed = restart.get<uint32_t>();
+            int ck_n_system = restart.get<int32_t>();
+            if(ck_n_system != int(config_args.getValue().size()))
+                throw string("checkpoint contains ") + to_string(ck_n_system) + " systems but received " +
+                    to_string(config_args.getValue().size()) + " configuration files";
+        }
+
         // initialize thermostat and thermalize momentum
         if(verbose) printf("random seed: %lu\n", (unsigned long)(base_random_seed));
 
@@ -417,6 +653,19 @@ try {
 
         int duration_print_width = ceil(log(1+duration)/log(10));
 
+        int threads_per_replica = threads_per_replica_arg.getValue();
+        if(threads_per_replica<1) throw string("--threads-per-replica must be at least 1");
+        // threads for the replica loop; each of them spawns a team of threads_per_replica
+#if defined(_OPENMP)
+        int n_replica_threads = max(1, omp_get_max_threads()/threads_per_replica);
+        if(threads_per_replica>1) omp_set_max_active_levels(2);
+#else
+        int n_replica_threads = 1;
+#endif
+
+        int log_queue_length = log_queue_length_arg.getValue();
+        if(log_queue_length < 1) throw string("--log-queue-length must be at least 1");
+
         bool do_recenter = !disable_recenter_arg.getValue();
         bool xy_recenter_only = do_recenter && disable_z_recenter_arg.getValue();
 
@@ -454,26 +703,40 @@ try {
         // system 0 is the minimum temperature
         int n_system = systems.size();
 
-        // We are not allowed to exit an OpenMP critical section early.  For this reason, we must trap
-        // all exceptions.  To avoid crashing callers, we simply record the presence of an exception
-        // then exit immediately after the block.
+        // Systems are initialized in parallel.  HDF5 calls are serialized by the H5Lock, which
+        // is held only while reading or writing, so that node construction, spline fitting and
+        // the remaining CPU-heavy work run concurrently.  We are not allowed to exit an OpenMP
+        // parallel region early.  For this reason, we must trap all exceptions.  To avoid
+        // crashing callers, we simply record the presence of an exception then exit immediately
+        // after the block.
         bool error_exit_omp = false;
-        #pragma omp critical
+        #pragma omp parallel for schedule(dynamic,1) num_threads(min(n_system,n_replica_threads))
         for(int ns=0; ns<n_system; ++ns) try {
             System* sys = &systems[ns];  // a pointer here makes later lambda's more natural
             sys->random_seed = base_random_seed + ns;
 
-            try {
-                sys->config = h5_obj(H5Fclose,
-                        H5Fopen(config_paths[ns].c_str(), H5F_ACC_RDWR, H5P_DEFAULT));
-            } catch(string &s) {
-                throw string("Unable to open configuration file at ") + config_paths[ns];
-            }
+            {
+                H5Lock h5_lock;  // for the direct HDF5 calls; the h5_support functions lock themselves
+                try {
+                    sys->config = h5_obj(H5Fclose,
+                            H5Fopen(config_paths[ns].c_str(), H5F_ACC_RDWR, H5P_DEFAULT));
+                } catch(string &s) {
+                    throw string("Unable to open configuration file at ") + config_paths[ns];
+                }
 
-            if(h5_exists(sys->config.get(), "output")) {
-                // Note that it is not possible in HDF5 1.8.x to reclaim space by deleting
-                // datasets or groups.  Subsequent h5repack will reclaim space, however.
-                h5_noerr(H5Ldelete(sys->config.get(), "/output", H5P_DEFAULT));
+                if(h5_exists(sys->config.get(), "output")) {
+                    if(restarting) {
+                        // keep the output before the restart, following the convention of run_upside.continue_sim
+                        int i = 0;
+                        while(h5_exists(sys->config.get(), ("output_previous_"+to_string(i)).c_str())) ++i;
+                        h5_noerr(H5Lmove(sys->config.get(), "/output", sys->config.get(),
+                                    ("/output_previous_"+to_string(i)).c_str(), H5P_DEFAULT, H5P_DEFAULT));
+                    } else {
+                        // Note that it is not possible in HDF5 1.8.x to reclaim space by deleting
+                        // datasets or groups.  Subsequent h5repack will reclaim space, however.
+                        h5_noerr(H5Ldelete(sys->config.get(), "/output", H5P_DEFAULT));
+                    }
+                }
             }
 
             LogLevel log_level;
@@ -483,7 +746,8 @@ try {
             else if(log_level_arg.getValue() == "extensive") log_level = LOG_EXTENSIVE;
             else throw string("Illegal value for --log-level");
 
-            sys->logger = make_shared<H5Logger>(sys->config, "output", log_level);
+            sys->logger = make_shared<H5Logger>(sys->config, "output", log_level, log_queue_length);
+            sys->logger->default_stride = frame_interval;
             default_logger = sys->logger;  // FIXME kind of a hack for the ugly global variable
 
             write_string_attribute(sys->config.get(), "output", "invocation", invocation);
@@ -498,52 +762,75 @@ try {
 
             auto potential_group = open_group(sys->config.get(), "/input/potential");
             sys->engine = initialize_engine_from_hdf5(sys->n_atom, potential_group.get());
+            sys->engine.n_threads = threads_per_replica;
 
             // Override parameters as instructed by users
             for(const auto& p: set_param_map)
                 sys->engine.get(p.first).computation->set_param(p.second);
 
-            traverse_dset<3,float>(sys->config.get(), "/input/pos", [&](size_t na, size_t d, size_t ns, float x) { 
-                    sys->engine.pos->output(d,na) = x;});
-
-            if(verbose) printf("%s\nn_atom %i\n\n", config_paths[ns].c_str(), sys->n_atom);
-
-            if(potential_deriv_agreement_arg.getValue()){
-                sys->engine.compute(PotentialAndDerivMode);
-                if(verbose) printf("Initial potential:\n");
-                auto relative_error = potential_deriv_agreement(sys->engine);
-                if(verbose) printf("overall potential relative error: ");
-                for(auto r: relative_error) printf(" %.5f", r);
-                if(verbose) printf("\n");
+            {
+                auto input_pos = read_dset<float>(sys->config.get(), "/input/pos", {size_t(sys->n_atom), 3u, 1u});
+                for(int na: range(sys->n_atom))
+                    for(int d: range(3))
+                        sys->engine.pos->output(d,na) = input_pos[na*3+d];
             }
 
-            sys->thermostat = OrnsteinUhlenbeckThermostat(
-                    sys->random_seed,
-                    thermostat_timescale_arg.getValue(),
-                    1.,
-                    1e8);
-            sys->set_temperature(sys->initial_temperature);
-
-            sys->thermostat.apply(sys->mom, sys->n_atom); // initial thermalization
-            sys->thermostat.set_delta_t(thermostat_interval*3*dt);  // set true thermostat interval
+            if(verbose) printf("%s\nn_atom %i\n\n", config_paths[ns].c_str(), sys->n_atom);
 
             // we must capture the sys pointer by value here so that it is available later
-            sys->logger->add_logger<float>("pos", {1, sys->n_atom, 3}, [sys](float* pos_buffer) {
+            double pos_precision = pos_precision_arg.getValue();
+            if(pos_precision > 0.) {
+                // Fixed point positions, stored as differences from the previous frame except at
+                // the first frame of each HDF5 chunk, so that every chunk may be decoded alone.
+                // Values are clamped to +/-2^29 so that differences fit in an int32_t.
+                auto prev_frame = make_shared<vector<int32_t>>(3*sys->n_atom, 0);
+                auto n_frame    = make_shared<uint64_t>(0u);
+                sys->logger->add_logger<int>("pos_quantized", {1, sys->n_atom, 3},
+                        [sys,prev_frame,n_frame,pos_precision](int* pos_buffer) {
+                    bool keyframe = !((*n_frame)++ % log_chunk_rows);
+                    const double limit = double(1<<29);
                     VecArray pos_array = sys->engine.pos->output;
-                    for(int na=0; na<sys->n_atom; ++na) 
-                    for(int d=0; d<3; ++d) 
-                    pos_buffer[na*3 + d] = pos_array(d,na);
-                    });
+                    for(int na=0; na<sys->n_atom; ++na) {
+                        for(int d=0; d<3; ++d) {
+                            auto q = int32_t(max(-limit, min(limit, nearbyint(pos_array(d,na)/pos_precision))));
+                            auto& prev = (*prev_frame)[na*3 + d];
+                            int32_t delta = keyframe ? q : q-prev;
+                            // zigzag, so small values have zero high bytes (in uint32_t, since shifting
+                            // a negative int32_t left is undefined)
+                            pos_buffer[na*3 + d] = (uint32_t(delta)<<1) ^ uint32_t(delta>>31);
+                            prev = q;
+                        }
+                    }});
+                write_attribute<double>(sys->logger->logging_group.get(), "pos_quantized", "precision", pos_precision);
+                write_attribute<int>   (sys->logger->logging_group.get(), "pos_quantized", "keyframe_interval",
+                        log_chunk_rows);
+            } else {
+                sys->logger->add_logger<float>("pos", {1, sys->n_atom, 3}, [sys](float* pos_buffer) {
+                        VecArray pos_array = sys->engine.pos->output;
+                        for(int na=0; na<sys->n_atom; ++na) 
+                        for(int d=0; d<3; ++d) 
+                        pos_buffer[na*3 + d] = pos_array(d,na);
+                        });
+            }
             sys->logger->add_logger<double>("kinetic", {1}, [sys](double* kin_buffer) {
                     double sum_kin = 0.f;
                     for(int na=0; na<sys->n_atom; ++na) sum_kin += mag2(load_vec<3>(sys->mom,na));
                     kin_buffer[0] = (0.5/sys->n_atom)*sum_kin;  // kinetic_energy = (1/2) * <mom^2>
-                    });
+                    }, scalar_interval);
+            // the engine is evaluated once before the loggers are sampled
             sys->logger->add_logger<double>("potential", {1}, [sys](double* pot_buffer) {
-                    sys->engine.compute(PotentialAndDerivMode);
-                    pot_buffer[0] = sys->engine.potential;});
+                    pot_buffer[0] = sys->engine.potential;}, scalar_interval);
             sys->logger->add_logger<double>("time", {}, [sys,dt](double* time_buffer) {
                     *time_buffer=3*dt*sys->round_num;});
+            if(scalar_interval != frame_interval) {
+                sys->logger->add_logger<double>("scalar_time", {}, [sys,dt](double* time_buffer) {
+                        *time_buffer=3*dt*sys->round_num;}, scalar_interval);
+            }
+            if(log_cycle_energy) {
+                // measured over the integration cycle that ends at the frame (0 at the first frame)
+                sys->logger->add_logger<double>("cycle_energy_change", {1}, [sys](double* buffer) {
+                        buffer[0] = sys->cycle_energy_change;});
+            }
 
             if(mc_interval) {
                 // sys->mc_samplers = MultipleMonteCarloSampler{open_group(sys->config.get(), "/input/sampler_group").get(), *sys->logger};
@@ -567,18 +854,67 @@ try {
                                 "This is not what you want.  Consider --disable-recentering.");
                 }
             }
+            default_logger = shared_ptr<H5Logger>();  // FIXME kind of a hack for the ugly global variable
 
+            if(potential_deriv_agreement_arg.getValue()){
+                sys->engine.compute(PotentialAndDerivMode);
+                vector<pair<string,float>> initial_potential;
+                for(auto &n: sys->engine.nodes)
+                    if(n.computation->potential_term)
+                        initial_potential.emplace_back(n.name,
+                                dynamic_cast<PotentialNode&>(*n.computation.get()).potential);
+                auto relative_error = potential_deriv_agreement(sys->engine);
+
+                #pragma omp critical (init_output)
+                {
+                    if(verbose) printf("%s initial potential:\n", config_paths[ns].c_str());
+                    for(auto &p: initial_potential) printf("%s: % 4.3f\n", p.first.c_str(), p.second);
+                    printf("\n\n");
+                    if(verbose) printf("overall potential relative error: ");
+                    for(auto r: relative_error) printf(" %.5f", r);
+                    if(verbose) printf("\n");
+                }
+            }
+
+            sys->thermostat = OrnsteinUhlenbeckThermostat(
+                    sys->random_seed,
+                    thermostat_timescale_arg.getValue(),
+                    1.,
+                    1e8);
+            sys->set_temperature(sys->initial_temperature);
 
+            sys->thermostat.apply(sys->mom, sys->n_atom); // initial thermalization
+            sys->thermostat.set_delta_t(thermostat_interval*3*dt);  // set true thermostat interval
         } catch(const string &e) {
-            fprintf(stderr, "\n\nERROR: %s\n", e.c_str());
-            error_exit_omp = true;
+            default_logger = shared_ptr<H5Logger>();
+            #pragma omp critical (init_output)
+            {
+                fprintf(stderr, "\n\nERROR: %s\n", e.c_str());
+                error_exit_omp = true;
+            }
         } catch(...) {
-            fprintf(stderr, "\n\nERROR: unknown error\n");
-            error_exit_omp = true;
+            default_logger = shared_ptr<H5Logger>();
+            #pragma omp critical (init_output)
+            {
+                fprintf(stderr, "\n\nERROR: unknown error\n");
+                error_exit_omp = true;
+            }
         }
-        // We have just left the critical section
+        // We have just left the parallel region
         if(error_exit_omp) return 2;
-        default_logger = shared_ptr<H5Logger>();  // FIXME kind of a hack for the ugly global variable
+
+        // The node buffers of each system are placed by the thread that integrates it, which
+        // is the same thread for each system in every static,1 loop below.
+        #pragma omp parallel for schedule(static,1) num_threads(n_replica_threads)
+        for(int ns=0; ns<n_system; ++ns)
+            systems[ns].engine.build_arena(huge_pages_arg.getValue());
+
+        if(verbose && n_system>1) {
+            // byte-identical parameter tables are stored once for all systems
+            auto usage = param_store_usage();
+            printf("%i systems share %lu parameter tables (%.1f MB of input data)\n",
+                    n_system, (unsigned long)usage.first, usage.second*1e-6);
+        }
 
         unique_ptr<ReplicaExchange> replex;
         if(replica_interval) {
@@ -595,20 +931,57 @@ try {
                     throw string("Replica exchange requires all systems have the same number of atoms");
         }
 
+        if(restarting) {
+            for(auto& sys: systems) sys.load_state(restart);
+            if(restart.get<int32_t>() != int(bool(replex)))
+                throw string("checkpoint and command line disagree about replica exchange");
+            if(replex) replex->load_state(restart);
+            restart.check_finished();
+            if(verbose) printf("restarting from %s at time %.1f\n",
+                    restart_from_arg.getValue().c_str(), 3*dt*systems[0].round_num);
+        }
+
+        // Systems only synchronize between integration cycles, so the checkpoint is written then.
+        // Afterward, caches are reset and the potential evaluated exactly as after a restart, so
+        // that a restarted simulation continues exactly as this one does.
+        auto write_checkpoint = [&]() {
+            Timer timer("checkpoint");
+            Checkpoint ck;
+            ck.put<uint32_t>(base_random_seed);
+            ck.put<int32_t>(n_system);
+            for(auto& sys: systems) sys.save_state(ck);
+            ck.put<int32_t>(bool(replex));
+            if(replex) replex->save_state(ck);
+
+            // Frames up to the checkpoint must be in the output files (written and flushed by
+            // the writer thread) before the checkpoint is, so that a crash in between never leaves
+            // a checkpoint ahead of its output
+            for(auto& sys: systems) sys.logger->flush();
+            h5_writer().drain();
+            ck.write(checkpoint_path);
+
+            #pragma omp parallel for schedule(static,1) num_threads(n_replica_threads)
+            for(int ns=0; ns<n_system; ++ns) {
+                systems[ns].engine.reset_caches();
+                systems[ns].engine.compute(PotentialAndDerivMode);
+            }
+        };
+
         if(verbose) printf("\n");
         for(int ns: range(systems.size())) {
             if(verbose) printf("%i %.2f\n", ns, systems[ns].temperature);
             float* temperature_pointer = &(systems[ns].temperature);
             systems[ns].logger->add_logger<double>("temperature", {1}, [temperature_pointer](double* temperature_buffer) {
-                    temperature_buffer[0] = *temperature_pointer;});
+                    temperature_buffer[0] = *temperature_pointer;}, scalar_interval);
         }
         if(verbose) printf("\n");
 
+        #pragma omp parallel for schedule(static,1) num_threads(n_replica_threads)
+        for(int ns=0; ns<n_system; ++ns)
+            systems[ns].engine.compute(PotentialAndDerivMode);
+
         if(verbose) printf("Initial potential energy:");
-        for(System& sys: systems) {
-            sys.engine.compute(PotentialAndDerivMode);
-            if(verbose) printf(" %.2f", sys.engine.potential);
-        }
+        for(System& sys: systems) if(verbose) printf(" %.2f", sys.engine.potential);
         if(verbose) printf("\n");
 
         // Install signal handlers to dump state only when the simulation has really started.  This is intended to prevent
@@ -620,11 +993,13 @@ try {
         // we need to run everyone until the next synchronization event
         // a little care is needed if we are multiplexing the events
         auto tstart = chrono::high_resolution_clock::now();
+        uint64_t start_round = systems[0].round_num;
         while(systems[0].round_num < n_round && received_signal==NO_SIGNAL) {
             int last_start = systems[0].round_num;
-            #pragma omp parallel for schedule(static,1)
+            #pragma omp parallel for schedule(static,1) num_threads(n_replica_threads)
             for(int ns=0; ns<int(systems.size()); ++ns) {
                 System& sys = systems[ns];
+                ReplicaTimerScope timer_scope(ns);
                 for(bool do_break=false; (!do_break) && (sys.round_num<n_round); ++sys.round_num) {
                     int nr = sys.round_num;
 
@@ -651,11 +1026,15 @@ try {
                     if(nr && mc_interval && !(nr%mc_interval)) 
                         sys.mc_samplers.execute(sys.random_seed, nr, sys.temperature, sys.engine);
 
-                    if(!frame_interval || !(nr%frame_interval)) {
-                        if(do_recenter) recenter(sys.engine.pos->output, xy_recenter_only, sys.n_atom);
+                    bool is_frame = !(nr%frame_interval);
+                    if(is_frame && do_recenter) recenter(sys.engine.pos->output, xy_recenter_only, sys.n_atom);
+                    if(is_frame || sys.logger->sample_due(nr)) {
+                        // a single evaluation is shared by all loggers and the progress report
                         sys.engine.compute(PotentialAndDerivMode);
-                        sys.logger->collect_samples();
+                        sys.logger->collect_samples(nr);
+                    }
 
+                    if(is_frame) {
                         double Rg = 0.f;
                         float3 com = make_vec3(0.f, 0.f, 0.f);
                         for(int na=0; na<sys.n_atom; ++na)
@@ -681,9 +1060,19 @@ try {
                             sys.set_temperature(anneal_temp(sys.initial_temperature, 3*dt*(sys.round_num+1)));
                         sys.thermostat.apply(sys.mom, sys.n_atom);
                     }
-                    sys.engine.integration_cycle(sys.mom, dt, 0.f, DerivEngine::Verlet);
 
-                    do_break = nr>last_start && replica_interval && !((nr+1)%replica_interval);
+                    // Only the integrator changes the energy between the thermostat and the end of
+                    // the cycle, so this measures the integration error for choosing respa_interval.
+                    // The cycle just before each frame is measured, so that the frame records it.
+                    bool measure_energy = log_cycle_energy && !((nr+1)%frame_interval);
+                    double energy_before = measure_energy ? sys.total_energy(dt) : 0.;
+                    if(respa_interval>1) sys.engine.respa_integration_cycle(sys.mom, dt, 0.f, respa_interval);
+                    else                 sys.engine.integration_cycle(sys.mom, dt, 0.f, DerivEngine::Verlet);
+                    if(measure_energy) sys.cycle_energy_change = sys.total_energy(dt) - energy_before;
+
+                    do_break = nr>last_start && (
+                            (replica_interval    && !((nr+1)%replica_interval)) ||
+                            (checkpoint_interval && !((nr+1)%checkpoint_interval)));
                 }
             }
             // Here we are running in serial again
@@ -691,18 +1080,25 @@ try {
             if(passed_time_lim) break;
 
             if(replica_interval && !(systems[0].round_num % replica_interval))
-                replex->attempt_swaps(base_random_seed, systems[0].round_num, systems);
+                replex->attempt_swaps(base_random_seed, systems[0].round_num, systems, n_replica_threads);
+            if(checkpoint_interval && !(systems[0].round_num % checkpoint_interval) && systems[0].round_num < n_round)
+                write_checkpoint();
         }
         if(received_signal!=NO_SIGNAL) {fprintf(stderr, "Received early termination signal\n");}
         if(passed_time_lim) {fprintf(stderr, "Passed time limit\n");}
+        // Complete all writes, even after a stop signal, before the output is read back below
+        for(auto& sys: systems) sys.logger->flush_and_wait();
         for(auto& sys: systems) sys.logger = shared_ptr<H5Logger>(); // release shared_ptr, which also flushes data during destructor
 
         auto elapsed = chrono::duration<double>(std::chrono::high_resolution_clock::now() - tstart).count();
         if(verbose)
             printf("\n\nfinished in %.1f seconds (%.2f us/systems/step, %.1e simulation_time_unit/hour)\n",
                 elapsed,
-                elapsed*1e6/systems.size()/systems[0].round_num/3, 
-                systems[0].round_num*3*dt/elapsed * 3600.);
+                elapsed*1e6/systems.size()/max(uint64_t(1),systems[0].round_num-start_round)/3, 
+                (systems[0].round_num-start_round)*3*dt/elapsed * 3600.);
+        if(verbose && replex)
+            printf("replica exchange took %.1f seconds (%.1f%% of run time)\n",
+                replex->exchange_time, 100.*replex->exchange_time/elapsed);
 
         if(verbose) printf("\navg_kinetic_energy/1.5kT");
         for(auto& sys: systems) {
@@ -747,7 +1143,7 @@ try {
 #ifdef COLLECT_PROFILE
         if(verbose) {
             printf("\n");
-            global_time_keeper.print_report(3*systems[0].round_num+1);
+            global_time_keeper.print_report(3*(systems[0].round_num-start_round)+1);
             printf("\n");
         }
 #endif
@@ -36,8 +36,9 @@ struct MembranePotential : public PotentialNode
     vector<ResidueParams>     res_params;
     vector<PotentialCBParams> pot_params;
 
-    LayeredClampedSpline1D<1> membrane_energy_cb_spline;
-    LayeredClampedSpline1D<1> membrane_energy_uhb_spline;
+    // splines are shared through param_store.h
+    shared_ptr<const LayeredClampedSpline1D<1>> membrane_energy_cb_spline;
+    shared_ptr<const LayeredClampedSpline1D<1>> membrane_energy_uhb_spline;
 
     // shift and scale to convert z coordinates to spline coordinates
     float cb_z_shift, cb_z_scale;
@@ -60,20 +61,15 @@ struct MembranePotential : public PotentialNode
         res_params(n_elem),
         pot_params(n_restype),
 
-        membrane_energy_cb_spline(
-                get_dset_size(2, grp, "cb_energy")[0],
-                get_dset_size(2, grp, "cb_energy")[1]),
-
-        membrane_energy_uhb_spline(
-                get_dset_size(2, grp, "uhb_energy")[0],
-                get_dset_size(2, grp, "uhb_energy")[1]),
-
         cb_z_shift(-read_attribute<float>(grp, "cb_energy", "z_min")),
-        cb_z_scale((membrane_energy_cb_spline.nx-1)/(read_attribute<float>(grp, "cb_energy", "z_max")+cb_z_shift)),
+        cb_z_scale((get_dset_size(2, grp, "cb_energy")[1]-1)/(read_attribute<float>(grp, "cb_energy", "z_max")+cb_z_shift)),
 
         uhb_z_shift(-read_attribute<float>(grp, "uhb_energy", "z_min")),
-        uhb_z_scale((membrane_energy_uhb_spline.nx-1)/(read_attribute<float>(grp, "uhb_energy", "z_max")+uhb_z_shift))
+        uhb_z_scale((get_dset_size(2, grp, "uhb_energy")[1]-1)/(read_attribute<float>(grp, "uhb_energy", "z_max")+uhb_z_shift))
     {
+        int cb_nx  = get_dset_size(2, grp,  "cb_energy")[1];
+        int uhb_nx = get_dset_size(2, grp, "uhb_energy")[1];
+
         check_elem_width_lower_bound(res_pos, 3);
         check_elem_width_lower_bound(environment_coverage, 1);
 
@@ -82,8 +78,6 @@ struct MembranePotential : public PotentialNode
         check_size(grp,  "residue_type",    n_elem);
         check_size(grp,  "cov_midpoint", n_restype);
         check_size(grp, "cov_sharpness", n_restype);
-        check_size(grp,     "cb_energy", n_restype, membrane_energy_cb_spline.nx);
-        check_size(grp,    "uhb_energy",         2, membrane_energy_uhb_spline.nx); // type 0 for unpaired donor, type 1 for unpaired acceptor
 
         traverse_dset<1,  int>(grp,      "cb_index", [&](size_t nr,   int  x) {res_params[nr].cb_index  = x;});
         traverse_dset<1,  int>(grp,     "env_index", [&](size_t nr,   int  x) {res_params[nr].env_index = x;});
@@ -91,19 +85,36 @@ struct MembranePotential : public PotentialNode
         traverse_dset<1,float>(grp,  "cov_midpoint", [&](size_t rt, float bc) {pot_params[rt].cov_midpoint  = bc;});
         traverse_dset<1,float>(grp, "cov_sharpness", [&](size_t rt, float bw) {pot_params[rt].cov_sharpness = bw;});
 
-        vector<double> cb_energy_data;
-        traverse_dset<2,double>(grp, "cb_energy", [&](size_t rt, size_t z_index, double value) {
-                cb_energy_data.push_back(value);});
-        membrane_energy_cb_spline.fit_spline(cb_energy_data.data());
+        membrane_energy_cb_spline = shared_clamped_spline_1d<1>(n_restype, cb_nx,
+                read_dset<double>(grp, "cb_energy", {size_t(n_restype), size_t(cb_nx)}));
+        membrane_energy_uhb_spline = shared_clamped_spline_1d<1>(2, uhb_nx,
+                read_dset<double>(grp, "uhb_energy", {size_t(2), size_t(uhb_nx)}));  // unpaired donor, unpaired acceptor
+    }
 
-        vector<double> uhb_energy_data;
-        traverse_dset<2,double>(grp, "uhb_energy", [&](size_t rt, size_t z_index, double value) {
-                uhb_energy_data.push_back(value);});
-        membrane_energy_uhb_spline.fit_spline(uhb_energy_data.data());
+    MembranePotential(const MembranePotential& other, CoordNode& res_pos_,
+                                                      CoordNode& environment_coverage_,
+                                                      CoordNode& protein_hbond_):
+        PotentialNode(),
+        n_elem(other.n_elem), n_restype(other.n_restype),
+        n_donor(other.n_donor), n_acceptor(other.n_acceptor),
+        res_pos(res_pos_),
+        environment_coverage(environment_coverage_),
+        protein_hbond(protein_hbond_),
+        res_params(other.res_params),
+        pot_params(other.pot_params),
+        membrane_energy_cb_spline (other.membrane_energy_cb_spline),
+        membrane_energy_uhb_spline(other.membrane_energy_uhb_spline),
+        cb_z_shift (other.cb_z_shift),  cb_z_scale (other.cb_z_scale),
+        uhb_z_shift(other.uhb_z_shift), uhb_z_scale(other.uhb_z_scale)
+    {}
+
+    virtual DerivComputation* clone(const ArgList& args) const override {
+        check_arguments_length(args,3);
+        return new MembranePotential(*this, *args[0], *args[1], *args[2]);
     }
 
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("membrane_potential"));
+        Timer timer("membrane_potential");
 
         VecArray cb_pos       = res_pos.output;
         VecArray cb_pos_sens  = res_pos.sens;
@@ -119,7 +130,7 @@ struct MembranePotential : public PotentialNode
             float cb_z = cb_pos(2, p.cb_index);
 
             float result[2];    // deriv then value
-            membrane_energy_cb_spline.evaluate_value_and_deriv(result, p.restype,
+            membrane_energy_cb_spline->evaluate_value_and_deriv(result, p.restype,
                     (cb_z + cb_z_shift) * cb_z_scale);
             float spline_value = result[1];
             float spline_deriv = result[0]*cb_z_scale; // scale to get derivative in *unnormalized* coordinates
@@ -138,7 +149,7 @@ struct MembranePotential : public PotentialNode
             float hb_prob = hb_pos(6, nv);  // probability that his virtual participates in any HBond
 
             float result[2];
-            membrane_energy_uhb_spline.evaluate_value_and_deriv(result, int(nv>=n_donor),
+            membrane_energy_uhb_spline->evaluate_value_and_deriv(result, int(nv>=n_donor),
                     (hb_z + uhb_z_shift) * uhb_z_scale);
             float spline_value = result[1];
             float spline_deriv = result[0]*uhb_z_scale;
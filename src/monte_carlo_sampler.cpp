@@ -79,7 +79,7 @@ PivotSampler::PivotSampler(const std::string& name, hid_t grp, H5Logger& logger)
 
 void PivotSampler::propose_random_move(float* delta_lprob, 
     	RandomGenerator& random, VecArray pos) const {
-    Timer timer(std::string("random_pivot"));
+    Timer timer("random_pivot");
     float4 random_values = random.uniform_open_closed();
 
     // pick a random pivot location
@@ -202,7 +202,7 @@ JumpSampler::JumpSampler(const std::string& name, hid_t grp, H5Logger& logger):
 
 void JumpSampler::propose_random_move(float* delta_lprob, 
         RandomGenerator& random, VecArray pos) const {
-    Timer timer(std::string("random_jump"));
+    Timer timer("random_jump");
 
     // pick jump move type: translation or rotation
     float4 rand_type_val = random.uniform_open_closed();
@@ -256,7 +256,8 @@ void MonteCarloSampler::monte_carlo_step(
         uint32_t seed, 
         uint64_t round,
         const float temperature,
-        DerivEngine& engine) 
+        DerivEngine& engine,
+        bool& engine_current) 
 {
     RandomGenerator random(seed, stream_id, 0, round);
 
@@ -264,12 +265,19 @@ void MonteCarloSampler::monte_carlo_step(
     VecArrayStorage pos_copy(pos);
     float delta_lprob;
 
-    engine.compute(PotentialAndDerivMode);
+    if(!engine_current) engine.compute(PotentialOnlyMode);
     float old_potential = engine.potential;
 
     propose_random_move(&delta_lprob, random, pos);
 
-    engine.compute(PotentialAndDerivMode);
+    // a move changes only part of the system, so evaluate only what depends on it if possible
+    std::vector<int> moved;
+    for(int na=0; na<engine.pos->n_atom; ++na)
+        for(int d=0; d<3; ++d)
+            if(pos(d,na) != pos_copy(d,na)) {moved.push_back(na); break;}
+
+    bool incremental = engine.compute_incremental(pos_copy, moved);
+    if(!incremental) engine.compute(PotentialOnlyMode);
     float new_potential = engine.potential;
 
     float lboltz_diff = delta_lprob - (1.f/temperature) * (new_potential-old_potential);
@@ -277,16 +285,26 @@ void MonteCarloSampler::monte_carlo_step(
 
     if(lboltz_diff >= 0.f || expf(lboltz_diff) >= random.uniform_open_closed().x()) {
         move_stats.n_success++;
+        engine_current = true;
     } else {
         // If we reject the move, we must reverse it
-        copy(pos_copy, pos);
+        if(incremental) {
+            VecArrayStorage rejected_pos(pos);
+            copy(pos_copy, pos);
+            engine.compute_incremental(rejected_pos, moved);
+            engine.potential = old_potential;
+        } else {
+            copy(pos_copy, pos);
+        }
+        engine_current = incremental;
     }
 }
 
 // ===[Multiple Monte Carlo Sampler Definitions]===
 
 void MultipleMonteCarloSampler::execute(uint32_t seed, uint64_t round, const float temperature, DerivEngine& engine) {
-    for (auto& s: samplers) s->monte_carlo_step(seed, round, temperature, engine);
+    bool engine_current = false;
+    for (auto& s: samplers) s->monte_carlo_step(seed, round, temperature, engine, engine_current);
 }
 
 MultipleMonteCarloSampler::MultipleMonteCarloSampler(hid_t sampler_group, H5Logger& logger) {
@@ -38,8 +38,12 @@ struct MonteCarloSampler {
 
     virtual void propose_random_move(float* delta_lprob, RandomGenerator& random, VecArray pos) const = 0;
 
+    //! \brief Attempt one move
+    //!
+    //! engine_current is true if the node outputs and potential of engine are those of the
+    //! current positions, and it is updated for the positions after the step.
     void monte_carlo_step(uint32_t seed, uint64_t round, const float temperature,
-            DerivEngine& engine);
+            DerivEngine& engine, bool& engine_current);
 };
 
 struct MultipleMonteCarloSampler {
@@ -128,7 +128,7 @@ struct Conv1D : public CoordNode
     }
 
     virtual void compute_value(ComputeMode mode) override {
-        Timer timer(string("conv1d")); 
+        Timer timer("conv1d"); 
         VecArray inputc = input.output;
         
         int n_elem_output = n_elem;
@@ -215,7 +215,7 @@ struct ScaledSum: public PotentialNode
     }
 
     virtual void compute_value(ComputeMode mode) override {
-        Timer timer(string("scaled_sum")); 
+        Timer timer("scaled_sum"); 
         VecArray value = input.output;
         VecArray sens  = input.sens;
         int n_elem = input.n_elem;
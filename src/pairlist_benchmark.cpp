@@ -0,0 +1,94 @@
+// Microbenchmark for the cache rebuild of PairCache
+//
+// Compares the all-pairs rebuild against the cell list rebuild for random
+// compact chains at protein-like density, and checks that both produce identical
+// edge lists.  Build with "make pairlist_benchmark".
+
+#include "interaction_graph.h"
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <limits>
+
+using namespace std;
+
+static Int4 acceptable_pair(const Int4& id1, const Int4& id2) {
+    return id1!=id2;
+}
+
+struct BenchmarkPairlist : public PairlistComputation<true> {
+    BenchmarkPairlist(int n_elem, int max_n_edge):
+        PairlistComputation<true>(n_elem, n_elem, max_n_edge) {}
+
+    // force a rebuild using the requested method and return the time in seconds
+    double rebuild(bool cell_list, float cutoff, const float* pos, int* id) {
+        cache->change_cell_list_min_pairs(cell_list ? 0l : numeric_limits<long>::max());
+        cache->invalidate();
+        auto tstart = chrono::high_resolution_clock::now();
+        ensure_cache_valid<acceptable_pair>(cutoff, pos, 4, id, pos, 4, id);
+        return chrono::duration<double>(chrono::high_resolution_clock::now() - tstart).count();
+    }
+
+    vector<int32_t> cache_edges() const {
+        vector<int32_t> edges;
+        for(int ne=0; ne<cache_n_edge; ++ne) {
+            edges.push_back(cache_edge_indices1[ne]);
+            edges.push_back(cache_edge_indices2[ne]);
+            edges.push_back(cache_edge_id1[ne]);
+            edges.push_back(cache_edge_id2[ne]);
+        }
+        return edges;
+    }
+};
+
+int main(int argc, char** argv) {
+    const float cutoff = 10.f;                    // typical sidechain interaction cutoff (angstroms)
+    const float volume_per_elem = 130.f;          // roughly one residue per 130 cubic angstroms
+    const int   n_repeat = 5;
+    int sizes[] = {100, 200, 500, 1000, 2000, 5000, 10000};
+
+    printf("%8s %10s %14s %14s %8s\n", "n_elem", "n_edge", "all_pairs(us)", "cell_list(us)", "speedup");
+    mt19937 gen(42);
+    for(int n_elem: sizes) {
+        float radius = cbrtf(0.75f/M_PI_F * n_elem*volume_per_elem);
+
+        normal_distribution<float> step(0.f, 1.f);
+
+        auto pos = new_aligned<float>  (round_up(n_elem,16)*4, 4);
+        auto id  = new_aligned<int32_t>(round_up(n_elem,16),   4);
+        fill_n(pos.get(), round_up(n_elem,16)*4, 1e20f);
+
+        // random walk with 3.8 angstrom steps confined to a sphere, mimicking a compact chain
+        float3 x = make_vec3(0.f, 0.f, 0.f);
+        for(int i=0; i<n_elem; ++i) {
+            float3 trial;
+            do {
+                trial = make_vec3(step(gen), step(gen), step(gen));
+                trial = x + trial*(3.8f/mag(trial));
+            } while(mag(trial)>radius);
+            x = trial;
+            for(int d=0; d<3; ++d) pos[i*4+d] = x[d];
+            id[i] = i;
+        }
+        for(int i=n_elem; i<round_up(n_elem,16); ++i) id[i] = -1;
+
+        BenchmarkPairlist pairlist(n_elem, round_up(n_elem*128, 16));
+
+        double t_all = 1e10, t_cell = 1e10;
+        vector<int32_t> edges_all, edges_cell;
+        for(int nr=0; nr<n_repeat; ++nr) {
+            t_all  = min(t_all,  pairlist.rebuild(false, cutoff, pos.get(), id.get()));
+            edges_all = pairlist.cache_edges();
+            t_cell = min(t_cell, pairlist.rebuild(true,  cutoff, pos.get(), id.get()));
+            edges_cell = pairlist.cache_edges();
+        }
+        if(edges_all != edges_cell) {
+            fprintf(stderr, "ERROR: cell list edges differ from all pairs edges for n_elem %i\n", n_elem);
+            return 1;
+        }
+
+        printf("%8i %10i %14.1f %14.1f %8.2f\n", n_elem, int(edges_all.size()/4),
+                t_all*1e6, t_cell*1e6, t_all/t_cell);
+    }
+    return 0;
+}
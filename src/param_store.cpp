@@ -0,0 +1,107 @@
+#include "param_store.h"
+#include <mutex>
+#include <unordered_map>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+namespace {
+    struct Entry {
+        string kind;
+        size_t n_key_bytes;
+        const void* key;  // owned by the value
+        weak_ptr<const void> owner;
+    };
+
+    struct ParamStore {
+        mutex mut;
+        unordered_map<uint64_t, vector<Entry>> buckets;
+    };
+
+    ParamStore& param_store() {
+        static ParamStore store;
+        return store;
+    }
+
+    uint64_t hash_bytes(const char* kind, const void* key, size_t n_key_bytes) {
+        // 64-bit FNV-1a
+        uint64_t h = 14695981039346656037ull;
+        auto mix = [&](const unsigned char* p, size_t n) {
+            for(size_t i=0; i<n; ++i) {h ^= p[i]; h *= 1099511628211ull;}};
+        mix(reinterpret_cast<const unsigned char*>(kind), strlen(kind)+1);
+        mix(static_cast<const unsigned char*>(key), n_key_bytes);
+        return h;
+    }
+
+    // Must hold the store lock.  Expired entries are removed as they are found.
+    shared_ptr<const void> find_entry(vector<Entry>& bucket, const char* kind,
+            const void* key, size_t n_key_bytes) {
+        for(size_t i=0; i<bucket.size();) {
+            auto owner = bucket[i].owner.lock();
+            if(!owner) {
+                bucket[i] = move(bucket.back());
+                bucket.pop_back();
+                continue;
+            }
+            auto& e = bucket[i];
+            if(e.n_key_bytes==n_key_bytes && e.kind==kind && !memcmp(e.key, key, n_key_bytes))
+                return owner;
+            ++i;
+        }
+        return shared_ptr<const void>();
+    }
+}
+
+
+shared_ptr<const void> intern_param_bytes(
+        const char* kind, const void* key, size_t n_key_bytes,
+        const function<pair<shared_ptr<const void>,const void*>()>& make) {
+    auto& store = param_store();
+    auto h = hash_bytes(kind, key, n_key_bytes);
+    {
+        lock_guard<mutex> lock(store.mut);
+        auto owner = find_entry(store.buckets[h], kind, key, n_key_bytes);
+        if(owner) return owner;
+    }
+
+    // construct outside the lock, since make may be expensive (e.g. spline fitting)
+    auto made = make();
+
+    lock_guard<mutex> lock(store.mut);
+    auto& bucket = store.buckets[h];
+    auto owner = find_entry(bucket, kind, key, n_key_bytes);
+    if(owner) return owner;  // another thread interned the same value first
+
+    bucket.push_back(Entry{kind, n_key_bytes, made.second, made.first});
+    return made.first;
+}
+
+
+shared_ptr<const void> intern_param_array_bytes(const void* data, size_t n_bytes) {
+    return intern_param_bytes("array", data, n_bytes, [&]() {
+            const size_t alignment = 64;
+            size_t n_alloc = ((n_bytes+alignment-1)/alignment)*alignment;
+            void* p = nullptr;
+            if(posix_memalign(&p, alignment, n_alloc ? n_alloc : alignment)) throw string("unable to allocate parameter array");
+            memset(p, 0, n_alloc);
+            memcpy(p, data, n_bytes);
+            return make_pair(shared_ptr<const void>(p, free), (const void*)p);});
+}
+
+
+pair<size_t,size_t> param_store_usage() {
+    auto& store = param_store();
+    lock_guard<mutex> lock(store.mut);
+    size_t n_entry = 0, n_bytes = 0;
+    for(auto& b: store.buckets) {
+        for(auto& e: b.second) {
+            if(e.owner.expired()) continue;
+            ++n_entry;
+            n_bytes += e.n_key_bytes;
+        }
+    }
+    return make_pair(n_entry, n_bytes);
+}
@@ -0,0 +1,69 @@
+#ifndef PARAM_STORE_H
+#define PARAM_STORE_H
+
+#include <memory>
+#include <functional>
+#include <vector>
+#include <utility>
+#include <type_traits>
+
+//! \brief Content-addressed store of read-only parameters
+//!
+//! Nodes constructed from byte-identical parameter data, such as the same interaction
+//! table in every replica of a replica exchange simulation, receive a single shared
+//! copy.  Entries are reference counted and freed with their last user.  Shared
+//! parameters must never be modified; set_param must intern new parameters instead
+//! (copy-on-write), so that other replicas are unaffected.  The store is thread-safe.
+
+//! \brief Type-erased lookup of an interned value
+//!
+//! Returns the owner of the value whose key has the same kind and bytes, or else the
+//! owner returned by make.  make returns the owner and a pointer to a copy of the key
+//! with the owner's lifetime.  make is called without holding the store lock.
+std::shared_ptr<const void> intern_param_bytes(
+        const char* kind, const void* key, size_t n_key_bytes,
+        const std::function<std::pair<std::shared_ptr<const void>,const void*>()>& make);
+
+//! \brief Shared, 64-byte aligned copy of an array of parameters
+//!
+//! The allocation is padded with zeros to a multiple of 64 bytes, so vector loads
+//! may read past the end of the array.
+std::shared_ptr<const void> intern_param_array_bytes(const void* data, size_t n_bytes);
+
+//! \brief Shared, aligned read-only copy of an array
+template <typename T>
+std::shared_ptr<const T> intern_param_array(const T* data, size_t n_elem) {
+    static_assert(std::is_trivially_copyable<T>::value, "only plain data may be interned");
+    return std::static_pointer_cast<const T>(intern_param_array_bytes(data, n_elem*sizeof(T)));
+}
+
+template <typename T>
+std::shared_ptr<const T> intern_param_array(const std::vector<T>& data) {
+    return intern_param_array(data.data(), data.size());
+}
+
+//! \brief Shared read-only object derived from the bytes of key
+//!
+//! make is only called if no live object with the same kind and key exists.  This
+//! is used for objects such as fitted splines, so that the fit is also shared.
+template <typename T, typename F>
+std::shared_ptr<const T> intern_param_object(const char* kind, const void* key, size_t n_key_bytes,
+        F make) {
+    struct Holder {
+        std::vector<char> key;
+        T value;
+    };
+
+    auto owner = intern_param_bytes(kind, key, n_key_bytes, [&]() {
+            auto k = static_cast<const char*>(key);
+            auto holder = std::make_shared<Holder>(Holder{std::vector<char>(k, k+n_key_bytes), make()});
+            return std::make_pair(std::shared_ptr<const void>(holder), (const void*)holder->key.data());});
+
+    auto holder = std::static_pointer_cast<const Holder>(owner);
+    return std::shared_ptr<const T>(holder, &holder->value);
+}
+
+//! \brief Number of live interned entries and their total key bytes (for diagnostics)
+std::pair<size_t,size_t> param_store_usage();
+
+#endif
@@ -91,7 +91,7 @@ struct PivotSampler {
 
     void execute_random_pivot(float* delta_lprob, 
             uint32_t seed, uint64_t n_round, VecArray pos) const {
-        Timer timer(std::string("random_pivot"));
+        Timer timer("random_pivot");
         RandomGenerator random(seed, PIVOT_MOVE_RANDOM_STREAM, 0, n_round);
         float4 random_values = random.uniform_open_closed();
 
@@ -177,12 +177,12 @@ struct PivotSampler {
         VecArrayStorage pos_copy(pos);
         float delta_lprob;
 
-        engine.compute(PotentialAndDerivMode);
+        engine.compute(PotentialOnlyMode);
         float old_potential = engine.potential;
 
         execute_random_pivot(&delta_lprob, seed, round, pos);
 
-        engine.compute(PotentialAndDerivMode);
+        engine.compute(PotentialOnlyMode);
         float new_potential = engine.potential;
 
         float lboltz_diff = delta_lprob - (1.f/temperature) * (new_potential-old_potential);
@@ -27,39 +27,47 @@ struct RamaPlacement {
     CoordNode& rama;
     int n_elem;
     vector<Params> params;
-    LayeredPeriodicSpline2D<n_pos_dim> spline;
+    shared_ptr<const LayeredPeriodicSpline2D<n_pos_dim>> spline;  // shared through param_store.h
     VecArrayStorage rama_deriv;
 
     RamaPlacement(hid_t grp, CoordNode& rama_):
         rama(rama_),
         n_elem(get_dset_size(1, grp, "layer_index")[0]),
         params(n_elem),
-        spline(
-                get_dset_size(4, grp, "placement_data")[0],
-                get_dset_size(4, grp, "placement_data")[1],
-                get_dset_size(4, grp, "placement_data")[2]),
         rama_deriv(2*n_pos_dim, n_elem) // first is all phi deriv then all psi deriv
     {
+        int n_layer = get_dset_size(4, grp, "placement_data")[0];
+        int nx      = get_dset_size(4, grp, "placement_data")[1];
+        int ny      = get_dset_size(4, grp, "placement_data")[2];
         check_size(grp, "layer_index",    n_elem);
         check_size(grp, "rama_residue",   n_elem);
-        check_size(grp, "placement_data", spline.n_layer, spline.nx, spline.ny, n_pos_dim);
 
         traverse_dset<1,int>(grp, "layer_index",    [&](size_t np, int x){params[np].layer_idx  = x;});
         traverse_dset<1,int>(grp, "rama_residue",   [&](size_t np, int x){params[np].rama_residue  = x;});
 
-        {
-            vector<double> all_data_to_fit;
-            traverse_dset<4,double>(grp, "placement_data", [&](size_t nl, size_t ix, size_t iy,size_t d, double x) {
-                    all_data_to_fit.push_back(x);});
-            spline.fit_spline(all_data_to_fit.data());
-        }
+        spline = shared_periodic_spline_2d<n_pos_dim>(n_layer, nx, ny,
+                read_dset<double>(grp, "placement_data", {size_t(n_layer), size_t(nx), size_t(ny), size_t(n_pos_dim)}));
     }
 
+    // args are the arguments of the PlacementNode
+    RamaPlacement(const RamaPlacement& other, const ArgList& args):
+        rama(*args.at(1)),
+        n_elem(other.n_elem),
+        params(other.params),
+        spline(other.spline),
+        rama_deriv(2*n_pos_dim, n_elem)
+    {}
+
     void reset() {}
 
+    // element ne depends on the Rama angles of its residue
+    bool depends_on_dirty(int ne, const vector<const DirtySet*>& arg_dirty) const {
+        return arg_dirty[1]->contains(params[ne].rama_residue);
+    }
+
     Vec<n_pos_dim> evaluate(int ne) {
-        const float scale_x = spline.nx * (0.5f/M_PI_F - 1e-7f);
-        const float scale_y = spline.ny * (0.5f/M_PI_F - 1e-7f);
+        const float scale_x = spline->nx * (0.5f/M_PI_F - 1e-7f);
+        const float scale_y = spline->ny * (0.5f/M_PI_F - 1e-7f);
         const float shift = M_PI_F;
 
         VecArray rama_pos   = rama.output;
@@ -67,7 +75,7 @@ struct RamaPlacement {
         auto r   = load_vec<2>(rama_pos,   params[ne].rama_residue);
 
         Vec<n_pos_dim> value;
-        spline.evaluate_value_and_deriv(
+        spline->evaluate_value_and_deriv(
                 value.v, 
                 &rama_deriv(        0,ne),
                 &rama_deriv(n_pos_dim,ne),
@@ -78,8 +86,8 @@ struct RamaPlacement {
     }
 
     void propagate_deriv(const Vec<n_pos_dim> &sens, int ne) {
-        const float scale_x = spline.nx * (0.5f/M_PI_F - 1e-7f);
-        const float scale_y = spline.ny * (0.5f/M_PI_F - 1e-7f);
+        const float scale_x = spline->nx * (0.5f/M_PI_F - 1e-7f);
+        const float scale_y = spline->ny * (0.5f/M_PI_F - 1e-7f);
 
         VecArray r_sens = rama.sens;
 
@@ -108,7 +116,7 @@ struct FixedPlacement {
     int n_elem;
     int n_layer;
     vector<Params> params;
-    VecArrayStorage data;
+    shared_ptr<const float> data;  // (n_layer,n_pos_dim), shared through param_store.h
 
     #ifdef PARAM_DERIV
     VecArrayStorage param_deriv;
@@ -117,27 +125,37 @@ struct FixedPlacement {
     FixedPlacement(hid_t grp):
         n_elem (get_dset_size(1, grp, "layer_index")[0]),
         n_layer(get_dset_size(2, grp, "placement_data")[0]),
-        params(n_elem),
-        data(n_pos_dim, n_layer)
+        params(n_elem)
         #ifdef PARAM_DERIV
         ,param_deriv(n_pos_dim, n_layer)
         #endif
     {
         check_size(grp, "layer_index",    n_elem);
-        check_size(grp, "placement_data", n_layer, n_pos_dim);
 
         traverse_dset<1,int>(grp, "layer_index",    [&](size_t np, int x){params[np].layer_idx  = x;});
-        traverse_dset<2,float>(grp, "placement_data", [&](size_t nl, size_t d, double x) {data(d,nl) = x;});
+        data = intern_param_array(read_dset<float>(grp, "placement_data", {size_t(n_layer), size_t(n_pos_dim)}));
     }
 
+    FixedPlacement(const FixedPlacement& other, const ArgList& args):
+        n_elem(other.n_elem),
+        n_layer(other.n_layer),
+        params(other.params),
+        data(other.data)
+        #ifdef PARAM_DERIV
+        ,param_deriv(n_pos_dim, n_layer)
+        #endif
+    {}
+
     void reset() {
         #ifdef PARAM_DERIV
         fill(param_deriv, 0.f);
         #endif
     }
 
+    bool depends_on_dirty(int ne, const vector<const DirtySet*>& arg_dirty) const {return false;}
+
     Vec<n_pos_dim> evaluate(int ne) {
-        return load_vec<n_pos_dim>(data, params[ne].layer_idx);
+        return load_vec<n_pos_dim>(data.get() + params[ne].layer_idx*n_pos_dim);
     }
 
     void propagate_deriv(const Vec<n_pos_dim> &sens, int ne) {
@@ -147,9 +165,7 @@ struct FixedPlacement {
     }
 
     virtual std::vector<float> get_param() const {
-        auto ret = std::vector<float>(n_layer*n_pos_dim);
-        for(int nl: range(n_layer)) for(int d: range(n_pos_dim)) ret[nl*n_pos_dim+d] = data(d,nl);
-        return ret;
+        return std::vector<float>(data.get(), data.get()+n_layer*n_pos_dim);
     }
 
 #ifdef PARAM_DERIV
@@ -162,7 +178,7 @@ struct FixedPlacement {
 
     virtual void set_param(const std::vector<float>& new_param) {
         if(new_param.size() != size_t(n_layer*n_pos_dim)) throw string("wrong param size");
-        for(int nl: range(n_layer)) for(int d: range(n_pos_dim)) data(d,nl) = new_param[nl*n_pos_dim+d];
+        data = intern_param_array(new_param);  // copy-on-write
     }
 };
 
@@ -177,27 +193,25 @@ static constexpr int compute_pos_dim_from_signature() {
     return placetype_size(first) + compute_pos_dim_from_signature<second,rest...>();
 }
 
-template<int offset>
-void do_transformations(const float* U, const float3& t, const float* val, float* pos) {}
-
-template<int offset, PlaceT first, PlaceT ... rest>
-void do_transformations(const float* U, const float3& t, const float* val, float* pos) {
-
-    switch(first) {
-        case PlaceT::SCALAR:
-            pos[offset] = val[offset];
-            break;
+// Transformations for 4 elements at once, where U is a row-major rotation matrix
+template<int n_pos_dim, int offset>
+void do_transformations(const Vec<9,Float4>& U, const Vec<3,Float4>& t,
+        const Vec<n_pos_dim,Float4>& val, Vec<n_pos_dim,Float4>& pos) {}
 
-        case PlaceT::VECTOR:
-            store_vec(pos+offset, apply_rotation(U,   make_vec3(val[offset],val[offset+1],val[offset+2])));
-            break;
+template<int n_pos_dim, int offset, PlaceT first, PlaceT ... rest>
+void do_transformations(const Vec<9,Float4>& U, const Vec<3,Float4>& t,
+        const Vec<n_pos_dim,Float4>& val, Vec<n_pos_dim,Float4>& pos) {
 
-        case PlaceT::POINT:
-            store_vec(pos+offset, apply_affine  (U,t, make_vec3(val[offset],val[offset+1],val[offset+2])));
-            break;
+    if(first==PlaceT::SCALAR) {
+        pos[offset] = val[offset];
+    } else {
+        for(int i=0; i<3; ++i) {
+            pos[offset+i] = U[3*i]*val[offset] + U[3*i+1]*val[offset+1] + U[3*i+2]*val[offset+2];
+            if(first==PlaceT::POINT) pos[offset+i] += t[i];
+        }
     }
 
-    do_transformations<offset+placetype_size(first), rest...>(U,t,val,pos);
+    do_transformations<n_pos_dim, offset+placetype_size(first), rest...>(U,t,val,pos);
 }
 
 
@@ -236,20 +250,22 @@ struct PlacementNode: public CoordNode
     static constexpr int n_pos_dim = compute_pos_dim_from_signature<signature...>();
 
     PlacementData placement_data;
-    CoordNode& alignment;
+    FrameNode& alignment;
 
     vector<index_t> affine_residue;
+    unique_ptr<int32_t[]> batch_residue;  // affine_residue padded to a multiple of 4
 
     template<typename ... Args>
     PlacementNode(hid_t grp, CoordNode& alignment_, Args& ... placement_arguments):
         CoordNode(get_dset_size(1,grp,"layer_index")[0], n_pos_dim),
         placement_data(grp, placement_arguments...),
-        alignment(alignment_),
+        alignment(as_frame_node(alignment_)),
         affine_residue(n_elem)
     {
         // static_assert(n_pos_dim == decltype(placement_data.evaluate(0)), "inconsistent n_pos_dim");
         check_size(grp, "affine_residue", n_elem);
         traverse_dset<1,int>(grp, "affine_residue", [&](size_t np, int x){affine_residue[np] = x;});
+        init_batch_residue();
 
         if(logging(LOG_EXTENSIVE)) {
             // FIXME prepend the logging with the class name for disambiguation
@@ -261,27 +277,76 @@ struct PlacementNode: public CoordNode
         }
     }
 
-    virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("placement"));
+    PlacementNode(const PlacementNode& other, const ArgList& args):
+        CoordNode(other.n_elem, n_pos_dim),
+        placement_data(other.placement_data, args),
+        alignment(as_frame_node(*args.at(0))),
+        affine_residue(other.affine_residue)
+    {
+        init_batch_residue();
+    }
 
-        VecArray affine_pos = alignment.output;
-        VecArray pos        = output;
+    void init_batch_residue() {
+        batch_residue = new_aligned<int32_t>(round_up(n_elem,4), 4);
+        for(int ne: range(round_up(n_elem,4)))
+            batch_residue[ne] = affine_residue[ne<n_elem ? ne : n_elem-1];
+    }
 
+    virtual DerivComputation* clone(const ArgList& args) const override {
+        return new PlacementNode(*this, args);
+    }
+
+    virtual void compute_value(ComputeMode mode) {
+        Timer timer("placement");
         placement_data.reset();
+        for(int ne=0; ne<n_elem; ne+=4) compute_batch(ne);
+    }
 
-        for(int ne: range(n_elem)) {
-            auto aff = load_vec<7>(affine_pos, affine_residue[ne]);
-            auto t   = extract<0,3>(aff);
-            float U[9]; quat_to_rot(U, aff.v+3);
+    // Place elements ne..ne+3 using the rotation matrices cached by the frame node.
+    // Padding elements beyond n_elem repeat the last element.
+    void compute_batch(int ne) {
+        constexpr int n_pos_dim_a = round_up(n_pos_dim,4);
+        alignas(16) float val_buf[4*n_pos_dim_a];
+        alignas(16) int32_t val_offset[4] = {0, n_pos_dim_a, 2*n_pos_dim_a, 3*n_pos_dim_a};
 
-            Vec<n_pos_dim> val = placement_data.evaluate(ne);
+        for(int i: range(4)) {
+            auto val = placement_data.evaluate(min(ne+i, n_elem-1));
+            for(int d: range(n_pos_dim)) val_buf[i*n_pos_dim_a+d] = val[d];
+        }
+
+        auto residue = Int4(batch_residue.get()+ne);
+        auto U = aligned_gather_vec<9>(alignment.rotation.x.get(), residue*Int4(alignment.rotation.row_width));
+        auto t = aligned_gather_vec<3>(alignment.output  .x.get(), residue*Int4(alignment.output  .row_width));
+        auto val = aligned_gather_vec<n_pos_dim>(val_buf, Int4(val_offset));
+
+        Vec<n_pos_dim,Float4> pos;
+        do_transformations<n_pos_dim, 0, signature...>(U,t, val, pos);
+
+        alignas(16) int32_t pos_offset[4];
+        for(int i: range(4)) pos_offset[i] = (ne+i)*output.row_width;
+        aligned_scatter_store_vec_destructive(output.x.get(), Int4(pos_offset), pos);
+    }
+
+    virtual bool incremental_supported() const override {return true;}
 
-            do_transformations<0, signature...>(U,t, val.v, &pos(0,ne));
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        if(old_args) return 0.;  // the elements are placed from the current arguments
+        for(int ne: range(n_elem))
+            if(arg_dirty[0]->contains(affine_residue[ne]) || placement_data.depends_on_dirty(ne, arg_dirty))
+                dirty.add(ne);
+
+        // elements are placed in batches of 4, so each batch is computed once
+        int last_batch = -1;
+        for(int ne: dirty.elems) {
+            if(ne/4 == last_batch) continue;
+            compute_batch(ne/4*4);
+            last_batch = ne/4;
         }
+        return 0.;
     }
 
     virtual void propagate_deriv() {
-      Timer timer(string("placement_deriv"));
+      Timer timer("placement_deriv");
 
       VecArray a_sens = alignment.sens;
       VecArray affine_pos = alignment.output;
@@ -290,15 +355,14 @@ struct PlacementNode: public CoordNode
           auto d = load_vec<n_pos_dim>(sens, ne);
           float* x = &output(0,ne);
 
-          auto aff = load_vec<7>(affine_pos, affine_residue[ne]);
-          auto t   = extract<0,3>(aff);
-          float U[9]; quat_to_rot(U, aff.v+3);
-          
+          auto t = load_vec<3>(affine_pos, affine_residue[ne]);
+          auto U = load_vec<9>(alignment.rotation, affine_residue[ne]);
+
           Vec<n_pos_dim> ref_frame_sens;
           Vec<3> com_deriv = make_zero<3>();
           Vec<3> torque    = make_zero<3>();
 
-          do_sens_transformations<0, signature...>(ref_frame_sens.v,com_deriv,torque, U,t,x, d.v);
+          do_sens_transformations<0, signature...>(ref_frame_sens.v,com_deriv,torque, U.v,t,x, d.v);
           placement_data.propagate_deriv(ref_frame_sens, ne);
 
           update_vec(&a_sens(0,affine_residue[ne]), com_deriv);
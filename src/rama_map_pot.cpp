@@ -17,7 +17,7 @@ struct RamaMapPot : public PotentialNode
     int n_residue;
     CoordNode& rama;
     vector<RamaMapParams> params;
-    LayeredPeriodicSpline2D<1> rama_map_data;
+    shared_ptr<const LayeredPeriodicSpline2D<1>> rama_map_data;  // shared through param_store.h
     vector<float> residue_potential;
     bool log_pot; // if false, never log potential
 
@@ -26,26 +26,20 @@ struct RamaMapPot : public PotentialNode
         n_residue(get_dset_size(1, grp, "residue_id")[0]), 
         rama(rama_), 
         params(n_residue),
-        rama_map_data(
-                get_dset_size(3, grp, "rama_pot")[0], 
-                get_dset_size(3, grp, "rama_pot")[1], 
-                get_dset_size(3, grp, "rama_pot")[2]),
         residue_potential(n_residue),
         log_pot(read_attribute<int>(grp,".","log_pot",1))
     {
-        auto& r = rama_map_data;
+        int n_layer = get_dset_size(3, grp, "rama_pot")[0];
+        int nx      = get_dset_size(3, grp, "rama_pot")[1];
+        int ny      = get_dset_size(3, grp, "rama_pot")[2];
         check_size(grp, "residue_id",     n_residue);
         check_size(grp, "rama_map_id",    n_residue);
-        check_size(grp, "rama_pot",       r.n_layer, r.nx, r.ny);
-
-        if(r.nx != r.ny) throw string("must have same x and y grid spacing for Rama maps");
-        vector<double> raw_data(r.n_layer * r.nx * r.ny);
 
+        if(nx != ny) throw string("must have same x and y grid spacing for Rama maps");
         traverse_dset<1,int>   (grp, "residue_id",  [&](size_t i, int x) {params[i].residue = x;});
         traverse_dset<1,int>   (grp, "rama_map_id", [&](size_t i, int x) {params[i].rama_map_id = x;});
-        traverse_dset<3,double>(grp, "rama_pot",    [&](size_t il, size_t ix, size_t iy, double x) {
-                raw_data[(il*r.nx + ix)*r.ny + iy] = x;});
-        r.fit_spline(raw_data.data());
+        rama_map_data = shared_periodic_spline_2d<1>(n_layer, nx, ny,
+                read_dset<double>(grp, "rama_pot", {size_t(n_layer), size_t(nx), size_t(ny)}));
 
         if(log_pot && logging(LOG_DETAILED))
             default_logger->add_logger<float>("rama_map_potential", {n_residue}, [&](float* buffer) {
@@ -54,40 +48,76 @@ struct RamaMapPot : public PotentialNode
                     });
     }
 
+    RamaMapPot(const RamaMapPot& other, CoordNode& rama_):
+        PotentialNode(),
+        n_residue(other.n_residue),
+        rama(rama_),
+        params(other.params),
+        rama_map_data(other.rama_map_data),
+        residue_potential(n_residue),
+        log_pot(other.log_pot)
+    {}
+
+    virtual DerivComputation* clone(const ArgList& args) const override {
+        check_arguments_length(args,1);
+        return new RamaMapPot(*this, *args[0]);
+    }
+
+    // potential of residue nr, adding its derivative to rama_sens if it is not null
+    float term(int nr, VecArray ramac, VecArray* rama_sens) const {
+        // add a litte paranoia to make sure there are no rounding problems
+        const float scale = rama_map_data->nx * (0.5f/M_PI_F - 1e-7f);
+        const float shift = M_PI_F;
+
+        const auto& p = params[nr];
+        auto r = load_vec<2>(ramac, p.residue);
+
+        float value,dx,dy;
+        rama_map_data->evaluate_value_and_deriv(&value,&dx,&dy, p.rama_map_id, 
+                (r.v[0]+shift)*scale, (r.v[1]+shift)*scale);
+
+        if(rama_sens) {
+            (*rama_sens)(0,p.residue) += dx * scale;
+            (*rama_sens)(1,p.residue) += dy * scale;
+        }
+        return value;
+    }
+
     virtual void compute_value(ComputeMode mode) override {
-        Timer timer(string("rama_map_pot"));
+        Timer timer("rama_map_pot");
 
         float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
         VecArray ramac     = rama.output;
         VecArray rama_sens = rama.sens;
-        if(pot) *pot = 0.f;
-
-        // add a litte paranoia to make sure there are no rounding problems
-        const float scale = rama_map_data.nx * (0.5f/M_PI_F - 1e-7f);
-        const float shift = M_PI_F;
 
         if(pot) *pot = 0.f;
         for(int nr=0; nr<n_residue; ++nr) {
-            const auto& p = params[nr];
-            auto r = load_vec<2>(ramac, p.residue);
+            float value = term(nr, ramac, &rama_sens);
+            if(pot) {*pot += value; residue_potential[nr] = value;}
+        }
+    }
 
-            float value,dx,dy;
-            rama_map_data.evaluate_value_and_deriv(&value,&dx,&dy, p.rama_map_id, 
-                    (r.v[0]+shift)*scale, (r.v[1]+shift)*scale);
+    virtual bool incremental_supported() const override {return true;}
 
-            if(pot) {*pot += value; residue_potential[nr] = value;}
-            rama_sens(0,p.residue) += dx * scale;
-            rama_sens(1,p.residue) += dy * scale;
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        double pot = 0.;
+        for(int nr=0; nr<n_residue; ++nr) {
+            if(!arg_dirty[0]->contains(params[nr].residue)) continue;
+            float value = term(nr, rama.output, nullptr);
+            if(!old_args) residue_potential[nr] = value;
+            pot += value;
         }
+        return pot;
     }
 
 #ifdef PARAM_DERIV
     virtual void set_param(const std::vector<float>& new_param) override {
-        auto& r = rama_map_data;
+        // the spline may be shared, so replace it rather than fitting in place
+        auto& r = *rama_map_data;
         vector<double> raw_data(r.n_layer * r.nx * r.ny);
         if(raw_data.size() != new_param.size()) throw string("wrong number of parameters");
         for(size_t i=0u; i<size_t(r.n_layer * r.nx * r.ny); ++i) raw_data[i] = new_param[i];
-        r.fit_spline(raw_data.data());
+        rama_map_data = shared_periodic_spline_2d<1>(r.n_layer, r.nx, r.ny, raw_data);
     }
 #endif
 };
@@ -325,6 +325,13 @@ struct EdgeHolder {
         EdgeLocator nodes_to_edge;
         vector<EdgeLoc> edge_loc;
 
+        // converged edge beliefs of the previous solve, used to warm start the next one
+        int prev_n_edge;
+        unique_ptr<int[]> prev_edge_indices1;
+        unique_ptr<int[]> prev_edge_indices2;
+        EdgeLocator prev_nodes_to_edge;
+        VecArrayStorage prev_belief;
+
         EdgeHolder(NodeHolder &nodes1_, NodeHolder &nodes2_, int max_n_edge):
             n_rot1(nodes1_.n_rot), n_rot2(nodes2_.n_rot),
             nodes1(nodes1_), nodes2(nodes2_),
@@ -336,28 +343,88 @@ struct EdgeHolder {
             edge_indices1(new_aligned<int>(max_n_edge,simd_width)),
             edge_indices2(new_aligned<int>(max_n_edge,simd_width)),
 
-            nodes_to_edge(nodes1.n_elem)
+            nodes_to_edge(nodes1.n_elem),
+
+            prev_n_edge(0),
+            prev_edge_indices1(new_aligned<int>(max_n_edge,simd_width)),
+            prev_edge_indices2(new_aligned<int>(max_n_edge,simd_width)),
+            prev_nodes_to_edge(nodes1.n_elem),
+            prev_belief(ru(n_rot1)+ru(n_rot2), max_n_edge+3)
         {
 
             edge_loc.reserve(n_rot1*n_rot2*max_n_edge);
             fill(cur_belief, 0.f);
             fill(old_belief, 0.f);
+            fill(prev_belief, 0.f);
             fill_n(edge_indices1, round_up(max_n_edge,simd_width), 0);
             fill_n(edge_indices2, round_up(max_n_edge,simd_width), 0);
             nodes_to_edge.n_edge = max_n_edge;
             reset();
         }
 
-        void reset() {
+        void reset(bool save_beliefs=false) {
             // reset the probabilities we wrote over
             for(int idx=0; idx<nodes_to_edge.n_edge; ++idx)
                 for(int i: range(n_rot1)) 
                     for(int j: range(n_rot2)) 
                         prob(i*ru(n_rot2)+j,idx) = 1.f;
 
+            if(save_beliefs) {
+                // keep the edges and converged beliefs of the last solve for warm_start_beliefs
+                prev_n_edge = nodes_to_edge.n_edge;
+                swap(nodes_to_edge, prev_nodes_to_edge);
+                swap(edge_indices1, prev_edge_indices1);
+                swap(edge_indices2, prev_edge_indices2);
+                swap(cur_belief,    prev_belief);
+            }
+
             nodes_to_edge.clear();
             edge_loc.clear();
         }
+
+        int warm_start_beliefs() {
+            // Initialize old_belief from the beliefs saved by reset(true), matching edges by their
+            // nodes.  Edges that are new since the last solve get the usual uniform start belief.
+            // Returns the number of edges that were warm started.
+            int n_edge = nodes_to_edge.n_edge;
+            if(n_edge==prev_n_edge &&
+                    equal(edge_indices1.get(), edge_indices1.get()+n_edge, prev_edge_indices1.get()) &&
+                    equal(edge_indices2.get(), edge_indices2.get()+n_edge, prev_edge_indices2.get())) {
+                swap(old_belief, prev_belief);  // unchanged edge set, so no remapping is needed
+                return n_edge;
+            }
+
+            int n_warm = 0;
+            int n_dim = ru(n_rot1)+ru(n_rot2);
+            for(int ne=0; ne<n_edge; ++ne) {
+                int32_t prev_ne;
+                bool is_new = prev_nodes_to_edge.find_or_insert(prev_ne, edge_indices1[ne], edge_indices2[ne]);
+                if(!is_new && prev_ne<prev_n_edge) {
+                    for(int d: range(n_dim)) old_belief(d,ne) = prev_belief(d,prev_ne);
+                    ++n_warm;
+                } else {
+                    for(int d: range(n_dim))
+                        old_belief(d,ne) = (d<n_rot1 || (ru(n_rot1)<=d && d<ru(n_rot1)+n_rot2)) ? 1.f : 0.f;
+                }
+            }
+            return n_warm;
+        }
+
+        template<int N_ROT1, int N_ROT2>
+        void multiply_old_node_beliefs() {
+            // Fold the starting edge beliefs into the starting node beliefs so that the two are
+            // consistent, as they are for the cold start (node belief prob and uniform edge beliefs)
+            for(int ne: range(nodes_to_edge.n_edge)) {
+                auto b = load_vec<ru(N_ROT1)+ru(N_ROT2)>(old_belief, ne);
+
+                auto b1 = load_vec<N_ROT1>(nodes1.old_belief, edge_indices1[ne]) * extract<0,N_ROT1>(b);
+                store_vec(nodes1.old_belief, edge_indices1[ne], b1*rcp(1e-10f+max(b1)));
+
+                auto b2 = load_vec<N_ROT2>(nodes2.old_belief, edge_indices2[ne]) *
+                    extract<ru(N_ROT1),ru(N_ROT1)+N_ROT2>(b);
+                store_vec(nodes2.old_belief, edge_indices2[ne], b2*rcp(1e-10f+max(b2)));
+            }
+        }
         void swap_beliefs() { swap(cur_belief, old_belief); }
 
         void add_to_edge(
@@ -599,9 +666,17 @@ struct RotamerSidechain: public PotentialNode {
     float tol;
     int   iteration_chunk_size;
 
+    // Start each solve from the beliefs of the previous one, which are usually close to the
+    // new answer since positions change little between calls.  Set the warm_start attribute
+    // to 0 to always start from the node probabilities and uniform edge beliefs instead.
+    bool warm_start;
+    bool warm_start_valid;  // previous solve converged, so its beliefs are worth reusing
+
     bool energy_fresh_relative_to_derivative;
 
     long n_bad_solve;
+    long n_cold_solve, n_cold_solve_iter;
+    long n_warm_solve, n_warm_solve_iter;
 
     RotamerSidechain(hid_t grp, CoordNode &pos_node_, vector<CoordNode*> prob_nodes_):
         PotentialNode(),
@@ -632,8 +707,13 @@ struct RotamerSidechain: public PotentialNode {
         tol     (read_attribute<float>(grp, ".", "tol")),
         iteration_chunk_size(read_attribute<int>(grp, ".", "iteration_chunk_size")),
 
+        warm_start(read_attribute<int>(grp, ".", "warm_start", 1)),
+        warm_start_valid(false),
+
         energy_fresh_relative_to_derivative(false),
-        n_bad_solve(0)
+        n_bad_solve(0),
+        n_cold_solve(0), n_cold_solve_iter(0),
+        n_warm_solve(0), n_warm_solve_iter(0)
     {
         for(int i: range(UPPER_ROT)) node_holders_matrix[i] = nullptr;
         node_holders_matrix[1] = &nodes1;
@@ -658,6 +738,13 @@ struct RotamerSidechain: public PotentialNode {
             default_logger->add_logger<long>("rotamer_bad_solves_cumulative", {1},
                     [&](long* buffer) {buffer[0]=n_bad_solve;});
 
+        if(logging(LOG_DETAILED) && warm_start) {
+            default_logger->add_logger<long>("rotamer_iterations_cumulative", {1},
+                    [&](long* buffer) {buffer[0]=n_cold_solve_iter+n_warm_solve_iter;});
+            default_logger->add_logger<float>("rotamer_iterations_saved_cumulative", {1},
+                    [&](float* buffer) {buffer[0]=iterations_saved();});
+        }
+
         if(logging(LOG_DETAILED)) {
             default_logger->add_logger<float>("rotamer_free_energy", {nodes1.n_elem+nodes3.n_elem+nodes6.n_elem}, 
                     [&](float* buffer) {
@@ -761,6 +848,8 @@ struct RotamerSidechain: public PotentialNode {
             }
 
             return edge_value;
+        } else if(!strcmp(log_name, "iterations_saved")) {
+            return vector<float>(1, iterations_saved());
         } else if(!strcmp(log_name, "read n_bad_solve")) {
             return vector<float>(1, float(n_bad_solve));
         } else if(!strcmp(log_name, "read n_bad_solve and reset")) {
@@ -776,28 +865,32 @@ struct RotamerSidechain: public PotentialNode {
         if(!energy_fresh_relative_to_derivative) compute_value(PotentialAndDerivMode);
     }
 
+    virtual bool potential_only_supported() const override {return true;}
+
     virtual void compute_value(ComputeMode mode) override {
-        energy_fresh_relative_to_derivative = mode==PotentialAndDerivMode;
+        energy_fresh_relative_to_derivative = mode!=DerivMode;
 
         fill_holders();
         auto solve_results = solve_for_marginals();
-        if(solve_results.first >= max_iter - iteration_chunk_size - 1)
+        bool bad_solve = solve_results.first >= max_iter - iteration_chunk_size - 1;
+        if(bad_solve)
             n_bad_solve++;
+        warm_start_valid = warm_start && !bad_solve && std::isfinite(solve_results.second);
 
-        propagate_derivatives();
-        if(mode==PotentialAndDerivMode) potential = calculate_energy_from_marginals();
+        if(mode!=PotentialOnlyMode) propagate_derivatives();
+        if(mode!=DerivMode)         potential = calculate_energy_from_marginals();
     }
 
     virtual double test_value_deriv_agreement() {return -1.;}
 
     void fill_holders()
     {
-        Timer timer(std::string("rotamer_fill"));
+        Timer timer("rotamer_fill");
         edges11.reset();
         for(int n_rot1: range(UPPER_ROT))
             for(int n_rot2: range(UPPER_ROT))
                 if(edge_holders_matrix[n_rot1][n_rot2])
-                    edge_holders_matrix[n_rot1][n_rot2]->reset();
+                    edge_holders_matrix[n_rot1][n_rot2]->reset(warm_start_valid && n_rot1>1);
 
         for(int n_rot: range(UPPER_ROT))
             if(node_holders_matrix[n_rot])
@@ -1002,8 +1095,14 @@ struct RotamerSidechain: public PotentialNode {
     }
     
 
+    float iterations_saved() const {
+        // estimated from the average number of iterations of cold-started solves
+        if(!n_cold_solve) return 0.f;
+        return n_warm_solve*(float(n_cold_solve_iter)/n_cold_solve) - n_warm_solve_iter;
+    }
+
     pair<int,float> solve_for_marginals() {
-        Timer timer(std::string("rotamer_solve"));
+        Timer timer("rotamer_solve");
         // first initialize old node beliefs to just be probability
         // this may affect the final answer since belief propagation is minimizing a non-convex function
         for(auto nh: node_holders_matrix)
@@ -1012,23 +1111,33 @@ struct RotamerSidechain: public PotentialNode {
                     for(int ne: range(nh->n_elem))
                         nh->old_belief(no,ne) = nh->prob(no,ne);
 
-        alignas(16) float start_belief3 [4] = {1.f,1.f,1.f,0.f}; auto sb3  = Float4(start_belief3);
-        alignas(16) float start_belief6a[4] = {1.f,1.f,1.f,1.f}; auto sb6a = Float4(start_belief6a);
-        alignas(16) float start_belief6b[4] = {1.f,1.f,0.f,0.f}; auto sb6b = Float4(start_belief6b);
-        for(int ne=0; ne<edges33.nodes_to_edge.n_edge; ++ne) {
-            sb3 .store(edges33.old_belief.x+ne*8+0);
-            sb3 .store(edges33.old_belief.x+ne*8+4);
-        }
-        for(int ne=0; ne<edges36.nodes_to_edge.n_edge; ++ne) {
-            sb3 .store(edges36.old_belief.x+ne*12+0);
-            sb6a.store(edges36.old_belief.x+ne*12+4);
-            sb6b.store(edges36.old_belief.x+ne*12+8);
-        }
-        for(int ne=0; ne<edges66.nodes_to_edge.n_edge; ++ne) {
-            sb6a.store(edges66.old_belief.x+ne*16+ 0);
-            sb6b.store(edges66.old_belief.x+ne*16+ 4);
-            sb6a.store(edges66.old_belief.x+ne*16+ 8);
-            sb6b.store(edges66.old_belief.x+ne*16+12);
+        bool warm = warm_start_valid;
+        if(warm) {
+            edges33.warm_start_beliefs();
+            edges36.warm_start_beliefs();
+            edges66.warm_start_beliefs();
+            edges33.multiply_old_node_beliefs<3,3>();
+            edges36.multiply_old_node_beliefs<3,6>();
+            edges66.multiply_old_node_beliefs<6,6>();
+        } else {
+            alignas(16) float start_belief3 [4] = {1.f,1.f,1.f,0.f}; auto sb3  = Float4(start_belief3);
+            alignas(16) float start_belief6a[4] = {1.f,1.f,1.f,1.f}; auto sb6a = Float4(start_belief6a);
+            alignas(16) float start_belief6b[4] = {1.f,1.f,0.f,0.f}; auto sb6b = Float4(start_belief6b);
+            for(int ne=0; ne<edges33.nodes_to_edge.n_edge; ++ne) {
+                sb3 .store(edges33.old_belief.x+ne*8+0);
+                sb3 .store(edges33.old_belief.x+ne*8+4);
+            }
+            for(int ne=0; ne<edges36.nodes_to_edge.n_edge; ++ne) {
+                sb3 .store(edges36.old_belief.x+ne*12+0);
+                sb6a.store(edges36.old_belief.x+ne*12+4);
+                sb6b.store(edges36.old_belief.x+ne*12+8);
+            }
+            for(int ne=0; ne<edges66.nodes_to_edge.n_edge; ++ne) {
+                sb6a.store(edges66.old_belief.x+ne*16+ 0);
+                sb6b.store(edges66.old_belief.x+ne*16+ 4);
+                sb6a.store(edges66.old_belief.x+ne*16+ 8);
+                sb6b.store(edges66.old_belief.x+ne*16+12);
+            }
         }
 
         calculate_new_beliefs(0.f, true);
@@ -1049,6 +1158,8 @@ struct RotamerSidechain: public PotentialNode {
             // printf("(%i,%.3f,%.3f)\n", iter, nodes3.max_deviation(), nodes6.max_deviation());
             max_deviation = max(nodes3.max_deviation(), nodes6.max_deviation());
         }
+        if(warm) {n_warm_solve++; n_warm_solve_iter += iter;}
+        else     {n_cold_solve++; n_cold_solve_iter += iter;}
 
         nodes1 .calculate_marginals<1>  ();
         nodes3 .calculate_marginals<3>  ();
@@ -1060,6 +1171,11 @@ struct RotamerSidechain: public PotentialNode {
         return make_pair(iter, max_deviation);
     }
 
+    virtual void reset_caches() override {
+        igraph.reset_caches();
+        warm_start_valid = false;  // next solve starts cold
+    }
+
     virtual std::vector<float> get_param() const override {return igraph.get_param();}
 #ifdef PARAM_DERIV
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
@@ -88,19 +88,33 @@ struct SidechainRadialPairs : public PotentialNode
         igraph(grp, &bb_point_)
     {};
 
+    virtual bool potential_only_supported() const override {return true;}
+
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("radial_pairs"));
+        Timer timer("radial_pairs");
 
         igraph.compute_edges();
-        for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
-        igraph.propagate_derivatives();
+        if(mode!=PotentialOnlyMode) {
+            for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
+            igraph.propagate_derivatives();
+        }
 
-        if(mode==PotentialAndDerivMode) {
+        if(mode!=DerivMode) {
             potential = 0.f;
             for(int ne=0; ne<igraph.n_edge; ++ne) 
                 potential += igraph.edge_value[ne];
         }
     }
+
+    virtual void reset_caches() override {igraph.reset_caches();}
+
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        double pot = 0.;
+        igraph.visit_dirty_edges(*arg_dirty[0], nullptr, [&](int i1, int i2, float value) {pot += value;});
+        return pot;
+    }
 };
 
 
@@ -114,20 +128,34 @@ struct HBondSidechainRadialPairs : public PotentialNode
         igraph(grp, &hb_point_, &bb_point_)
     {};
 
+    virtual bool potential_only_supported() const override {return true;}
+
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("hbond_sc_radial_pairs"));
+        Timer timer("hbond_sc_radial_pairs");
 
         igraph.compute_edges();
-        for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
-        igraph.propagate_derivatives();
+        if(mode!=PotentialOnlyMode) {
+            for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
+            igraph.propagate_derivatives();
+        }
 
-        if(mode==PotentialAndDerivMode) {
+        if(mode!=DerivMode) {
             potential = 0.f;
             for(int ne=0; ne<igraph.n_edge; ++ne) 
                 potential += igraph.edge_value[ne];
         }
     }
 
+    virtual void reset_caches() override {igraph.reset_caches();}
+
+    virtual bool incremental_supported() const override {return true;}
+
+    virtual double update_dirty(const vector<const DirtySet*>& arg_dirty, DirtySet& dirty, bool old_args) override {
+        double pot = 0.;
+        igraph.visit_dirty_edges(*arg_dirty[0], arg_dirty[1], [&](int i1, int i2, float value) {pot += value;});
+        return pot;
+    }
+
     virtual std::vector<float> get_param() const override {return igraph.get_param();}
 #ifdef PARAM_DERIV
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
@@ -184,7 +212,7 @@ struct ContactEnergy : public PotentialNode
     }
 
     virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("contact_energy"));
+        Timer timer("contact_energy");
         VecArray pos  = bead_pos.output;
         VecArray sens = bead_pos.sens;
         potential = 0.f;
@@ -6,6 +6,7 @@
 #include <cstring>
 #include "vector_math.h"
 #include "Float4.h"
+#include "param_store.h"
 
 //! \brief Compute polynomial coefficients from periodic data
 //!
@@ -514,4 +515,35 @@ struct LayeredClampedSpline1D {
         }
     }
 };
+
+
+//! \brief Fitted spline shared by all users of identical data (see param_store.h)
+//!
+//! data has shape (n_layer, nx, ny, NDIM_VALUE) as for fit_spline.
+template<int NDIM_VALUE>
+std::shared_ptr<const LayeredPeriodicSpline2D<NDIM_VALUE>> shared_periodic_spline_2d(
+        int n_layer, int nx, int ny, const std::vector<double>& data) {
+    std::vector<double> key = {double(NDIM_VALUE), double(n_layer), double(nx), double(ny)};
+    key.insert(key.end(), data.begin(), data.end());
+    return intern_param_object<LayeredPeriodicSpline2D<NDIM_VALUE>>(
+            "LayeredPeriodicSpline2D", key.data(), key.size()*sizeof(double), [&]() {
+                LayeredPeriodicSpline2D<NDIM_VALUE> spline(n_layer, nx, ny);
+                spline.fit_spline(data.data());
+                return spline;});
+}
+
+//! \brief Fitted spline shared by all users of identical data (see param_store.h)
+//!
+//! data has shape (n_layer, nx, NDIM_VALUE) as for fit_spline.
+template<int NDIM_VALUE>
+std::shared_ptr<const LayeredClampedSpline1D<NDIM_VALUE>> shared_clamped_spline_1d(
+        int n_layer, int nx, const std::vector<double>& data) {
+    std::vector<double> key = {double(NDIM_VALUE), double(n_layer), double(nx)};
+    key.insert(key.end(), data.begin(), data.end());
+    return intern_param_object<LayeredClampedSpline1D<NDIM_VALUE>>(
+            "LayeredClampedSpline1D", key.data(), key.size()*sizeof(double), [&]() {
+                LayeredClampedSpline1D<NDIM_VALUE> spline(n_layer, nx);
+                spline.fit_spline(data.data());
+                return spline;});
+}
 #endif
@@ -1,3 +1,69 @@
 #include "state_logger.h"
 
-std::shared_ptr<H5Logger> default_logger;
+thread_local std::shared_ptr<H5Logger> default_logger;
+
+H5Writer& h5_writer() {
+    static H5Writer writer;
+    return writer;
+}
+
+uint64_t H5Writer::enqueue(std::function<void()> job) {
+    std::lock_guard<std::mutex> lock(mut);
+    if(error.size()) throw error;
+    if(!thread.joinable()) thread = std::thread([this]() {run();});
+
+    queue.push_back(std::move(job));
+    work_available.notify_one();
+    return ++n_enqueued;
+}
+
+void H5Writer::wait_for(uint64_t ticket) {
+    // jobs finish in submission order
+    std::unique_lock<std::mutex> lock(mut);
+    work_done.wait(lock, [&]() {return n_finished >= ticket;});
+    if(error.size()) throw error;
+}
+
+void H5Writer::drain() {
+    std::unique_lock<std::mutex> lock(mut);
+    work_done.wait(lock, [&]() {return n_finished == n_enqueued;});
+    if(error.size()) throw error;
+}
+
+void H5Writer::run() {
+    std::unique_lock<std::mutex> lock(mut);
+    while(true) {
+        work_available.wait(lock, [&]() {return stopping || !queue.empty();});
+        if(queue.empty()) break;  // only exit when everything is written
+
+        auto job = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+
+        std::string job_error;
+        {
+            h5::H5Lock h5_lock;  // HDF5 is often built non-thread-safe
+            try {
+                job();
+            } catch(const std::string& e) {
+                job_error = e;
+            } catch(...) {
+                job_error = "unknown error in HDF5 writer";
+            }
+        }
+
+        lock.lock();
+        n_finished++;
+        if(job_error.size() && error.empty()) error = job_error;
+        work_done.notify_all();
+    }
+}
+
+H5Writer::~H5Writer() {
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        stopping = true;
+        work_available.notify_one();
+    }
+    if(thread.joinable()) thread.join();
+}
@@ -5,11 +5,53 @@
 #include "h5_support.h"
 #include <initializer_list>
 #include <memory>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "timing.h"
 
+// Background thread that performs all buffered HDF5 writes of the H5Logger's, so that
+// simulation threads do not wait on the filesystem.  Jobs run in submission order while
+// holding the h5::H5Lock.  Simulation threads only block in wait_for or drain.
+struct H5Writer {
+    std::mutex mut;
+    std::condition_variable work_available;
+    std::condition_variable work_done;
+    std::deque<std::function<void()>> queue;
+    uint64_t n_enqueued;
+    uint64_t n_finished;
+    bool stopping;
+    std::string error;   // first error from a job, rethrown on a simulation thread
+    std::thread thread;  // started on the first enqueue
+
+    H5Writer(): n_enqueued(0u), n_finished(0u), stopping(false) {}
+
+    uint64_t enqueue(std::function<void()> job);  // returns a ticket for wait_for
+    void wait_for(uint64_t ticket);  // wait until the job with this ticket is written
+    void drain();   // wait until all enqueued jobs are written
+    void run();
+    ~H5Writer();
+};
+
+H5Writer& h5_writer();
+
+
+//! Rows in each HDF5 chunk of a logged dataset
+constexpr int log_chunk_rows = 100;
+
 struct SingleLogger {
+    uint64_t stride;  //!< sampled every stride rounds of the simulation
+
+    SingleLogger(uint64_t stride_): stride(stride_) {}
     virtual void collect_samples() = 0;
     virtual void dump_samples   () = 0;
+    //! \brief Hand the buffered samples to a write job, so that collection may continue immediately
+    //!
+    //! Samples are collected into a ring of buffers while the others are written.  The buffer
+    //! filled next is the one detached n_buffers-1 calls ago, whose job must have finished.
+    virtual std::function<void()> detach_samples() = 0;
     virtual ~SingleLogger() {};
 };
 
@@ -18,36 +60,55 @@ template <typename T, typename F>
 struct SpecializedSingleLogger: public SingleLogger {
     h5::H5Obj data_set;
     std::vector<hsize_t> dims;
-    std::vector<T> data_buffer;
+    std::vector<std::vector<T>> buffers;  // ring of buffers, the others being written or written
+    int current;                          // index of the buffer being filled
     F sample_function;
     hsize_t row_size;
 
     SpecializedSingleLogger(hid_t logging_group, const char* loc, 
-            F sample_function_, const std::initializer_list<int>& dims_):
-        sample_function(sample_function_), row_size(1u)
+            F sample_function_, const std::initializer_list<int>& dims_, uint64_t stride_,
+            int n_buffers, int first_buffer):
+        SingleLogger(stride_), buffers(n_buffers), current(first_buffer), sample_function(sample_function_), row_size(1u)
     {
         dims.push_back(H5S_UNLIMITED);
         std::vector<hsize_t> chunk_shape;
-        chunk_shape.push_back(100);
+        chunk_shape.push_back(log_chunk_rows);
         for(auto i: dims_) {
             dims.push_back(i);
             chunk_shape.push_back(i);
             row_size *= i;
         }
         data_set = h5::create_earray(logging_group, loc, h5::select_predtype<T>(), dims, chunk_shape);
+        // rows are at rounds 0, stride, 2*stride, ... after the start of the simulation
+        h5::write_attribute<int>(logging_group, loc, "stride", int(stride));
     }
 
     virtual void collect_samples() {
+        auto& data_buffer = buffers[current];
         data_buffer.resize(data_buffer.size()+row_size);
         T* current_data = data_buffer.data() + data_buffer.size() - row_size;
         sample_function(current_data);
     }
 
     virtual void dump_samples() {
+        auto& data_buffer = buffers[current];
         if(data_buffer.size()) h5::append_to_dset(data_set.get(), data_buffer, 0);
         data_buffer.resize(0);
     }
 
+    virtual std::function<void()> detach_samples() {
+        // the buffers keep their capacity, so after the first pass around the ring
+        // nothing is allocated
+        const std::vector<T>* filled = &buffers[current];
+        current = (current+1) % int(buffers.size());
+        buffers[current].clear();
+
+        hid_t dset = data_set.get();
+        return [dset,filled]() {
+            if(filled->size()) h5::append_to_dset(dset, *filled, 0);
+        };
+    }
+
     virtual ~SpecializedSingleLogger() {
         dump_samples();
     }
@@ -71,45 +132,85 @@ struct H5Logger {
     h5::H5Obj logging_group;
     std::vector<std::unique_ptr<SingleLogger>> state_loggers;
     size_t n_samples_buffered;
+    uint64_t default_stride;  //!< stride of loggers added without an explicit stride
+    //! \brief H5Writer tickets of the flushes of each buffer of the ring, which has
+    //! queue_length+1 buffers so that queue_length flushes may wait for the writer
+    std::vector<uint64_t> write_tickets;
+    uint64_t n_flush;
 
     // H5Logger(): level(LOG_BASIC), config(0u), logging_group(0u), n_samples_buffered(0u) {}
 
-    H5Logger(h5::H5Obj& config_, const char* loc, LogLevel level_): 
+    H5Logger(h5::H5Obj& config_, const char* loc, LogLevel level_, int queue_length=1): 
         level(level_),
         config(h5::duplicate_obj(config_)),
         logging_group(h5::ensure_group(config.get(), loc)),
-        n_samples_buffered(0u)
+        n_samples_buffered(0u),
+        default_stride(1u),
+        write_tickets(queue_length+1, 0u),
+        n_flush(0u)
     {}
 
-    void collect_samples() {
-        Timer timer(std::string("logger"));
-        for(auto &sl: state_loggers) 
+    //! \brief True if any logger samples at this round
+    //!
+    //! The caller should evaluate the engine once before collect_samples, since the
+    //! loggers only read the results of the last evaluation.
+    bool sample_due(uint64_t round) const {
+        for(auto &sl: state_loggers)
+            if(!(round % sl->stride)) return true;
+        return false;
+    }
+
+    //! \brief Sample the loggers whose stride divides round
+    void collect_samples(uint64_t round) {
+        Timer timer("logger");
+        bool any_sampled = false;
+        for(auto &sl: state_loggers) {
+            if(round % sl->stride) continue;
             sl->collect_samples();
+            any_sampled = true;
+        }
+        if(!any_sampled) return;
 
         n_samples_buffered++;
         if(!(n_samples_buffered % 100)) flush();
     }
 
     void flush() {
-        // HDF5 is often built non-thread-safe, so we must serialize access with a OpenMP critical section
-        #pragma omp critical (hdf5_write_access)
-        {
-            if(n_samples_buffered) {
-                for(auto &sl: state_loggers) 
-                    sl->dump_samples();
-                n_samples_buffered = 0u;
-                H5Fflush(config.get(), H5F_SCOPE_LOCAL);
-            }
-        }
+        // The write itself happens on the H5Writer thread.  This only waits if the buffer filled
+        // next, detached queue_length flushes ago, is still being written.
+        if(!n_samples_buffered) return;
+        size_t n_buffers = write_tickets.size();
+        h5_writer().wait_for(write_tickets[(n_flush+1) % n_buffers]);
+
+        auto jobs = std::make_shared<std::vector<std::function<void()>>>();
+        for(auto &sl: state_loggers) 
+            jobs->push_back(sl->detach_samples());
+        n_samples_buffered = 0u;
+
+        hid_t file = config.get();
+        write_tickets[n_flush % n_buffers] = h5_writer().enqueue([jobs,file]() {
+                for(auto& job: *jobs) job();
+                H5Fflush(file, H5F_SCOPE_LOCAL);});
+        n_flush++;
     }
 
+    //! \brief Flush and wait until all samples are in the file
+    void flush_and_wait() {
+        flush();
+        h5_writer().drain();
+    }
+
+    //! \brief Add a logger sampled every stride rounds (default_stride if stride is 0)
     template <typename T, typename F>
     void add_logger(
             const char* relative_path, 
             const std::initializer_list<int>& data_shape, 
-            const F&& sample_function) {
+            const F&& sample_function,
+            uint64_t stride = 0u) {
         auto logger = std::unique_ptr<SingleLogger>(
-                new SpecializedSingleLogger<T,F>(logging_group.get(), relative_path, sample_function, data_shape));
+                new SpecializedSingleLogger<T,F>(logging_group.get(), relative_path, sample_function, data_shape,
+                    stride ? stride : default_stride, int(write_tickets.size()),
+                    int(n_flush % write_tickets.size())));
         state_loggers.emplace_back(std::move(logger));
     }
 
@@ -136,11 +237,18 @@ struct H5Logger {
     }
 
     virtual ~H5Logger() {
-        flush();
+        // datasets must outlive their write jobs
+        try {
+            flush_and_wait();
+        } catch(const std::string& e) {
+            fprintf(stderr, "ERROR: unable to write log data: %s\n", e.c_str());
+        }
     }
 };
 
-extern std::shared_ptr<H5Logger> default_logger;
+// Logger for the nodes being constructed on this thread, since systems may be
+// initialized in parallel
+extern thread_local std::shared_ptr<H5Logger> default_logger;
 
 static bool logging(LogLevel level) {
     if(!default_logger) return false; // cannot log without a defined logger
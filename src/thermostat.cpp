@@ -7,7 +7,7 @@
 using namespace std;
 
 void OrnsteinUhlenbeckThermostat::apply(VecArray mom, int n_atom) {
-    Timer timer(string("thermostat"));
+    Timer timer("thermostat");
 
     for(int na=0; na<n_atom; ++na) {
         RandomGenerator random(random_seed, THERMOSTAT_RANDOM_STREAM, na, n_invocations);
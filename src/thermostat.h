@@ -35,5 +35,9 @@ struct OrnsteinUhlenbeckThermostat
         OrnsteinUhlenbeckThermostat& set_delta_t  (float delta_t_)   {
             delta_t   = delta_t_;   update_parameters(); return *this;}
 
+        //! \brief Number of applications so far, which selects the random stream (for checkpoints)
+        uint64_t get_n_invocations() const {return n_invocations;}
+        void set_n_invocations(uint64_t n) {n_invocations = n;}
+
         void apply(VecArray mom, int n_atom); 
 };
@@ -6,56 +6,164 @@
 
 TimeKeeper global_time_keeper(1);
 
+#ifdef COLLECT_PROFILE
+thread_local int current_timer_replica = -1;
+#endif
+
 using namespace std;
 
+namespace {
+    struct TimerNames {
+        mutex mut;
+        vector<string> names;
+        unordered_map<string,int> ids;
+    };
+
+    TimerNames& timer_names() {
+        static TimerNames tn;
+        return tn;
+    }
+}
+
+int timer_id(const string& name) {
+    auto& tn = timer_names();
+    lock_guard<mutex> lock(tn.mut);
+    auto it = tn.ids.find(name);
+    if(it != tn.ids.end()) return it->second;
+
+    int id = tn.names.size();
+    tn.names.push_back(name);
+    tn.ids[name] = id;
+    return id;
+}
+
+int timer_id(const char* name) {
+    // string literals have a fixed address, so only the first use on each thread
+    // needs the locked lookup
+    thread_local unordered_map<const char*,int> cache;
+    auto it = cache.find(name);
+    if(it != cache.end()) return it->second;
+    return cache[name] = timer_id(string(name));
+}
+
+const string& timer_name(int id) {
+    auto& tn = timer_names();
+    lock_guard<mutex> lock(tn.mut);
+    return tn.names.at(id);
+}
+
+int n_timer_id() {
+    auto& tn = timer_names();
+    lock_guard<mutex> lock(tn.mut);
+    return tn.names.size();
+}
+
+
+TimeKeeper::ThreadRecords& TimeKeeper::records_for_this_thread() {
+    // a thread normally records into a single TimeKeeper, so a short list suffices
+    thread_local vector<pair<TimeKeeper*,ThreadRecords*>> by_keeper;
+    for(auto& p: by_keeper) if(p.first == this) return *p.second;
+
+    lock_guard<mutex> lock(mut);
+    thread_records.emplace_back(new ThreadRecords);
+    by_keeper.emplace_back(this, thread_records.back().get());
+    return *thread_records.back();
+}
+
+void TimeKeeper::add_time(const string &name, double t_elapsed) {
+#ifdef COLLECT_PROFILE
+    add_time(timer_id(name), current_timer_replica, t_elapsed);
+#else
+    add_time(timer_id(name), -1, t_elapsed);
+#endif
+}
+
 void TimeKeeper::print_report(int n_steps) {
     struct S {
-        string name; 
+        string name;
         TimeRecord rec;
         double avg_time;
         double steps_per_invocation;
         double contribution;
     };
 
-    vector<S> sorted_records;
-
-    double all_total = 0.;
-    for(auto &p: records) {
-        auto avg_time = p.second.total_elapsed / (p.second.n_invoke-n_ignore);
-        auto steps_per_invocation = double(n_steps) / p.second.n_invoke;
-        if(!(avg_time>0.)) avg_time = 0.;
+    // merge the per-thread records, both overall and for each replica
+    int n_id = n_timer_id();
+    vector<TimeRecord> total(n_id);
+    map<int,vector<TimeRecord>> replica_total;
+    {
+        lock_guard<mutex> lock(mut);
+        for(auto& tr: thread_records) {
+            for(int i=0; i<int(tr->by_replica.size()); ++i) {
+                auto& records = tr->by_replica[i];
+                int replica = i-1;
+                if(replica>=0 && records.size()) replica_total[replica].resize(n_id);
+                for(int id=0; id<int(records.size()); ++id) {
+                    auto& r = records[id];
+                    total[id].n_invoke      += r.n_invoke;
+                    total[id].total_elapsed += r.total_elapsed;
+                    if(replica>=0) {
+                        replica_total[replica][id].n_invoke      += r.n_invoke;
+                        replica_total[replica][id].total_elapsed += r.total_elapsed;
+                    }
+                }
+            }
+        }
+    }
 
-        sorted_records.emplace_back(); 
-        auto &s = sorted_records.back();
+    auto summarize = [&](const vector<TimeRecord>& records, double& all_total) {
+        vector<S> sorted_records;
+        all_total = 0.;
+        for(int id=0; id<int(records.size()); ++id) {
+            auto& rec = records[id];
+            if(!rec.n_invoke) continue;
+            auto avg_time = rec.total_elapsed / (rec.n_invoke-n_ignore);
+            auto steps_per_invocation = double(n_steps) / rec.n_invoke;
+            if(!(avg_time>0.)) avg_time = 0.;
+
+            sorted_records.emplace_back();
+            auto &s = sorted_records.back();
+
+            s.name = timer_name(id);
+            s.rec = rec;
+            s.avg_time = avg_time;
+            s.steps_per_invocation = steps_per_invocation;
+            s.contribution = s.avg_time / s.steps_per_invocation;
+            all_total += s.contribution;
+        }
+
+        sort(begin(sorted_records), end(sorted_records), [&](const S& s1, const S& s2) {
+                return s1.contribution!=s2.contribution ? s1.contribution > s2.contribution : s1.name < s2.name;});
+        return sorted_records;
+    };
 
-        s.name = p.first;
-        s.rec = p.second;
-        s.avg_time = avg_time;
-        s.steps_per_invocation = steps_per_invocation;
-        s.contribution = s.avg_time / s.steps_per_invocation;
-        all_total += s.contribution;
-    }
-    
-    sort(begin(sorted_records), end(sorted_records), [&](const S& s1, const S& s2) {
-            return s1.contribution!=s2.contribution ? s1.contribution > s2.contribution : s1.name < s2.name;});
+    double all_total;
+    auto sorted_records = summarize(total, all_total);
 
     int maxlen = 0;
     for(auto &p: sorted_records) maxlen = max(int(p.name.size()), maxlen);
 
     for(auto &p: sorted_records) {
-        printf("%*s  %6.1f us/step  (%4.1f%%, %7.2f invocations/step, %7.1f us/invocation)\n", 
-                maxlen, p.name.c_str(), 
-                p.contribution*1e6, 
+        printf("%*s  %6.1f us/step  (%4.1f%%, %7.2f invocations/step, %7.1f us/invocation)\n",
+                maxlen, p.name.c_str(),
+                p.contribution*1e6,
                 p.contribution/all_total*100.,
-                1.f/p.steps_per_invocation, 
+                1.f/p.steps_per_invocation,
                 p.avg_time*1e6);
     }
     printf("%*s  %6.1f us/step\n", maxlen, "(total)", all_total*1e6);
-}
-
-
-
-
-
-
 
+    // per replica totals with the largest contributions, to spot imbalanced replicas
+    if(replica_total.size() > 1u) {
+        printf("\n");
+        for(auto& rt: replica_total) {
+            double replica_all_total;
+            auto replica_records = summarize(rt.second, replica_all_total);
+            printf("replica %3i  %8.1f us/step ", rt.first, replica_all_total*1e6);
+            for(int i=0; i<min(3,int(replica_records.size())); ++i)
+                printf(" %s %.1f%%", replica_records[i].name.c_str(),
+                        replica_records[i].contribution/replica_all_total*100.);
+            printf("\n");
+        }
+    }
+}
@@ -4,9 +4,20 @@
 #include <unordered_map>
 #include <string>
 #include <chrono>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+// Timer names are interned into small integer ids.  The ids are shared by all
+// TimeKeeper's, and the lookup of a string literal is cached per thread by address,
+// so that a Timer costs two clock reads and an array update.
+int timer_id(const char* name);
+int timer_id(const std::string& name);
+const std::string& timer_name(int id);
+int n_timer_id();
 
 struct TimeKeeper {
-    // ignore some number of initial timing events to avoid cache-warming and 
+    // ignore some number of initial timing events to avoid cache-warming and
     // delayed-initialization effects as much as possible
     const int n_ignore;
 
@@ -15,35 +26,68 @@ struct TimeKeeper {
         double total_elapsed = 0.;
     };
 
+    // Each thread accumulates into its own records, indexed by [replica+1][timer id],
+    // where replica -1 is time outside of any replica.  The records are only merged
+    // by print_report, so recording needs no synchronization.
+    struct ThreadRecords {
+        std::vector<std::vector<TimeRecord>> by_replica;
+    };
+
+    std::mutex mut;  // protects thread_records
+    std::vector<std::unique_ptr<ThreadRecords>> thread_records;
+
     TimeKeeper(int n_ignore_ = -1): n_ignore(n_ignore_) {}
 
-    std::unordered_map<std::string, TimeRecord> records;
+    ThreadRecords& records_for_this_thread();
 
-    void add_time(const std::string &name, double t_elapsed) {
-        TimeRecord& record = records[name];
+    void add_time(int id, int replica, double t_elapsed) {
+        auto& by_replica = records_for_this_thread().by_replica;
+        if(int(by_replica.size()) <= replica+1) by_replica.resize(replica+2);
+        auto& records = by_replica[replica+1];
+        if(int(records.size()) <= id) records.resize(id+1);
+
+        TimeRecord& record = records[id];
         record.n_invoke++;
-        if(record.n_invoke<n_ignore) return; 
+        if(record.n_invoke<n_ignore) return;
         record.total_elapsed += t_elapsed;
     }
 
+    void add_time(const std::string &name, double t_elapsed);
+
+    // must not be called while other threads are recording
     void print_report(int n_steps);
 };
 extern TimeKeeper global_time_keeper;
 
 #ifdef COLLECT_PROFILE
+// replica whose work the current thread is doing, or -1
+extern thread_local int current_timer_replica;
+
+// Attribute all timers on this thread to a replica for the lifetime of the object
+struct ReplicaTimerScope {
+    int old_replica;
+    ReplicaTimerScope(int replica): old_replica(current_timer_replica) {current_timer_replica = replica;}
+    ~ReplicaTimerScope() {current_timer_replica = old_replica;}
+};
+
+static inline int timer_replica() {return current_timer_replica;}
+
 struct Timer {
     TimeKeeper &time_keeper;
-    const std::string name;
-    const std::chrono::time_point<std::chrono::high_resolution_clock> tstart;
+    const int id;
+    const std::chrono::time_point<std::chrono::steady_clock> tstart;
     bool  active;
 
-    Timer(const std::string &name_, TimeKeeper& time_keeper_ = global_time_keeper): 
-        time_keeper(time_keeper_), name(name_), tstart(std::chrono::high_resolution_clock::now()), active(true) {}
+    Timer(const char* name_, TimeKeeper& time_keeper_ = global_time_keeper):
+        time_keeper(time_keeper_), id(timer_id(name_)), tstart(std::chrono::steady_clock::now()), active(true) {}
+
+    Timer(const std::string &name_, TimeKeeper& time_keeper_ = global_time_keeper):
+        time_keeper(time_keeper_), id(timer_id(name_)), tstart(std::chrono::steady_clock::now()), active(true) {}
 
     void stop() {
         if(active) {
-            auto elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tstart).count();
-            time_keeper.add_time(name, elapsed);
+            auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tstart).count();
+            time_keeper.add_time(id, current_timer_replica, elapsed);
             active = false;
         }
     }
@@ -53,7 +97,14 @@ struct Timer {
     ~Timer() {stop();}
 };
 #else
+struct ReplicaTimerScope {
+    ReplicaTimerScope(int replica) {}
+};
+
+static inline int timer_replica() {return -1;}
+
 struct Timer {
+    Timer(const char* name_, TimeKeeper& time_keeper_ = global_time_keeper) {}
     Timer(const std::string &name_, TimeKeeper& time_keeper_ = global_time_keeper) {}
     void stop () {}
     void abort() {}
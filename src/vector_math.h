@@ -54,20 +54,27 @@ struct VecArray {
 };
 
 
+//! Deleter for arrays from new[], which does nothing for arrays owned by an arena
+struct ArrayDeleter {
+    bool owned;
+    ArrayDeleter(bool owned_=true): owned(owned_) {}
+    void operator()(float* p) const {if(owned) delete [] p;}
+};
+
 struct VecArrayStorage {
     int n_elem;
     int row_width;
-    std::unique_ptr<float[]> x;
+    std::unique_ptr<float[],ArrayDeleter> x;
 
     VecArrayStorage(int elem_width_, int n_elem_):
         n_elem(n_elem_), row_width(ru(elem_width_)),
-        x(new_aligned<float>(n_elem*row_width)) {
+        x(new_aligned<float>(n_elem*row_width).release()) {
             std::fill_n(x.get(), n_elem*row_width, 0.f);
         }
 
     VecArrayStorage(const VecArrayStorage& o):
         n_elem(o.n_elem), row_width(o.row_width),
-        x(new_aligned<float>(n_elem*row_width))
+        x(new_aligned<float>(n_elem*row_width).release())
     {
         std::copy_n(o.x.get(), n_elem*row_width, x.get());
     }
@@ -87,12 +94,21 @@ struct VecArrayStorage {
     void reset(int elem_width_, int n_elem_) {
         row_width = ru(elem_width_);
         n_elem = n_elem_;
-        x.reset(new float[n_elem*row_width]);
+        x = std::unique_ptr<float[],ArrayDeleter>(new float[n_elem*row_width]);
+    }
+
+    //! Number of floats in the storage
+    size_t size() const {return size_t(n_elem)*row_width;}
+
+    //! \brief Move the contents to dest, which must hold size() floats and outlive this storage
+    void move_to(float* dest) {
+        std::copy_n(x.get(), size(), dest);
+        x = std::unique_ptr<float[],ArrayDeleter>(dest, ArrayDeleter(false));
     }
 };
 
 
-static void copy(VecArrayStorage& v_src, VecArrayStorage& v_dst) {
+static void copy(const VecArrayStorage& v_src, VecArrayStorage& v_dst) {
     assert(v_src.n_elem    == v_dst.n_elem);
     assert(v_src.row_width == v_dst.row_width);
     std::copy_n(v_src.x.get(), v_src.n_elem*v_src.row_width, v_dst.x.get()); 
@@ -101,7 +117,11 @@ static void copy(VecArrayStorage& v_src, VecArrayStorage& v_dst) {
 inline void swap(VecArrayStorage& a, VecArrayStorage& b) {
     assert(a.n_elem==b.n_elem);
     assert(a.row_width==b.row_width);
-    a.x.swap(b.x);
+    // arena memory must stay with its owner (e.g. for replica exchange of positions)
+    if(a.x.get_deleter().owned && b.x.get_deleter().owned)
+        a.x.swap(b.x);
+    else
+        std::swap_ranges(a.x.get(), a.x.get()+a.size(), b.x.get());
 }
 
 static void fill(VecArrayStorage& v, float fill_value) {